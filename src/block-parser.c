@@ -0,0 +1,346 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/*
+ * Splitting the xzibit stream into blocks.
+ *
+ * Copyright (c) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "block-parser.h"
+#include <string.h>
+
+#define HEADER_LENGTH 4
+#define LONG_HEADER_LENGTH 8
+
+/**
+ * In a short header, this length means that the real
+ * length follows, once long blocks are allowed.
+ */
+#define LONG_LENGTH_MARKER 0xFFFF
+
+struct _BlockParser {
+  /**
+   * The greeting we expect, and how much of it
+   * we've seen so far.
+   */
+  gchar *greeting;
+  gsize greeting_length;
+  gsize greeting_seen;
+  /**
+   * The header of the current block, if it's arrived
+   * in pieces, and how much of it we have.
+   */
+  guchar header[LONG_HEADER_LENGTH];
+  gsize header_seen;
+  /**
+   * The longest block allowed, or zero if long
+   * blocks haven't been allowed.
+   */
+  gsize max_length;
+  /**
+   * Whether we're in the payload of a block, and
+   * that block's channel and length.
+   */
+  gboolean in_payload;
+  int channel;
+  gsize length;
+  /**
+   * The part of the payload we have, if it's arriving
+   * in pieces.  This is kept between blocks, and only
+   * ever grows.
+   */
+  guchar *buffer;
+  gsize buffer_size;
+  gsize buffer_used;
+  /**
+   * A bit for each channel, set if the channel is streamed.
+   */
+  guint32 streamed[65536/32];
+  /**
+   * Whether the current block is on a streamed channel.
+   */
+  gboolean streaming;
+
+  BlockParserGreetingCb greeting_cb;
+  BlockParserBlockCb block_cb;
+  BlockParserSpanCb span_cb;
+  gpointer user_data;
+};
+
+BlockParser*
+block_parser_new (const char *greeting,
+                  BlockParserGreetingCb greeting_cb,
+                  BlockParserBlockCb block_cb,
+                  gpointer user_data)
+{
+  BlockParser *result = g_malloc0 (sizeof (BlockParser));
+
+  result->greeting = g_strdup (greeting? greeting: "");
+  result->greeting_length = strlen (result->greeting);
+  result->greeting_cb = greeting_cb;
+  result->block_cb = block_cb;
+  result->user_data = user_data;
+
+  return result;
+}
+
+/**
+ * Returns how long a header is, given "available"
+ * bytes of it.
+ */
+static gsize
+header_length (BlockParser *parser,
+               const guchar *header,
+               gsize available)
+{
+  if (parser->max_length &&
+      available >= HEADER_LENGTH &&
+      (header[2] | header[3] << 8) == LONG_LENGTH_MARKER)
+    return LONG_HEADER_LENGTH;
+  else
+    return HEADER_LENGTH;
+}
+
+/**
+ * Starts a block, given its whole header.
+ *
+ * \return  FALSE if the block is too long.
+ */
+static gboolean
+start_block (BlockParser *parser,
+             const guchar *header)
+{
+  parser->channel = header[0] | header[1] << 8;
+  parser->length = header[2] | header[3] << 8;
+
+  if (parser->max_length && parser->length == LONG_LENGTH_MARKER)
+    {
+      parser->length = header[4] | header[5] << 8 |
+        header[6] << 16 | (gsize) header[7] << 24;
+
+      if (parser->length > parser->max_length)
+        return FALSE;
+    }
+
+  parser->in_payload = TRUE;
+  parser->buffer_used = 0;
+  parser->streaming = parser->span_cb &&
+    (parser->streamed[parser->channel/32] & (1U << (parser->channel%32)));
+
+  return TRUE;
+}
+
+static void
+finish_block (BlockParser *parser,
+              const guchar *payload)
+{
+  parser->in_payload = FALSE;
+  parser->block_cb (parser->channel,
+                    payload,
+                    parser->length,
+                    parser->user_data);
+}
+
+gboolean
+block_parser_feed (BlockParser *parser,
+                   const guchar *data,
+                   gsize length)
+{
+  gsize count;
+
+  while (length)
+    {
+      if (parser->greeting_seen < parser->greeting_length)
+        {
+          count = MIN (length,
+                       parser->greeting_length - parser->greeting_seen);
+
+          if (memcmp (data,
+                      parser->greeting + parser->greeting_seen,
+                      count)!=0)
+            return FALSE;
+
+          parser->greeting_seen += count;
+          data += count;
+          length -= count;
+
+          if (parser->greeting_seen == parser->greeting_length &&
+              parser->greeting_cb)
+            parser->greeting_cb (parser->user_data);
+
+          continue;
+        }
+
+      if (!parser->in_payload)
+        {
+          if (parser->header_seen==0 &&
+              length >= header_length (parser, data, length))
+            {
+              /* the usual case: the header is all here */
+              count = header_length (parser, data, length);
+              if (!start_block (parser, data))
+                return FALSE;
+              data += count;
+              length -= count;
+            }
+          else
+            {
+              count = MIN (length,
+                           header_length (parser,
+                                          parser->header,
+                                          parser->header_seen) -
+                           parser->header_seen);
+              memcpy (parser->header + parser->header_seen, data, count);
+              parser->header_seen += count;
+              data += count;
+              length -= count;
+
+              /* If that was the short part of a long header,
+               * we go round again for the rest.
+               */
+              if (parser->header_seen < header_length (parser,
+                                                       parser->header,
+                                                       parser->header_seen))
+                continue;
+
+              parser->header_seen = 0;
+              if (!start_block (parser, parser->header))
+                return FALSE;
+            }
+        }
+
+      if (parser->streaming)
+        {
+          if (parser->length==0)
+            {
+              parser->in_payload = FALSE;
+              continue;
+            }
+
+          if (length==0)
+            break;
+
+          count = MIN (length, parser->length);
+          parser->span_cb (parser->channel,
+                           data,
+                           count,
+                           parser->user_data);
+          data += count;
+          length -= count;
+          block_parser_skip (parser, count);
+          continue;
+        }
+
+      if (parser->buffer_used==0 && length >= parser->length)
+        {
+          /* The whole payload is here, so it can go
+           * straight from the caller's buffer.
+           */
+          count = parser->length;
+          finish_block (parser, data);
+          data += count;
+          length -= count;
+          continue;
+        }
+
+      if (parser->buffer_size < parser->length)
+        {
+          parser->buffer_size = parser->length;
+          parser->buffer = g_realloc (parser->buffer,
+                                      parser->buffer_size);
+        }
+
+      count = MIN (length, parser->length - parser->buffer_used);
+      memcpy (parser->buffer + parser->buffer_used, data, count);
+      parser->buffer_used += count;
+      data += count;
+      length -= count;
+
+      if (parser->buffer_used == parser->length)
+        finish_block (parser, parser->buffer);
+    }
+
+  return TRUE;
+}
+
+void
+block_parser_allow_long_blocks (BlockParser *parser,
+                                gsize max_length)
+{
+  parser->max_length = max_length;
+}
+
+void
+block_parser_set_span_cb (BlockParser *parser,
+                          BlockParserSpanCb span_cb)
+{
+  parser->span_cb = span_cb;
+}
+
+void
+block_parser_set_streamed (BlockParser *parser,
+                           int channel,
+                           gboolean streamed)
+{
+  g_return_if_fail (channel >= 0 && channel < 65536);
+
+  if (streamed)
+    parser->streamed[channel/32] |= 1U << (channel%32);
+  else
+    parser->streamed[channel/32] &= ~(1U << (channel%32));
+}
+
+gsize
+block_parser_get_pending (BlockParser *parser,
+                          int *channel)
+{
+  if (!parser->in_payload || !parser->streaming)
+    return 0;
+
+  if (channel)
+    *channel = parser->channel;
+
+  return parser->length;
+}
+
+void
+block_parser_skip (BlockParser *parser,
+                   gsize length)
+{
+  g_return_if_fail (parser->in_payload && parser->streaming);
+  g_return_if_fail (length <= parser->length);
+
+  /* While streaming, "length" counts down what's left. */
+  parser->length -= length;
+
+  if (parser->length==0)
+    parser->in_payload = FALSE;
+}
+
+void
+block_parser_free (BlockParser *parser)
+{
+  if (!parser)
+    return;
+
+  g_free (parser->greeting);
+  g_free (parser->buffer);
+  g_free (parser);
+}
+
+/* eof block-parser.c */
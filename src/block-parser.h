@@ -0,0 +1,137 @@
+#ifndef BLOCK_PARSER_H
+#define BLOCK_PARSER_H 1
+
+#include <glib.h>
+
+/**
+ * Splits an xzibit stream into blocks.  The stream
+ * starts with a greeting string, and is then a series
+ * of blocks, each with a four-byte header giving its
+ * channel and length.
+ *
+ * Once both sides have agreed to it, a block may
+ * instead have an eight-byte header: the channel, the
+ * short length 0xFFFF, and then a four-byte length.
+ *
+ * Blocks which arrive whole in one read are handed on
+ * where they lie, without being copied.  Blocks which
+ * straddle reads are gathered in a buffer which is
+ * kept from one block to the next.
+ */
+typedef struct _BlockParser BlockParser;
+
+/**
+ * The longest block we accept once long blocks have
+ * been agreed, and so what we tell the other side.
+ */
+#define BLOCK_PARSER_LONG_MAX (1024*1024)
+
+/**
+ * The longest block which can have a short header once
+ * long blocks have been offered; 0xFFFF is kept to mark
+ * a long header.
+ */
+#define BLOCK_PARSER_SHORT_MAX 0xFFFE
+
+/**
+ * Called once the whole greeting has arrived.
+ */
+typedef void (*BlockParserGreetingCb) (gpointer user_data);
+
+/**
+ * Called with each block.  "payload" is only valid
+ * until the callback returns.
+ */
+typedef void (*BlockParserBlockCb) (int channel,
+				    const guchar *payload,
+				    gsize length,
+				    gpointer user_data);
+
+/**
+ * Called with each piece of a block on a streamed
+ * channel, as it arrives; see block_parser_set_streamed().
+ * "data" is only valid until the callback returns.
+ */
+typedef void (*BlockParserSpanCb) (int channel,
+				   const guchar *data,
+				   gsize length,
+				   gpointer user_data);
+
+/**
+ * Creates a parser.
+ *
+ * \param greeting     The string the stream must start
+ *                     with; may be NULL if there is none.
+ * \param greeting_cb  Called when the greeting has arrived;
+ *                     may be NULL.
+ * \param block_cb     Called with each block.
+ * \param user_data    User data for the callbacks.
+ */
+BlockParser *block_parser_new (const char *greeting,
+			       BlockParserGreetingCb greeting_cb,
+			       BlockParserBlockCb block_cb,
+			       gpointer user_data);
+
+/**
+ * Feeds some of the stream to the parser, which calls
+ * the callbacks for whatever it completes.
+ *
+ * \return  FALSE if the stream didn't start with the
+ *          greeting, or a block was longer than allowed;
+ *          nothing more should be fed.
+ */
+gboolean block_parser_feed (BlockParser *parser,
+			    const guchar *data,
+			    gsize length);
+
+/**
+ * Allows blocks with long headers from here on in the
+ * stream.  This may be called from the block callback,
+ * and takes effect from the next block.
+ *
+ * \param max_length  The longest block to accept.
+ */
+void block_parser_allow_long_blocks (BlockParser *parser,
+				     gsize max_length);
+
+/**
+ * Sets the callback for streamed channels.
+ */
+void block_parser_set_span_cb (BlockParser *parser,
+			       BlockParserSpanCb span_cb);
+
+/**
+ * Sets whether a channel is streamed.  Blocks on a
+ * streamed channel are never gathered up: each piece
+ * of the payload goes to the span callback as soon as
+ * it arrives, and the block callback isn't called.
+ * This suits channels which carry a byte stream, where
+ * block boundaries don't matter.
+ */
+void block_parser_set_streamed (BlockParser *parser,
+				int channel,
+				gboolean streamed);
+
+/**
+ * If the parser is part-way through the payload of a
+ * block on a streamed channel, returns how much of it
+ * is still to come, and sets *channel to its channel.
+ * Otherwise returns zero.  The caller may then move up
+ * to that many bytes of the stream itself, without
+ * passing them through the parser, as long as it calls
+ * block_parser_skip() to say so.
+ */
+gsize block_parser_get_pending (BlockParser *parser,
+				int *channel);
+
+/**
+ * Tells the parser that the caller has dealt with
+ * "length" bytes of a streamed payload itself; see
+ * block_parser_get_pending().
+ */
+void block_parser_skip (BlockParser *parser,
+			gsize length);
+
+void block_parser_free (BlockParser *parser);
+
+#endif /* !BLOCK_PARSER_H */
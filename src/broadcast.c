@@ -0,0 +1,508 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/*
+ * Showing one RFB stream to several viewers.
+ *
+ * Copyright (c) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "broadcast.h"
+#include <string.h>
+
+/**
+ * The length of the ProtocolVersion message,
+ * "RFB 003.008\n".
+ */
+#define VERSION_LENGTH 12
+
+/**
+ * Client-to-server RFB message types.
+ */
+#define RFB_SET_PIXEL_FORMAT 0
+#define RFB_SET_ENCODINGS 2
+#define RFB_UPDATE_REQUEST 3
+#define RFB_KEY_EVENT 4
+#define RFB_POINTER_EVENT 5
+#define RFB_CUT_TEXT 6
+
+#define SET_PIXEL_FORMAT_LENGTH 20
+
+/**
+ * What message_length() says about a message we
+ * don't know.
+ */
+#define UNKNOWN_LENGTH G_MAXSIZE
+
+/**
+ * Part of the stream.  Each is as long as one read
+ * from the server.
+ */
+typedef struct _BroadcastChunk {
+  /**
+   * How many viewers still want this chunk, plus one
+   * if we're keeping it for viewers who join later.
+   * Since viewers go through the chunks in order,
+   * the chunks nobody wants are at the front.
+   */
+  guint refs;
+  gsize length;
+  guchar *data;
+} BroadcastChunk;
+
+struct _Broadcast {
+  /**
+   * The chunks of the stream we still have, oldest first.
+   */
+  GQueue *chunks;
+  /**
+   * How far into the stream the first chunk starts,
+   * and how far it goes.
+   */
+  gsize start;
+  gsize end;
+
+  gboolean joinable;
+  gsize history_limit;
+
+  GList *viewers;
+
+  /**
+   * How many steps of the handshake have gone to
+   * the server.
+   */
+  guint handshake_sent;
+  /**
+   * The ProtocolVersion the server was sent.
+   */
+  guchar version[VERSION_LENGTH];
+  /**
+   * The SetPixelFormat the server was sent, if any.
+   */
+  gboolean have_pixel_format;
+  guchar pixel_format[SET_PIXEL_FORMAT_LENGTH];
+  /**
+   * Whether the server has been sent SetEncodings.
+   */
+  gboolean encodings_sent;
+};
+
+struct _BroadcastViewer {
+  Broadcast *broadcast;
+  /**
+   * The link in the broadcast's chunks of the chunk
+   * this viewer is in, and how far into it; NULL if
+   * the viewer has had everything.
+   */
+  GList *chunk;
+  gsize offset;
+  /**
+   * How far into the stream the viewer is.
+   */
+  gsize position;
+
+  /**
+   * Part of a message from the viewer, if it's
+   * arriving in pieces.
+   */
+  GByteArray *input;
+  /**
+   * How many steps of the handshake the viewer has
+   * taken, and how many there are.  We know there are
+   * three until we see the ProtocolVersion.
+   */
+  guint handshake_seen;
+  guint handshake_length;
+  /**
+   * Set if the viewer sent something we didn't
+   * understand, after which we ignore it.
+   */
+  gboolean lost;
+  gboolean compatible;
+};
+
+Broadcast*
+broadcast_new (gsize history_limit)
+{
+  Broadcast *result = g_malloc0 (sizeof (Broadcast));
+
+  result->chunks = g_queue_new ();
+  result->joinable = TRUE;
+  result->history_limit = history_limit;
+
+  return result;
+}
+
+/**
+ * Frees the chunks at the front which nobody wants.
+ */
+static void
+release_chunks (Broadcast *broadcast)
+{
+  BroadcastChunk *chunk;
+
+  while ((chunk = g_queue_peek_head (broadcast->chunks)) &&
+         chunk->refs==0)
+    {
+      g_queue_pop_head (broadcast->chunks);
+      broadcast->start += chunk->length;
+      g_free (chunk->data);
+      g_free (chunk);
+    }
+}
+
+/**
+ * Lets go of a chunk and all the chunks after it,
+ * starting with the link "from".
+ */
+static void
+unref_chunks (Broadcast *broadcast,
+              GList *from)
+{
+  for (; from; from = from->next)
+    ((BroadcastChunk*) from->data)->refs--;
+
+  release_chunks (broadcast);
+}
+
+void
+broadcast_append (Broadcast *broadcast,
+                  const guchar *data,
+                  gsize length)
+{
+  BroadcastChunk *chunk;
+  GList *cursor;
+
+  if (length==0)
+    return;
+
+  chunk = g_malloc (sizeof (BroadcastChunk));
+  chunk->refs = g_list_length (broadcast->viewers) +
+    (broadcast->joinable? 1: 0);
+  chunk->length = length;
+  chunk->data = g_memdup (data, length);
+
+  g_queue_push_tail (broadcast->chunks, chunk);
+  broadcast->end += length;
+
+  for (cursor = broadcast->viewers; cursor; cursor = cursor->next)
+    {
+      BroadcastViewer *viewer = cursor->data;
+
+      if (!viewer->chunk)
+        {
+          viewer->chunk = g_queue_peek_tail_link (broadcast->chunks);
+          viewer->offset = 0;
+        }
+    }
+
+  if (broadcast->joinable &&
+      broadcast->end > broadcast->history_limit)
+    broadcast_stop_joining (broadcast);
+
+  /* With nobody to see it and nobody to come, it can go
+   * straight away.
+   */
+  release_chunks (broadcast);
+}
+
+void
+broadcast_stop_joining (Broadcast *broadcast)
+{
+  if (!broadcast->joinable)
+    return;
+
+  broadcast->joinable = FALSE;
+  unref_chunks (broadcast, broadcast->chunks->head);
+}
+
+gboolean
+broadcast_is_joinable (Broadcast *broadcast)
+{
+  return broadcast->joinable;
+}
+
+gsize
+broadcast_get_lag (Broadcast *broadcast)
+{
+  GList *cursor;
+  gsize lag = 0;
+
+  for (cursor = broadcast->viewers; cursor; cursor = cursor->next)
+    {
+      BroadcastViewer *viewer = cursor->data;
+
+      lag = MAX (lag, broadcast->end - viewer->position);
+    }
+
+  return lag;
+}
+
+void
+broadcast_free (Broadcast *broadcast)
+{
+  if (!broadcast)
+    return;
+
+  g_return_if_fail (broadcast->viewers==NULL);
+
+  broadcast_stop_joining (broadcast);
+  g_queue_free (broadcast->chunks);
+  g_free (broadcast);
+}
+
+BroadcastViewer*
+broadcast_viewer_new (Broadcast *broadcast)
+{
+  BroadcastViewer *result;
+  GList *cursor;
+
+  if (!broadcast->joinable)
+    return NULL;
+
+  result = g_malloc0 (sizeof (BroadcastViewer));
+  result->broadcast = broadcast;
+  result->chunk = broadcast->chunks->head;
+  result->input = g_byte_array_new ();
+  result->handshake_length = 3;
+  result->compatible = TRUE;
+
+  for (cursor = broadcast->chunks->head; cursor; cursor = cursor->next)
+    ((BroadcastChunk*) cursor->data)->refs++;
+
+  broadcast->viewers = g_list_append (broadcast->viewers, result);
+
+  return result;
+}
+
+gsize
+broadcast_viewer_peek (BroadcastViewer *viewer,
+                       const guchar **data)
+{
+  BroadcastChunk *chunk;
+
+  if (!viewer->chunk)
+    return 0;
+
+  chunk = viewer->chunk->data;
+  *data = chunk->data + viewer->offset;
+
+  return chunk->length - viewer->offset;
+}
+
+void
+broadcast_viewer_consume (BroadcastViewer *viewer,
+                          gsize length)
+{
+  Broadcast *broadcast = viewer->broadcast;
+
+  while (length && viewer->chunk)
+    {
+      BroadcastChunk *chunk = viewer->chunk->data;
+      gsize count = MIN (length, chunk->length - viewer->offset);
+
+      viewer->offset += count;
+      viewer->position += count;
+      length -= count;
+
+      if (viewer->offset == chunk->length)
+        {
+          viewer->chunk = viewer->chunk->next;
+          viewer->offset = 0;
+          chunk->refs--;
+        }
+    }
+
+  release_chunks (broadcast);
+}
+
+/**
+ * Returns how long the message at the start of
+ * "message" is, given "available" bytes of it; 0 if
+ * we can't tell yet; UNKNOWN_LENGTH if we can't tell
+ * at all.
+ */
+static gsize
+message_length (BroadcastViewer *viewer,
+                const guchar *message,
+                gsize available)
+{
+  if (viewer->handshake_seen < viewer->handshake_length)
+    return viewer->handshake_seen==0? VERSION_LENGTH: 1;
+
+  switch (message[0])
+    {
+    case RFB_SET_PIXEL_FORMAT:
+      return SET_PIXEL_FORMAT_LENGTH;
+
+    case RFB_SET_ENCODINGS:
+      if (available < 4)
+        return 0;
+      return 4 + 4 * (message[2] << 8 | message[3]);
+
+    case RFB_UPDATE_REQUEST:
+      return 10;
+
+    case RFB_KEY_EVENT:
+      return 8;
+
+    case RFB_POINTER_EVENT:
+      return 6;
+
+    case RFB_CUT_TEXT:
+      if (available < 8)
+        return 0;
+      return 8 + ((gsize) message[4] << 24 | message[5] << 16 |
+                  message[6] << 8 | message[7]);
+
+    default:
+      return UNKNOWN_LENGTH;
+    }
+}
+
+/**
+ * Decides what to do with one whole message from
+ * a viewer.
+ */
+static void
+handle_message (BroadcastViewer *viewer,
+                const guchar *message,
+                gsize length,
+                GByteArray *out)
+{
+  Broadcast *broadcast = viewer->broadcast;
+
+  if (viewer->handshake_seen < viewer->handshake_length)
+    {
+      if (viewer->handshake_seen==0)
+        {
+          /* "RFB 003.00x\n": before 3.7, there's no
+           * choice of security type to send.
+           */
+          int minor = (message[8]-'0')*100 +
+            (message[9]-'0')*10 +
+            (message[10]-'0');
+
+          if (minor < 7)
+            viewer->handshake_length = 2;
+
+          if (broadcast->handshake_sent==0)
+            memcpy (broadcast->version, message, VERSION_LENGTH);
+          else if (memcmp (broadcast->version, message, VERSION_LENGTH)!=0)
+            viewer->compatible = FALSE;
+        }
+
+      /* Every viewer's answers are the same, so the
+       * first one there answers for all of them.
+       */
+      if (viewer->handshake_seen == broadcast->handshake_sent)
+        {
+          g_byte_array_append (out, message, length);
+          broadcast->handshake_sent++;
+        }
+
+      viewer->handshake_seen++;
+      return;
+    }
+
+  switch (message[0])
+    {
+    case RFB_SET_PIXEL_FORMAT:
+      if (!broadcast->have_pixel_format)
+        {
+          memcpy (broadcast->pixel_format, message, length);
+          broadcast->have_pixel_format = TRUE;
+          g_byte_array_append (out, message, length);
+        }
+      else if (memcmp (broadcast->pixel_format, message, length)!=0)
+        viewer->compatible = FALSE;
+      break;
+
+    case RFB_SET_ENCODINGS:
+      /* The window's encoding policy chooses the
+       * encoding anyway; see vnc.c.
+       */
+      if (!broadcast->encodings_sent)
+        {
+          broadcast->encodings_sent = TRUE;
+          g_byte_array_append (out, message, length);
+        }
+      break;
+
+    default:
+      g_byte_array_append (out, message, length);
+    }
+}
+
+void
+broadcast_viewer_filter_input (BroadcastViewer *viewer,
+                               const guchar *data,
+                               gsize length,
+                               GByteArray *out)
+{
+  GByteArray *input = viewer->input;
+
+  if (viewer->lost)
+    return;
+
+  g_byte_array_append (input, data, length);
+
+  while (input->len)
+    {
+      gsize needed = message_length (viewer, input->data, input->len);
+
+      if (needed==UNKNOWN_LENGTH)
+        {
+          g_warning ("Viewer sent RFB message type %d, which we don't know; "
+                     "ignoring it from now on",
+                     input->data[0]);
+          viewer->lost = TRUE;
+          g_byte_array_set_size (input, 0);
+          return;
+        }
+
+      if (needed==0 || needed > input->len)
+        break;
+
+      handle_message (viewer, input->data, needed, out);
+      g_byte_array_remove_range (input, 0, needed);
+    }
+}
+
+gboolean
+broadcast_viewer_is_compatible (BroadcastViewer *viewer)
+{
+  return viewer->compatible;
+}
+
+void
+broadcast_viewer_free (BroadcastViewer *viewer)
+{
+  Broadcast *broadcast;
+
+  if (!viewer)
+    return;
+
+  broadcast = viewer->broadcast;
+  broadcast->viewers = g_list_remove (broadcast->viewers, viewer);
+  unref_chunks (broadcast, viewer->chunk);
+
+  g_byte_array_free (viewer->input, TRUE);
+  g_free (viewer);
+}
+
+/* eof broadcast.c */
@@ -0,0 +1,126 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H 1
+
+#include <glib.h>
+
+/**
+ * One RFB stream from libvncserver, shown to several
+ * viewers.  What the server sends is kept once, in
+ * chunks which are freed when every viewer has had
+ * them; each viewer only has its place in the stream.
+ *
+ * A viewer can only make sense of the stream from its
+ * beginning, so viewers can only join while we still
+ * have all of it.  That stops when it grows past the
+ * history limit, or when the owner says so.
+ *
+ * The server thinks it has one client, so what the
+ * viewers send has to look like what one client would
+ * send: see broadcast_viewer_filter_input().
+ */
+typedef struct _Broadcast Broadcast;
+
+/**
+ * A viewer of a broadcast.
+ */
+typedef struct _BroadcastViewer BroadcastViewer;
+
+/**
+ * Creates a broadcast which can be joined.
+ *
+ * \param history_limit  How much of the stream we keep
+ *                       for viewers who join late.
+ */
+Broadcast *broadcast_new (gsize history_limit);
+
+/**
+ * Adds bytes the server has sent to the stream.
+ */
+void broadcast_append (Broadcast *broadcast,
+		       const guchar *data,
+		       gsize length);
+
+/**
+ * Stops viewers joining, so that what every viewer
+ * has had can be freed.
+ */
+void broadcast_stop_joining (Broadcast *broadcast);
+
+/**
+ * Returns whether viewers can still join.
+ */
+gboolean broadcast_is_joinable (Broadcast *broadcast);
+
+/**
+ * Returns how far the slowest viewer is behind the
+ * server, in bytes.
+ */
+gsize broadcast_get_lag (Broadcast *broadcast);
+
+/**
+ * Frees a broadcast.  Every viewer must have been
+ * freed first.
+ */
+void broadcast_free (Broadcast *broadcast);
+
+/**
+ * Adds a viewer, which starts at the beginning of
+ * the stream.
+ *
+ * \return  The viewer, or NULL if the broadcast can't
+ *          be joined.
+ */
+BroadcastViewer *broadcast_viewer_new (Broadcast *broadcast);
+
+/**
+ * Finds the next bytes of the stream a viewer hasn't
+ * had.  They stay where they are until the viewer
+ * consumes them.
+ *
+ * \param viewer  The viewer.
+ * \param data    Set to the bytes.
+ * \return        How many bytes there are; 0 if the
+ *                viewer has had everything.
+ */
+gsize broadcast_viewer_peek (BroadcastViewer *viewer,
+			     const guchar **data);
+
+/**
+ * Moves a viewer on through the stream, after it has
+ * had "length" bytes found by broadcast_viewer_peek().
+ */
+void broadcast_viewer_consume (BroadcastViewer *viewer,
+			       gsize length);
+
+/**
+ * Takes RFB a viewer has sent to the server, and adds
+ * the parts the server should see to "out".  Each step
+ * of the handshake is passed on once, from whichever
+ * viewer gets there first.  So is the first pixel
+ * format and the first list of encodings; after that,
+ * viewers asking for a different pixel format are no
+ * longer compatible.  Everything else is passed on.
+ *
+ * \param viewer  The viewer.
+ * \param data    What it sent.
+ * \param length  How much it sent.
+ * \param out     Where to put what the server should see.
+ */
+void broadcast_viewer_filter_input (BroadcastViewer *viewer,
+				    const guchar *data,
+				    gsize length,
+				    GByteArray *out);
+
+/**
+ * Returns whether a viewer can understand the stream,
+ * as far as we know from what it has sent.
+ */
+gboolean broadcast_viewer_is_compatible (BroadcastViewer *viewer);
+
+/**
+ * Frees a viewer, and whatever part of the stream only
+ * it was waiting for.
+ */
+void broadcast_viewer_free (BroadcastViewer *viewer);
+
+#endif /* !BROADCAST_H */
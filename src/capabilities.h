@@ -0,0 +1,41 @@
+#ifndef CAPABILITIES_H
+#define CAPABILITIES_H 1
+
+/**
+ * Bits in the map sent in a CAPABILITIES message on the
+ * control channel; see doc/protocol.txt.  Bits we don't
+ * know about are ignored.
+ */
+
+/**
+ * Understands FRAMING, and so long blocks.
+ */
+#define CAPABILITY_LONG_BLOCKS      0x00000001
+/**
+ * Understands CREDIT, and so per-channel flow control.
+ */
+#define CAPABILITY_CREDIT           0x00000002
+/**
+ * Can carry blocks through shared memory when both
+ * sides are on the same machine.
+ */
+#define CAPABILITY_SHARED_MEMORY    0x00000004
+/**
+ * Can accept blocks compressed with zlib.
+ */
+#define CAPABILITY_CODEC_ZLIB       0x00000100
+
+/**
+ * What this version of xzibit supports.
+ */
+#define CAPABILITIES_SUPPORTED (CAPABILITY_LONG_BLOCKS | \
+				CAPABILITY_CREDIT)
+
+/**
+ * The length of a CAPABILITIES message we send: the
+ * opcode and the map.  The longest block we accept
+ * goes in FRAMING.
+ */
+#define CAPABILITIES_MESSAGE_LENGTH 5
+
+#endif /* !CAPABILITIES_H */
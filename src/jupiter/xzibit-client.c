@@ -49,6 +49,7 @@ struct _XzibitClient {
   GHashTable *vnc_fds;
   GHashTable *audio_channels;
   guint32 respawn_id;
+  guint32 peer_capabilities;
 };
 
 #define CONTROL_CHANNEL 0
@@ -61,6 +62,11 @@ struct _XzibitClient {
 #define COMMAND_AVATAR 6
 #define COMMAND_LISTEN 7
 #define COMMAND_MOUSE 8
+#define COMMAND_CAPABILITIES 11
+
+/* We support none of the optional extensions, so we
+ * never send FRAMING and only take ordinary blocks. */
+#define CAPABILITIES_SUPPORTED 0
 
 #define METADATA_TRANSIENCY 1
 #define METADATA_TITLE 2
@@ -76,6 +82,14 @@ static void send_byte (XzibitClient *client, guint8 byte);
 static void
 received_header (XzibitClient *client)
 {
+  send_block_header (client,
+                     CONTROL_CHANNEL,
+                     5);
+
+  send_byte (client, COMMAND_CAPABILITIES);
+  send_word (client, CAPABILITIES_SUPPORTED & 0xFFFF);
+  send_word (client, CAPABILITIES_SUPPORTED >> 16);
+
   send_block_header (client,
                      CONTROL_CHANNEL,
                      5);
@@ -136,7 +150,17 @@ received_from_xzibit (GIOChannel *source,
 	      client->buffer[client->state] = buffer[i];
 	      if (client->state==client->length-1)
 		{
-                  if (client->channel==CONTROL_CHANNEL)
+                  if (client->channel==CONTROL_CHANNEL &&
+                      client->length >= 5 &&
+                      client->buffer[0]==COMMAND_CAPABILITIES)
+                    {
+                      guchar *map = (guchar*) client->buffer + 1;
+
+                      client->peer_capabilities =
+                        map[0] | map[1] << 8 | map[2] << 16 |
+                        (guint32) map[3] << 24;
+                    }
+                  else if (client->channel==CONTROL_CHANNEL)
                     {
                       g_print ("Received control message (FIXME)\n");
                     }
@@ -327,6 +351,7 @@ xzibit_client_new_from_fd (int fd)
   result->buffer = NULL;
   result->highest_channel = 0;
   result->respawn_id = random();
+  result->peer_capabilities = 0;
 
   result->vnc_servers =
     g_hash_table_new_full (g_int_hash,
@@ -0,0 +1,821 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/*
+ * Coalescing output buffers for xzibit's sockets.
+ *
+ * Copyright (c) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "output-queue.h"
+#include "block-parser.h"
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+/**
+ * Small writes are copied into chunks of this size,
+ * so that a run of them costs one iovec.
+ */
+#define CHUNK_SIZE 65536
+
+/**
+ * The most chunks we hand to one writev().
+ */
+#define MAX_IOVECS 64
+
+/**
+ * What a channel of weight 1 may send in each round
+ * of a class: one whole piece, header and all.
+ */
+#define QUANTUM (OUTPUT_QUEUE_PIECE + 8)
+
+/**
+ * A block which has been queued in some class, but
+ * not yet committed to going out next.
+ */
+typedef struct {
+  GByteArray *data;
+  /**
+   * When it was queued, by the queue's timer.
+   */
+  double queued_at;
+} PendingBlock;
+
+/**
+ * The blocks waiting in one class for one channel.
+ */
+typedef struct {
+  int channel;
+  /**
+   * PendingBlocks, oldest first.  Never empty: a flow
+   * is freed as soon as it has nothing waiting.
+   */
+  GQueue *blocks;
+  /**
+   * How many bytes the channel may still send before
+   * the next channel in the class gets a turn.
+   */
+  gsize deficit;
+  /**
+   * Whether this channel's turn has started, and so
+   * it has already been given its quantum.
+   */
+  gboolean in_turn;
+} Flow;
+
+/**
+ * Everything waiting in one class.  Channels with
+ * something to send take turns, deficit round robin:
+ * each turn, a channel may send QUANTUM times its
+ * weight, and whatever it didn't use is carried over.
+ */
+typedef struct {
+  /**
+   * Flows, keyed by channel.
+   */
+  GHashTable *flows;
+  /**
+   * The same flows, in the order of their turns;
+   * the head is the one whose turn it is.
+   */
+  GQueue *turns;
+} ClassQueue;
+
+/**
+ * How long blocks of one class have waited.
+ */
+typedef struct {
+  guint64 count;
+  double total;
+  double max;
+} ClassDelay;
+
+struct _OutputQueue {
+  int fd;
+  /**
+   * GByteArrays committed to being written next,
+   * oldest first.  Nothing can be put in front of
+   * these, since the oldest may be partly written.
+   */
+  GQueue *chunks;
+  /**
+   * How much of the oldest chunk has been written.
+   */
+  gsize head_offset;
+  /**
+   * How many bytes are in "chunks".
+   */
+  gsize committed;
+  /**
+   * What's waiting in each class.
+   */
+  ClassQueue pending[OUTPUT_CLASS_COUNT];
+  /**
+   * The weight of each channel which isn't 1.
+   */
+  GHashTable *weights;
+  /**
+   * How many bytes are waiting, committed or not.
+   */
+  gsize length;
+  /**
+   * The idle handler which will flush the queue,
+   * or 0 if none is due.
+   */
+  guint flush_source;
+  /**
+   * The watch which will flush the queue when the
+   * socket is writable again, or 0 if it isn't full.
+   */
+  GIOChannel *channel;
+  guint writable_source;
+  /**
+   * Whether writing has failed, after which we
+   * don't try again.
+   */
+  gboolean failed;
+  /**
+   * The longest block the other side will take:
+   * BLOCK_PARSER_SHORT_MAX until it allows long blocks.
+   */
+  gsize max_block;
+  gsize high_water, low_water;
+  gboolean congested;
+  OutputQueueCongestionCb congestion_cb;
+  gpointer congestion_user_data;
+  guint64 blocks;
+  guint64 syscalls;
+  GTimer *timer;
+  ClassDelay delays[OUTPUT_CLASS_COUNT];
+};
+
+static void
+free_flow (gpointer data)
+{
+  Flow *flow = (Flow*) data;
+
+  while (!g_queue_is_empty (flow->blocks))
+    {
+      PendingBlock *block = g_queue_pop_head (flow->blocks);
+
+      g_byte_array_free (block->data, TRUE);
+      g_slice_free (PendingBlock, block);
+    }
+
+  g_queue_free (flow->blocks);
+  g_slice_free (Flow, flow);
+}
+
+OutputQueue*
+output_queue_new (int fd)
+{
+  OutputQueue *result = g_malloc0 (sizeof (OutputQueue));
+  int i;
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+  result->fd = fd;
+  result->chunks = g_queue_new ();
+  result->head_offset = 0;
+  result->committed = 0;
+  for (i=0; i<OUTPUT_CLASS_COUNT; i++)
+    {
+      result->pending[i].flows =
+        g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                               NULL, free_flow);
+      result->pending[i].turns = g_queue_new ();
+    }
+  result->weights = g_hash_table_new (g_direct_hash, g_direct_equal);
+  result->length = 0;
+  result->flush_source = 0;
+  result->channel = NULL;
+  result->writable_source = 0;
+  result->failed = FALSE;
+  result->max_block = BLOCK_PARSER_SHORT_MAX;
+  result->high_water = G_MAXSIZE;
+  result->low_water = 0;
+  result->congested = FALSE;
+  result->congestion_cb = NULL;
+  result->congestion_user_data = NULL;
+  result->blocks = 0;
+  result->syscalls = 0;
+  result->timer = g_timer_new ();
+
+  return result;
+}
+
+int
+output_queue_get_fd (OutputQueue *queue)
+{
+  return queue->fd;
+}
+
+void
+output_queue_set_congestion_callback (OutputQueue *queue,
+                                      gsize high_water,
+                                      gsize low_water,
+                                      OutputQueueCongestionCb callback,
+                                      gpointer user_data)
+{
+  queue->high_water = high_water;
+  queue->low_water = low_water;
+  queue->congestion_cb = callback;
+  queue->congestion_user_data = user_data;
+}
+
+gboolean
+output_queue_is_congested (OutputQueue *queue)
+{
+  return queue->congested;
+}
+
+static void
+set_congested (OutputQueue *queue,
+               gboolean congested)
+{
+  if (queue->congested == congested)
+    return;
+
+  queue->congested = congested;
+
+  if (queue->congestion_cb)
+    queue->congestion_cb (queue,
+                          congested,
+                          queue->congestion_user_data);
+}
+
+static gboolean
+flush_when_idle (gpointer data)
+{
+  OutputQueue *queue = (OutputQueue*) data;
+
+  queue->flush_source = 0;
+  output_queue_flush (queue);
+
+  return FALSE;
+}
+
+/**
+ * Arranges for the queue to be flushed at the end
+ * of this pass of the main loop.
+ */
+static void
+schedule_flush (OutputQueue *queue)
+{
+  /* If we're waiting for the socket to be writable,
+   * there's no point trying before then.
+   */
+  if (!queue->flush_source && !queue->writable_source)
+    {
+      /* At default priority, rather than idle priority,
+       * so that a busy main loop can't starve it.
+       */
+      queue->flush_source = g_idle_add_full (G_PRIORITY_DEFAULT,
+                                             flush_when_idle,
+                                             queue,
+                                             NULL);
+    }
+}
+
+/**
+ * Queues a block in a class, taking ownership of
+ * "data".  A channel which had nothing waiting in the
+ * class joins the end of the round.
+ */
+static void
+append_pending (OutputQueue *queue,
+                OutputClass output_class,
+                int channel,
+                GByteArray *data)
+{
+  ClassQueue *pending = &queue->pending[output_class];
+  PendingBlock *block = g_slice_new (PendingBlock);
+  Flow *flow = g_hash_table_lookup (pending->flows,
+                                    GINT_TO_POINTER (channel));
+
+  if (!flow)
+    {
+      flow = g_slice_new (Flow);
+      flow->channel = channel;
+      flow->blocks = g_queue_new ();
+      flow->deficit = 0;
+      flow->in_turn = FALSE;
+
+      g_hash_table_insert (pending->flows,
+                           GINT_TO_POINTER (channel),
+                           flow);
+      g_queue_push_tail (pending->turns, flow);
+    }
+
+  block->data = data;
+  block->queued_at = g_timer_elapsed (queue->timer, NULL);
+  g_queue_push_tail (flow->blocks, block);
+
+  queue->length += data->len;
+
+  if (queue->length >= queue->high_water)
+    set_congested (queue, TRUE);
+
+  schedule_flush (queue);
+}
+
+/**
+ * Makes a block out of a header and up to two
+ * pieces of payload.
+ */
+static GByteArray*
+make_block (const guchar *header,
+            gsize header_length,
+            const void *preamble,
+            gsize preamble_length,
+            const void *payload,
+            gsize payload_length)
+{
+  GByteArray *result =
+    g_byte_array_sized_new (header_length +
+                            preamble_length +
+                            payload_length);
+
+  g_byte_array_append (result, header, header_length);
+  if (preamble_length)
+    g_byte_array_append (result, preamble, preamble_length);
+  if (payload_length)
+    g_byte_array_append (result, payload, payload_length);
+
+  return result;
+}
+
+void
+output_queue_append (OutputQueue *queue,
+                     const void *data,
+                     gsize length)
+{
+  if (length==0 || queue->failed)
+    return;
+
+  append_pending (queue,
+                  OUTPUT_CLASS_CONTROL,
+                  0,
+                  make_block (data, length, NULL, 0, NULL, 0));
+}
+
+/**
+ * Fills in a block header.
+ *
+ * \return  The length of the header.
+ */
+static gsize
+make_header (guchar header[8],
+             int channel,
+             gsize length)
+{
+  header[0] = channel % 256;
+  header[1] = channel / 256;
+
+  if (length <= BLOCK_PARSER_SHORT_MAX)
+    {
+      header[2] = length % 256;
+      header[3] = length / 256;
+      return 4;
+    }
+  else
+    {
+      header[2] = header[3] = 0xFF;
+      header[4] = length & 0xFF;
+      header[5] = (length >> 8) & 0xFF;
+      header[6] = (length >> 16) & 0xFF;
+      header[7] = (length >> 24) & 0xFF;
+      return 8;
+    }
+}
+
+void
+output_queue_append_block (OutputQueue *queue,
+                           OutputClass output_class,
+                           int channel,
+                           const void *preamble,
+                           gsize preamble_length,
+                           const void *payload,
+                           gsize payload_length)
+{
+  const guchar *rest = payload;
+  guchar header[8];
+  gsize header_length;
+
+  if (queue->failed)
+    return;
+
+  /* Streams go in pieces short enough for anyone,
+   * but a control message can't be split.
+   */
+  g_return_if_fail (output_class != OUTPUT_CLASS_CONTROL ||
+                    preamble_length + payload_length <= queue->max_block);
+
+  if (output_class == OUTPUT_CLASS_CONTROL ||
+      preamble_length + payload_length <= OUTPUT_QUEUE_PIECE)
+    {
+      header_length = make_header (header, channel,
+                                   preamble_length + payload_length);
+      append_pending (queue,
+                      output_class,
+                      channel,
+                      make_block (header, header_length,
+                                  preamble, preamble_length,
+                                  payload, payload_length));
+      queue->blocks++;
+      return;
+    }
+
+  /* A stream, so it can go in pieces.  Only the
+   * first piece has the preamble.
+   */
+  do
+    {
+      gsize count = MIN (payload_length,
+                         OUTPUT_QUEUE_PIECE - preamble_length);
+
+      header_length = make_header (header, channel,
+                                   preamble_length + count);
+      append_pending (queue,
+                      output_class,
+                      channel,
+                      make_block (header, header_length,
+                                  preamble, preamble_length,
+                                  rest, count));
+      queue->blocks++;
+
+      preamble_length = 0;
+      rest += count;
+      payload_length -= count;
+    }
+  while (payload_length);
+}
+
+void
+output_queue_allow_long_blocks (OutputQueue *queue,
+                                gsize max_length)
+{
+  queue->max_block = MAX (max_length, BLOCK_PARSER_SHORT_MAX);
+}
+
+/**
+ * Moves a pending block to the end of the committed
+ * chunks, taking ownership of it.  Small blocks are
+ * copied into the last chunk, so that a run of them
+ * costs one iovec.
+ */
+static void
+commit_block (OutputQueue *queue,
+              OutputClass output_class,
+              PendingBlock *block)
+{
+  GByteArray *tail = g_queue_peek_tail (queue->chunks);
+  ClassDelay *delay = &queue->delays[output_class];
+  double waited;
+
+  waited = g_timer_elapsed (queue->timer, NULL) - block->queued_at;
+  delay->count++;
+  delay->total += waited;
+  delay->max = MAX (delay->max, waited);
+
+  queue->committed += block->data->len;
+
+  if (tail && tail->len + block->data->len <= CHUNK_SIZE)
+    {
+      g_byte_array_append (tail, block->data->data, block->data->len);
+      g_byte_array_free (block->data, TRUE);
+    }
+  else if (block->data->len >= CHUNK_SIZE/4)
+    {
+      /* big enough to be a chunk in its own right */
+      g_queue_push_tail (queue->chunks, block->data);
+    }
+  else
+    {
+      tail = g_byte_array_sized_new (CHUNK_SIZE);
+      g_byte_array_append (tail, block->data->data, block->data->len);
+      g_queue_push_tail (queue->chunks, tail);
+      g_byte_array_free (block->data, TRUE);
+    }
+
+  g_slice_free (PendingBlock, block);
+}
+
+static gsize
+get_weight (OutputQueue *queue,
+            int channel)
+{
+  gpointer weight = g_hash_table_lookup (queue->weights,
+                                         GINT_TO_POINTER (channel));
+
+  return weight? GPOINTER_TO_UINT (weight): 1;
+}
+
+/**
+ * Commits the next block in a class, from whichever
+ * channel's turn it is.
+ *
+ * \return  FALSE if nothing in the class is waiting.
+ */
+static gboolean
+commit_next (OutputQueue *queue,
+             OutputClass output_class)
+{
+  ClassQueue *pending = &queue->pending[output_class];
+
+  while (TRUE)
+    {
+      Flow *flow = g_queue_peek_head (pending->turns);
+      PendingBlock *block;
+
+      if (!flow)
+        return FALSE;
+
+      if (!flow->in_turn)
+        {
+          flow->deficit += QUANTUM * get_weight (queue, flow->channel);
+          flow->in_turn = TRUE;
+        }
+
+      block = g_queue_peek_head (flow->blocks);
+
+      if (block->data->len > flow->deficit)
+        {
+          /* It's had its turn; keep what's left over
+           * for the next one. */
+          flow->in_turn = FALSE;
+          g_queue_push_tail (pending->turns,
+                             g_queue_pop_head (pending->turns));
+          continue;
+        }
+
+      flow->deficit -= block->data->len;
+      commit_block (queue, output_class,
+                    g_queue_pop_head (flow->blocks));
+
+      if (g_queue_is_empty (flow->blocks))
+        {
+          /* A channel with nothing to send doesn't
+           * save up for later. */
+          g_queue_pop_head (pending->turns);
+          g_hash_table_remove (pending->flows,
+                               GINT_TO_POINTER (flow->channel));
+        }
+
+      return TRUE;
+    }
+}
+
+/**
+ * Decides what goes out next.  All pending control
+ * messages are committed at once, since they're short;
+ * a piece of anything else is only committed when
+ * nothing else is, so that a control message which
+ * turns up later waits behind at most that piece.
+ */
+static void
+commit_pending (OutputQueue *queue)
+{
+  int i;
+
+  while (commit_next (queue, OUTPUT_CLASS_CONTROL))
+    ;
+
+  if (queue->committed)
+    return;
+
+  for (i=OUTPUT_CLASS_CONTROL+1; i<OUTPUT_CLASS_COUNT; i++)
+    if (commit_next (queue, (OutputClass) i))
+      return;
+}
+
+/**
+ * Forgets the first "count" bytes of the queue,
+ * which have been written.
+ */
+static void
+consume (OutputQueue *queue,
+         gsize count)
+{
+  queue->length -= count;
+  queue->committed -= count;
+
+  while (count)
+    {
+      GByteArray *head = g_queue_peek_head (queue->chunks);
+      gsize available = head->len - queue->head_offset;
+
+      if (count < available)
+        {
+          queue->head_offset += count;
+          break;
+        }
+
+      count -= available;
+      g_byte_array_free (g_queue_pop_head (queue->chunks), TRUE);
+      queue->head_offset = 0;
+    }
+
+  if (queue->length <= queue->low_water)
+    set_congested (queue, FALSE);
+}
+
+static gboolean
+flush_when_writable (GIOChannel *source,
+                     GIOCondition condition,
+                     gpointer data)
+{
+  OutputQueue *queue = (OutputQueue*) data;
+
+  queue->writable_source = 0;
+  output_queue_flush (queue);
+
+  /* output_queue_flush() adds a new watch if need be */
+  return FALSE;
+}
+
+/**
+ * Throws away everything waiting, after the socket
+ * has failed.
+ */
+static void
+discard (OutputQueue *queue)
+{
+  int i;
+
+  while (!g_queue_is_empty (queue->chunks))
+    g_byte_array_free (g_queue_pop_head (queue->chunks), TRUE);
+
+  for (i=0; i<OUTPUT_CLASS_COUNT; i++)
+    {
+      while (!g_queue_is_empty (queue->pending[i].turns))
+        g_queue_pop_head (queue->pending[i].turns);
+      g_hash_table_remove_all (queue->pending[i].flows);
+    }
+
+  queue->head_offset = 0;
+  queue->committed = 0;
+  queue->length = 0;
+  queue->failed = TRUE;
+
+  set_congested (queue, FALSE);
+}
+
+gboolean
+output_queue_flush (OutputQueue *queue)
+{
+  if (queue->failed)
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct iovec iov[MAX_IOVECS];
+      GList *cursor;
+      gssize written;
+      int count = 0;
+
+      commit_pending (queue);
+
+      if (g_queue_is_empty (queue->chunks))
+        break;
+
+      for (cursor = queue->chunks->head;
+           cursor && count < MAX_IOVECS;
+           cursor = cursor->next)
+        {
+          GByteArray *chunk = cursor->data;
+          gsize skip = (count==0)? queue->head_offset: 0;
+
+          iov[count].iov_base = chunk->data + skip;
+          iov[count].iov_len = chunk->len - skip;
+          count++;
+        }
+
+      written = writev (queue->fd, iov, count);
+      queue->syscalls++;
+
+      if (written < 0)
+        {
+          if (errno==EINTR)
+            continue;
+
+          if (errno==EAGAIN || errno==EWOULDBLOCK)
+            {
+              /* The socket is full; come back when
+               * it isn't.
+               */
+              if (!queue->channel)
+                queue->channel = g_io_channel_unix_new (queue->fd);
+
+              if (!queue->writable_source)
+                queue->writable_source = g_io_add_watch (queue->channel,
+                                                         G_IO_OUT,
+                                                         flush_when_writable,
+                                                         queue);
+              return TRUE;
+            }
+
+          g_warning ("Could not write to socket %d: %s",
+                     queue->fd, strerror (errno));
+          discard (queue);
+          return FALSE;
+        }
+
+      consume (queue, written);
+    }
+
+  return TRUE;
+}
+
+void
+output_queue_set_weight (OutputQueue *queue,
+                         int channel,
+                         guint weight)
+{
+  if (weight > 1)
+    g_hash_table_insert (queue->weights,
+                         GINT_TO_POINTER (channel),
+                         GUINT_TO_POINTER (weight));
+  else
+    g_hash_table_remove (queue->weights,
+                         GINT_TO_POINTER (channel));
+}
+
+void
+output_queue_get_counts (OutputQueue *queue,
+                         guint64 *blocks,
+                         guint64 *syscalls)
+{
+  if (blocks)
+    *blocks = queue->blocks;
+
+  if (syscalls)
+    *syscalls = queue->syscalls;
+}
+
+void
+output_queue_get_delay (OutputQueue *queue,
+                        OutputClass output_class,
+                        guint64 *count,
+                        double *mean,
+                        double *max)
+{
+  ClassDelay *delay = &queue->delays[output_class];
+
+  if (count)
+    *count = delay->count;
+
+  if (mean)
+    *mean = delay->count? delay->total / delay->count: 0.0;
+
+  if (max)
+    *max = delay->max;
+}
+
+void
+output_queue_free (OutputQueue *queue)
+{
+  int i;
+
+  if (!queue)
+    return;
+
+  if (queue->flush_source)
+    g_source_remove (queue->flush_source);
+
+  if (queue->writable_source)
+    g_source_remove (queue->writable_source);
+
+  if (queue->channel)
+    g_io_channel_unref (queue->channel);
+
+  queue->congestion_cb = NULL;
+  discard (queue);
+  g_queue_free (queue->chunks);
+  for (i=0; i<OUTPUT_CLASS_COUNT; i++)
+    {
+      g_hash_table_destroy (queue->pending[i].flows);
+      g_queue_free (queue->pending[i].turns);
+    }
+  g_hash_table_destroy (queue->weights);
+  g_timer_destroy (queue->timer);
+  g_free (queue);
+}
+
+/* eof output-queue.c */
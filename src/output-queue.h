@@ -0,0 +1,198 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H 1
+
+#include <glib.h>
+
+/**
+ * Data waiting to be written to a socket.  Everything
+ * appended during one pass of the main loop goes out in
+ * a single writev() at the end of it.  The socket is
+ * non-blocking; if it won't take everything, the rest
+ * waits until it's writable again.
+ *
+ * Blocks are queued by class, and a class goes out
+ * ahead of every class after it, so that a control
+ * message never waits behind more than one piece of
+ * video, however much video is queued.  Within a
+ * class, channels take turns in proportion to their
+ * weights, so that one busy window can't hold up
+ * the others.
+ */
+typedef struct _OutputQueue OutputQueue;
+
+/**
+ * The classes of traffic, most urgent first.
+ */
+typedef enum {
+  /**
+   * Control messages, including pointer movement.
+   * Blocks in this class are never split.
+   */
+  OUTPUT_CLASS_CONTROL,
+  /**
+   * Replies to input: RFB from the side which is
+   * viewing a window.
+   */
+  OUTPUT_CLASS_INPUT,
+  /**
+   * RFB updates.
+   */
+  OUTPUT_CLASS_VIDEO,
+  /**
+   * Sound.
+   */
+  OUTPUT_CLASS_AUDIO,
+  OUTPUT_CLASS_COUNT
+} OutputClass;
+
+/**
+ * Blocks in classes other than OUTPUT_CLASS_CONTROL
+ * carry byte streams, so they're split into pieces no
+ * longer than this, which bounds how long a control
+ * message can wait.  So they never need long blocks,
+ * even where the other side allows them.
+ */
+#define OUTPUT_QUEUE_PIECE 16384
+
+/**
+ * Called when a queue becomes congested, because more
+ * than its high-water mark is waiting, or stops being
+ * congested, because it's drained to its low-water mark.
+ */
+typedef void (*OutputQueueCongestionCb) (OutputQueue *queue,
+					 gboolean congested,
+					 gpointer user_data);
+
+/**
+ * Creates a queue for the given file descriptor, and
+ * makes the descriptor non-blocking.  The queue doesn't
+ * own the descriptor.
+ */
+OutputQueue *output_queue_new (int fd);
+
+/**
+ * Sets the marks at which the queue becomes congested
+ * and stops being congested, and what to tell.
+ *
+ * \param queue       The queue.
+ * \param high_water  Bytes waiting at which we're congested.
+ * \param low_water   Bytes waiting at which we're not.
+ * \param callback    What to call when that changes.
+ * \param user_data   User data for the callback.
+ */
+void output_queue_set_congestion_callback (OutputQueue *queue,
+					   gsize high_water,
+					   gsize low_water,
+					   OutputQueueCongestionCb callback,
+					   gpointer user_data);
+
+/**
+ * Returns whether the queue is congested.
+ */
+gboolean output_queue_is_congested (OutputQueue *queue);
+
+/**
+ * Returns the file descriptor the queue writes to.
+ */
+int output_queue_get_fd (OutputQueue *queue);
+
+/**
+ * Queues some bytes exactly as they are, in
+ * OUTPUT_CLASS_CONTROL.
+ */
+void output_queue_append (OutputQueue *queue,
+			  const void *data,
+			  gsize length);
+
+/**
+ * Says that the other side takes long blocks, up to the
+ * given length, as a FRAMING message tells us.  Until
+ * this is called, no block longer than
+ * BLOCK_PARSER_SHORT_MAX is sent.
+ */
+void output_queue_allow_long_blocks (OutputQueue *queue,
+				     gsize max_length);
+
+/**
+ * Queues an xzibit block: the four-byte header giving
+ * the channel and length, then the preamble, then the
+ * payload, as if the preamble and payload were one.
+ * Blocks longer than BLOCK_PARSER_SHORT_MAX get a long
+ * header.  Unless the class is OUTPUT_CLASS_CONTROL,
+ * the block may go as several shorter blocks; a control
+ * block longer than the other side allows isn't sent.
+ *
+ * \param queue            The queue.
+ * \param output_class     The class of the block.
+ * \param channel          The channel the block is for.
+ * \param preamble         The start of the block; may be
+ *                         NULL if "preamble_length" is 0.
+ * \param preamble_length  Its length.
+ * \param payload          The rest of the block; may be
+ *                         NULL if "payload_length" is 0.
+ * \param payload_length   Its length.
+ */
+void output_queue_append_block (OutputQueue *queue,
+				OutputClass output_class,
+				int channel,
+				const void *preamble,
+				gsize preamble_length,
+				const void *payload,
+				gsize payload_length);
+
+/**
+ * Sets how large a share of each class a channel gets
+ * while other channels are busy in the same class.
+ * Channels start with weight 1.
+ *
+ * \param queue    The queue.
+ * \param channel  The channel.
+ * \param weight   Its weight; 0 counts as 1.
+ */
+void output_queue_set_weight (OutputQueue *queue,
+			      int channel,
+			      guint weight);
+
+/**
+ * Writes out as much of the queue as the socket will
+ * take now, rather than waiting for the end of this pass
+ * of the main loop.
+ *
+ * \return  FALSE if the socket failed, in which case
+ *          everything waiting, and everything appended
+ *          later, is thrown away.
+ */
+gboolean output_queue_flush (OutputQueue *queue);
+
+/**
+ * Reports how many blocks have been queued, and how
+ * many system calls it took to write them.  Either
+ * pointer may be NULL.
+ */
+void output_queue_get_counts (OutputQueue *queue,
+			      guint64 *blocks,
+			      guint64 *syscalls);
+
+/**
+ * Reports how long blocks of a given class have waited
+ * behind other classes before being handed to the
+ * socket.  Any pointer may be NULL.
+ *
+ * \param queue         The queue.
+ * \param output_class  The class.
+ * \param count         Set to how many blocks have gone.
+ * \param mean          Set to their mean wait, in seconds.
+ * \param max           Set to the longest wait, in seconds.
+ */
+void output_queue_get_delay (OutputQueue *queue,
+			     OutputClass output_class,
+			     guint64 *count,
+			     double *mean,
+			     double *max);
+
+/**
+ * Frees the queue, discarding anything unwritten.
+ */
+void output_queue_free (OutputQueue *queue);
+
+#endif /* !OUTPUT_QUEUE_H */
@@ -0,0 +1,570 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/*
+ * Kernels for scanning captured frames: tile hashing
+ * and row comparison, with SSE2 and AVX2 versions
+ * chosen at runtime.
+ *
+ * Copyright (c) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "pixel-scan.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+  (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * The hash works on 32-byte stripes, split into four
+ * 64-bit lanes.  For each lane we add the lane itself
+ * and the product of the two halves of the lane xored
+ * with a key; the 32x32->64 multiply is the one thing
+ * SSE2 can do in a single instruction (pmuludq), so the
+ * vector versions give exactly the same answers as the
+ * scalar one.  The key starts each row as the secret and
+ * moves on by STRIPE_STEP for each stripe, because the
+ * sums alone don't care what order the stripes come in:
+ * without it, swapping two cells of a row (say, two
+ * glyphs of monospace text) would go unnoticed.  At the
+ * end of each row every lane is scrambled, so that rows
+ * can't be swapped unnoticed either.
+ */
+
+#define PRIME32 G_GUINT64_CONSTANT(0x9E3779B1)
+#define PRIME64_1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define PRIME64_2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+
+#define STRIPE_STEP PRIME64_1
+
+/**
+ * Arbitrary constants mixed into each of the four
+ * lanes of the first stripe of a row, and into the
+ * lanes again at the end of each row.
+ */
+static const guint64 secret[8] __attribute__ ((aligned (32))) = {
+  G_GUINT64_CONSTANT(0xbe4ba423396cfeb8), G_GUINT64_CONSTANT(0x1cad21f72c81017c),
+  G_GUINT64_CONSTANT(0xdb979083e96dd4de), G_GUINT64_CONSTANT(0x1f67b3b7a4a44072),
+  G_GUINT64_CONSTANT(0x78e5c0cc4ee679cb), G_GUINT64_CONSTANT(0x2172ffcc7dd05a82),
+  G_GUINT64_CONSTANT(0x8e2443f7744608b8), G_GUINT64_CONSTANT(0x4c263a81e69035e0),
+};
+
+static const guint64 initial_acc[4] = {
+  PRIME32, PRIME64_1, PRIME64_2, PRIME64_3
+};
+
+static guint64
+finish_hash (const guint64 *acc,
+             int row_bytes,
+             int rows)
+{
+  guint64 result = (guint64) row_bytes * rows * PRIME64_1;
+  int lane;
+
+  for (lane=0; lane<4; lane++)
+    result = (result ^ acc[lane]) * PRIME64_2;
+
+  result ^= result >> 33;
+  result *= PRIME64_3;
+  result ^= result >> 29;
+
+  return result;
+}
+
+/****************************************************************
+ * Scalar versions.
+ ****************************************************************/
+
+static inline guint64
+read64 (const guchar *p)
+{
+  guint64 result;
+
+  memcpy (&result, p, sizeof (result));
+  return GUINT64_FROM_LE (result);
+}
+
+static inline void
+accumulate_stripe_scalar (guint64 *acc,
+                          const guchar *p,
+                          int stripe)
+{
+  int lane;
+
+  for (lane=0; lane<4; lane++)
+    {
+      guint64 value = read64 (p + lane*8);
+      guint64 keyed = value ^ (secret[lane] + stripe * STRIPE_STEP);
+
+      acc[lane] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+      acc[lane] += value;
+    }
+}
+
+static guint64
+hash_scalar (const guchar *pixels,
+             int rowstride,
+             int row_bytes,
+             int rows)
+{
+  guint64 acc[4];
+  int stripes = row_bytes / 32;
+  int tail = row_bytes % 32;
+  int y, s, lane;
+
+  memcpy (acc, initial_acc, sizeof (acc));
+
+  for (y=0; y<rows; y++)
+    {
+      const guchar *row = pixels + y*rowstride;
+
+      for (s=0; s<stripes; s++)
+        accumulate_stripe_scalar (acc, row + s*32, s);
+
+      if (tail)
+        {
+          guchar padded[32] = { 0, };
+
+          memcpy (padded, row + stripes*32, tail);
+          accumulate_stripe_scalar (acc, padded, stripes);
+        }
+
+      for (lane=0; lane<4; lane++)
+        {
+          acc[lane] ^= acc[lane] >> 47;
+          acc[lane] ^= secret[lane+4];
+          acc[lane] *= PRIME32;
+        }
+    }
+
+  return finish_hash (acc, row_bytes, rows);
+}
+
+static gboolean
+row_differs_scalar (const guchar *a,
+                    const guchar *b,
+                    gsize length)
+{
+  return memcmp (a, b, length) != 0;
+}
+
+static gboolean
+supported_scalar (void)
+{
+  return TRUE;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/****************************************************************
+ * SSE2 versions.
+ ****************************************************************/
+
+__attribute__ ((target ("sse2")))
+static inline void
+accumulate_stripe_sse2 (__m128i *acc,
+                        __m128i *key,
+                        const guchar *p)
+{
+  __m128i step = _mm_set1_epi64x ((long long) STRIPE_STEP);
+  int half;
+
+  for (half=0; half<2; half++)
+    {
+      __m128i value = _mm_loadu_si128 ((const __m128i*) (p + half*16));
+      __m128i keyed = _mm_xor_si128 (value, key[half]);
+      __m128i product = _mm_mul_epu32 (keyed,
+                                       _mm_srli_epi64 (keyed, 32));
+
+      acc[half] = _mm_add_epi64 (acc[half], product);
+      acc[half] = _mm_add_epi64 (acc[half], value);
+      key[half] = _mm_add_epi64 (key[half], step);
+    }
+}
+
+__attribute__ ((target ("sse2")))
+static guint64
+hash_sse2 (const guchar *pixels,
+           int rowstride,
+           int row_bytes,
+           int rows)
+{
+  __m128i acc[2];
+  __m128i prime = _mm_set1_epi64x ((long long) PRIME32);
+  guint64 result[4] __attribute__ ((aligned (16)));
+  int stripes = row_bytes / 32;
+  int tail = row_bytes % 32;
+  int y, s, half;
+
+  acc[0] = _mm_loadu_si128 ((const __m128i*) initial_acc);
+  acc[1] = _mm_loadu_si128 ((const __m128i*) (initial_acc + 2));
+
+  for (y=0; y<rows; y++)
+    {
+      const guchar *row = pixels + y*rowstride;
+      __m128i key[2];
+
+      key[0] = _mm_load_si128 ((const __m128i*) secret);
+      key[1] = _mm_load_si128 ((const __m128i*) (secret + 2));
+
+      for (s=0; s<stripes; s++)
+        accumulate_stripe_sse2 (acc, key, row + s*32);
+
+      if (tail)
+        {
+          guchar padded[32] = { 0, };
+
+          memcpy (padded, row + stripes*32, tail);
+          accumulate_stripe_sse2 (acc, key, padded);
+        }
+
+      for (half=0; half<2; half++)
+        {
+          __m128i a = acc[half];
+          __m128i low, high;
+
+          a = _mm_xor_si128 (a, _mm_srli_epi64 (a, 47));
+          a = _mm_xor_si128 (a, _mm_load_si128 ((const __m128i*)
+                                                (secret + 4 + half*2)));
+
+          /* a *= PRIME32, done as two 32x32->64 multiplies */
+          low = _mm_mul_epu32 (a, prime);
+          high = _mm_mul_epu32 (_mm_srli_epi64 (a, 32), prime);
+          acc[half] = _mm_add_epi64 (low, _mm_slli_epi64 (high, 32));
+        }
+    }
+
+  _mm_store_si128 ((__m128i*) result, acc[0]);
+  _mm_store_si128 ((__m128i*) (result + 2), acc[1]);
+
+  return finish_hash (result, row_bytes, rows);
+}
+
+__attribute__ ((target ("sse2")))
+static gboolean
+row_differs_sse2 (const guchar *a,
+                  const guchar *b,
+                  gsize length)
+{
+  gsize i = 0;
+
+  for (; i+64 <= length; i+=64)
+    {
+      __m128i x0 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*) (a+i)),
+                                  _mm_loadu_si128 ((const __m128i*) (b+i)));
+      __m128i x1 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*) (a+i+16)),
+                                  _mm_loadu_si128 ((const __m128i*) (b+i+16)));
+      __m128i x2 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*) (a+i+32)),
+                                  _mm_loadu_si128 ((const __m128i*) (b+i+32)));
+      __m128i x3 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*) (a+i+48)),
+                                  _mm_loadu_si128 ((const __m128i*) (b+i+48)));
+      __m128i any = _mm_or_si128 (_mm_or_si128 (x0, x1),
+                                  _mm_or_si128 (x2, x3));
+
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (any,
+                                             _mm_setzero_si128 ())) != 0xFFFF)
+        return TRUE;
+    }
+
+  for (; i+16 <= length; i+=16)
+    {
+      __m128i x = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*) (a+i)),
+                                 _mm_loadu_si128 ((const __m128i*) (b+i)));
+
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (x,
+                                             _mm_setzero_si128 ())) != 0xFFFF)
+        return TRUE;
+    }
+
+  return memcmp (a+i, b+i, length-i) != 0;
+}
+
+static gboolean
+supported_sse2 (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return FALSE;
+
+  return (edx & bit_SSE2) != 0;
+}
+
+/****************************************************************
+ * AVX2 versions.
+ ****************************************************************/
+
+__attribute__ ((target ("avx2")))
+static guint64
+hash_avx2 (const guchar *pixels,
+           int rowstride,
+           int row_bytes,
+           int rows)
+{
+  __m256i acc = _mm256_loadu_si256 ((const __m256i*) initial_acc);
+  __m256i first_key = _mm256_load_si256 ((const __m256i*) secret);
+  __m256i step = _mm256_set1_epi64x ((long long) STRIPE_STEP);
+  __m256i row_key = _mm256_load_si256 ((const __m256i*) (secret + 4));
+  __m256i prime = _mm256_set1_epi64x ((long long) PRIME32);
+  guint64 result[4] __attribute__ ((aligned (32)));
+  int stripes = row_bytes / 32;
+  int tail = row_bytes % 32;
+  int y, s;
+
+  for (y=0; y<rows; y++)
+    {
+      const guchar *row = pixels + y*rowstride;
+      __m256i key = first_key;
+      __m256i low, high;
+
+      for (s=0; s<=stripes; s++)
+        {
+          __m256i value, keyed;
+          guchar padded[32] __attribute__ ((aligned (32)));
+
+          if (s<stripes)
+            value = _mm256_loadu_si256 ((const __m256i*) (row + s*32));
+          else if (tail)
+            {
+              memset (padded, 0, sizeof (padded));
+              memcpy (padded, row + stripes*32, tail);
+              value = _mm256_load_si256 ((const __m256i*) padded);
+            }
+          else
+            break;
+
+          keyed = _mm256_xor_si256 (value, key);
+          acc = _mm256_add_epi64 (acc,
+                                  _mm256_mul_epu32 (keyed,
+                                                    _mm256_srli_epi64 (keyed, 32)));
+          acc = _mm256_add_epi64 (acc, value);
+          key = _mm256_add_epi64 (key, step);
+        }
+
+      acc = _mm256_xor_si256 (acc, _mm256_srli_epi64 (acc, 47));
+      acc = _mm256_xor_si256 (acc, row_key);
+      low = _mm256_mul_epu32 (acc, prime);
+      high = _mm256_mul_epu32 (_mm256_srli_epi64 (acc, 32), prime);
+      acc = _mm256_add_epi64 (low, _mm256_slli_epi64 (high, 32));
+    }
+
+  _mm256_store_si256 ((__m256i*) result, acc);
+
+  return finish_hash (result, row_bytes, rows);
+}
+
+__attribute__ ((target ("avx2")))
+static gboolean
+row_differs_avx2 (const guchar *a,
+                  const guchar *b,
+                  gsize length)
+{
+  gsize i = 0;
+
+  for (; i+128 <= length; i+=128)
+    {
+      __m256i x0 = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (a+i)),
+                                     _mm256_loadu_si256 ((const __m256i*) (b+i)));
+      __m256i x1 = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (a+i+32)),
+                                     _mm256_loadu_si256 ((const __m256i*) (b+i+32)));
+      __m256i x2 = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (a+i+64)),
+                                     _mm256_loadu_si256 ((const __m256i*) (b+i+64)));
+      __m256i x3 = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (a+i+96)),
+                                     _mm256_loadu_si256 ((const __m256i*) (b+i+96)));
+      __m256i any = _mm256_or_si256 (_mm256_or_si256 (x0, x1),
+                                     _mm256_or_si256 (x2, x3));
+
+      if (!_mm256_testz_si256 (any, any))
+        return TRUE;
+    }
+
+  for (; i+32 <= length; i+=32)
+    {
+      __m256i x = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (a+i)),
+                                    _mm256_loadu_si256 ((const __m256i*) (b+i)));
+
+      if (!_mm256_testz_si256 (x, x))
+        return TRUE;
+    }
+
+  return memcmp (a+i, b+i, length-i) != 0;
+}
+
+static gboolean
+supported_avx2 (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int xcr0_low, xcr0_high;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return FALSE;
+
+  /* The OS must be saving the YMM registers for us. */
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return FALSE;
+
+  __asm__ ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+  if ((xcr0_low & 6) != 6)
+    return FALSE;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+  return (ebx & bit_AVX2) != 0;
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/****************************************************************
+ * Dispatch.
+ ****************************************************************/
+
+typedef struct _ScanImplementation {
+  const char *name;
+  gboolean (*supported) (void);
+  guint64 (*hash) (const guchar *, int, int, int);
+  gboolean (*row_differs) (const guchar *, const guchar *, gsize);
+} ScanImplementation;
+
+/**
+ * All the implementations, best first.
+ */
+static const ScanImplementation implementations[] = {
+#ifdef HAVE_X86_KERNELS
+  { "avx2", supported_avx2, hash_avx2, row_differs_avx2 },
+  { "sse2", supported_sse2, hash_sse2, row_differs_sse2 },
+#endif
+  { "scalar", supported_scalar, hash_scalar, row_differs_scalar },
+};
+
+static const ScanImplementation *current = NULL;
+
+static const ScanImplementation*
+find_implementation (const char *name)
+{
+  int i;
+
+  for (i=0; i<G_N_ELEMENTS (implementations); i++)
+    {
+      if ((!name || strcmp (name, implementations[i].name)==0) &&
+          implementations[i].supported ())
+        return &implementations[i];
+    }
+
+  return NULL;
+}
+
+static const ScanImplementation*
+ensure_implementation (void)
+{
+  if (!current)
+    {
+      const char *requested = g_getenv ("XZIBIT_PIXEL_SCAN");
+
+      if (requested)
+        {
+          current = find_implementation (requested);
+
+          if (!current)
+            g_warning ("Pixel scanner \"%s\" isn't available here",
+                       requested);
+        }
+
+      if (!current)
+        current = find_implementation (NULL);
+    }
+
+  return current;
+}
+
+guint64
+pixel_scan_hash (const guchar *pixels,
+                 int rowstride,
+                 int row_bytes,
+                 int rows)
+{
+  return ensure_implementation ()->hash (pixels, rowstride,
+                                         row_bytes, rows);
+}
+
+gboolean
+pixel_scan_diff (const guchar *a,
+                 int a_rowstride,
+                 const guchar *b,
+                 int b_rowstride,
+                 int row_bytes,
+                 int rows,
+                 int *first_row,
+                 int *last_row)
+{
+  const ScanImplementation *impl = ensure_implementation ();
+  int first, last;
+
+  for (first=0; first<rows; first++)
+    if (impl->row_differs (a + first*a_rowstride,
+                           b + first*b_rowstride,
+                           row_bytes))
+      break;
+
+  if (first==rows)
+    return FALSE;
+
+  if (first_row)
+    *first_row = first;
+
+  if (last_row)
+    {
+      for (last=rows-1; last>first; last--)
+        if (impl->row_differs (a + last*a_rowstride,
+                               b + last*b_rowstride,
+                               row_bytes))
+          break;
+
+      *last_row = last;
+    }
+
+  return TRUE;
+}
+
+const char*
+pixel_scan_implementation (void)
+{
+  return ensure_implementation ()->name;
+}
+
+gboolean
+pixel_scan_set_implementation (const char *name)
+{
+  const ScanImplementation *impl = find_implementation (name);
+
+  if (!impl)
+    return FALSE;
+
+  current = impl;
+  return TRUE;
+}
+
+/* eof pixel-scan.c */
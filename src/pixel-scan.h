@@ -0,0 +1,61 @@
+#ifndef PIXEL_SCAN_H
+#define PIXEL_SCAN_H 1
+
+#include <glib.h>
+
+/**
+ * Hashes a rectangle of pixels.  The rectangle is "rows"
+ * rows high, and each row is "row_bytes" long.  Every
+ * implementation returns the same hash for the same pixels.
+ *
+ * \param pixels     The first byte of the first row.
+ * \param rowstride  Bytes between the starts of rows.
+ * \param row_bytes  Bytes in each row of the rectangle.
+ * \param rows       Number of rows.
+ */
+guint64 pixel_scan_hash (const guchar *pixels,
+			 int rowstride,
+			 int row_bytes,
+			 int rows);
+
+/**
+ * Compares two rectangles of pixels row by row, like
+ * memcmp() but reporting which rows differ.
+ *
+ * \param a, b              The rectangles to compare.
+ * \param a_rowstride,
+ *        b_rowstride       Their rowstrides.
+ * \param row_bytes         Bytes in each row.
+ * \param rows              Number of rows.
+ * \param first_row         Set to the first row which differs,
+ *                          if any.  May be NULL.
+ * \param last_row          Set to the last row which differs,
+ *                          if any.  May be NULL.
+ * \return  TRUE if any row differs.
+ */
+gboolean pixel_scan_diff (const guchar *a,
+			  int a_rowstride,
+			  const guchar *b,
+			  int b_rowstride,
+			  int row_bytes,
+			  int rows,
+			  int *first_row,
+			  int *last_row);
+
+/**
+ * Returns the name of the implementation in use:
+ * "avx2", "sse2" or "scalar".  By default the best one
+ * the CPU supports is chosen; the XZIBIT_PIXEL_SCAN
+ * environment variable can name a slower one instead.
+ */
+const char *pixel_scan_implementation (void);
+
+/**
+ * Switches to the named implementation.
+ *
+ * \return  FALSE, and leaves things as they were, if there
+ *          is no such implementation or the CPU can't run it.
+ */
+gboolean pixel_scan_set_implementation (const char *name);
+
+#endif /* !PIXEL_SCAN_H */
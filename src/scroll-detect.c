@@ -0,0 +1,322 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/*
+ * Finding scrolled content in captured frames.
+ *
+ * Copyright (c) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "scroll-detect.h"
+#include "pixel-scan.h"
+#include <string.h>
+
+/**
+ * Marks a slot in the table of old lines as empty, or
+ * as holding a hash which more than one line has.
+ */
+#define SLOT_EMPTY -1
+#define SLOT_AMBIGUOUS -2
+
+#define COLUMN_PRIME G_GUINT64_CONSTANT (0x9E3779B185EBCA87)
+
+struct _ScrollDetect {
+  /**
+   * The most rows or columns we'll be asked about.
+   */
+  int max_lines;
+  /**
+   * The hash of each row or column of the old and
+   * new areas.
+   */
+  guint64 *old_hashes;
+  guint64 *new_hashes;
+  /**
+   * An open-addressed table from the hash of each old
+   * line to its index, so we can find where a new line
+   * came from.  "table_size" is a power of two.
+   */
+  guint64 *table_keys;
+  int *table_lines;
+  int table_size;
+  /**
+   * For each possible shift, how many lines agree
+   * that's what happened; the middle one is no shift.
+   */
+  int *votes;
+};
+
+ScrollDetect*
+scroll_detect_new (int width,
+                   int height)
+{
+  ScrollDetect *result = g_malloc (sizeof (ScrollDetect));
+
+  result->max_lines = MAX (width, height);
+  result->old_hashes = g_new (guint64, result->max_lines);
+  result->new_hashes = g_new (guint64, result->max_lines);
+
+  result->table_size = 1;
+  while (result->table_size < result->max_lines * 2)
+    result->table_size *= 2;
+
+  result->table_keys = g_new (guint64, result->table_size);
+  result->table_lines = g_new (int, result->table_size);
+  result->votes = g_new (int, result->max_lines * 2 + 1);
+
+  return result;
+}
+
+static void
+hash_rows (guint64 *hashes,
+           const guchar *pixels,
+           int stride,
+           int width,
+           int height)
+{
+  int row;
+
+  for (row=0; row<height; row++)
+    hashes[row] = pixel_scan_hash (pixels + row * stride,
+                                   stride,
+                                   width * 4,
+                                   1);
+}
+
+/**
+ * Hashes each column.  We go a row at a time, keeping
+ * every column's hash on the go, so that we read memory
+ * in order.
+ */
+static void
+hash_columns (guint64 *hashes,
+              const guchar *pixels,
+              int stride,
+              int width,
+              int height)
+{
+  int row, column;
+
+  for (column=0; column<width; column++)
+    hashes[column] = 0;
+
+  for (row=0; row<height; row++)
+    {
+      const guchar *here = pixels + row * stride;
+
+      for (column=0; column<width; column++)
+        {
+          guint32 pixel;
+
+          memcpy (&pixel, here + column * 4, sizeof (pixel));
+          hashes[column] = (hashes[column] ^ pixel) * COLUMN_PRIME;
+        }
+    }
+}
+
+static int
+find_slot (ScrollDetect *sd,
+           guint64 hash)
+{
+  int slot = (hash ^ (hash >> 32)) & (sd->table_size - 1);
+
+  while (sd->table_lines[slot] != SLOT_EMPTY &&
+         sd->table_keys[slot] != hash)
+    slot = (slot + 1) & (sd->table_size - 1);
+
+  return slot;
+}
+
+/**
+ * Works out how far the lines in "new_hashes" have
+ * moved from where they were in "old_hashes".
+ *
+ * Every line which changed votes for the distance back
+ * to the only old line with the same hash.  Lines whose
+ * hash several old lines share, like blank ones, could
+ * have come from anywhere and don't vote.  The winning
+ * shift is then applied to the longest band of lines
+ * which it explains.
+ *
+ * \return  TRUE if enough moved to be worth a copy.
+ */
+static gboolean
+find_shift (ScrollDetect *sd,
+            int lines,
+            int *shift,
+            int *first,
+            int *count)
+{
+  int line, slot, best;
+  int run_start, run_changed;
+  int best_start = 0, best_count = 0, best_changed = 0;
+
+  for (slot=0; slot<sd->table_size; slot++)
+    sd->table_lines[slot] = SLOT_EMPTY;
+
+  for (line=0; line<lines; line++)
+    {
+      slot = find_slot (sd, sd->old_hashes[line]);
+
+      if (sd->table_lines[slot] == SLOT_EMPTY)
+        {
+          sd->table_keys[slot] = sd->old_hashes[line];
+          sd->table_lines[slot] = line;
+        }
+      else
+        sd->table_lines[slot] = SLOT_AMBIGUOUS;
+    }
+
+  memset (sd->votes, 0, sizeof (int) * (lines * 2 + 1));
+
+  for (line=0; line<lines; line++)
+    {
+      if (sd->new_hashes[line] == sd->old_hashes[line])
+        continue;
+
+      slot = find_slot (sd, sd->new_hashes[line]);
+
+      if (sd->table_lines[slot] >= 0)
+        sd->votes[line - sd->table_lines[slot] + lines]++;
+    }
+
+  best = lines;
+  for (line=0; line<lines*2+1; line++)
+    {
+      if (line != lines && sd->votes[line] > sd->votes[best])
+        best = line;
+    }
+
+  if (sd->votes[best] < SCROLL_DETECT_MIN_LINES)
+    return FALSE;
+
+  *shift = best - lines;
+
+  /* Now find the longest band which the shift explains.
+   * Lines which were the same anyway can be part of it,
+   * but they mustn't be most of it, or there'd be no
+   * point in copying.
+   */
+  run_start = -1;
+  run_changed = 0;
+
+  for (line=MAX (0, *shift); line<=MIN (lines, lines + *shift); line++)
+    {
+      gboolean explained = line < MIN (lines, lines + *shift) &&
+        sd->new_hashes[line] == sd->old_hashes[line - *shift];
+
+      if (explained)
+        {
+          if (run_start == -1)
+            {
+              run_start = line;
+              run_changed = 0;
+            }
+
+          if (sd->new_hashes[line] != sd->old_hashes[line])
+            run_changed++;
+        }
+      else if (run_start != -1)
+        {
+          if (line - run_start > best_count)
+            {
+              best_start = run_start;
+              best_count = line - run_start;
+              best_changed = run_changed;
+            }
+
+          run_start = -1;
+        }
+    }
+
+  if (best_count < SCROLL_DETECT_MIN_LINES ||
+      best_changed * 2 < best_count)
+    return FALSE;
+
+  *first = best_start;
+  *count = best_count;
+
+  return TRUE;
+}
+
+gboolean
+scroll_detect_find (ScrollDetect *sd,
+                    const guchar *old_pixels,
+                    int old_stride,
+                    const guchar *new_pixels,
+                    int new_stride,
+                    int width,
+                    int height,
+                    ScrollDetectMove *move)
+{
+  int shift, first, count;
+
+  g_return_val_if_fail (width <= sd->max_lines &&
+                        height <= sd->max_lines, FALSE);
+
+  if (height >= SCROLL_DETECT_MIN_LINES)
+    {
+      hash_rows (sd->old_hashes, old_pixels, old_stride, width, height);
+      hash_rows (sd->new_hashes, new_pixels, new_stride, width, height);
+
+      if (find_shift (sd, height, &shift, &first, &count))
+        {
+          move->x = 0;
+          move->y = first;
+          move->width = width;
+          move->height = count;
+          move->dx = 0;
+          move->dy = shift;
+          return TRUE;
+        }
+    }
+
+  if (width >= SCROLL_DETECT_MIN_LINES)
+    {
+      hash_columns (sd->old_hashes, old_pixels, old_stride, width, height);
+      hash_columns (sd->new_hashes, new_pixels, new_stride, width, height);
+
+      if (find_shift (sd, width, &shift, &first, &count))
+        {
+          move->x = first;
+          move->y = 0;
+          move->width = count;
+          move->height = height;
+          move->dx = shift;
+          move->dy = 0;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+void
+scroll_detect_free (ScrollDetect *sd)
+{
+  if (!sd)
+    return;
+
+  g_free (sd->old_hashes);
+  g_free (sd->new_hashes);
+  g_free (sd->table_keys);
+  g_free (sd->table_lines);
+  g_free (sd->votes);
+  g_free (sd);
+}
+
+/* eof scroll-detect.c */
@@ -0,0 +1,60 @@
+#ifndef SCROLL_DETECT_H
+#define SCROLL_DETECT_H 1
+
+#include <glib.h>
+
+/**
+ * Scrolls shorter than this many rows or columns
+ * aren't worth sending as a copy.
+ */
+#define SCROLL_DETECT_MIN_LINES 16
+
+typedef struct _ScrollDetect ScrollDetect;
+
+/**
+ * Part of a frame which has moved.  The rectangle is
+ * where the pixels are now; they came from the same
+ * rectangle offset by (-dx, -dy).
+ */
+typedef struct _ScrollDetectMove {
+  int x, y;
+  int width, height;
+  int dx, dy;
+} ScrollDetectMove;
+
+/**
+ * Creates a detector for areas of up to the given size.
+ */
+ScrollDetect *scroll_detect_new (int width,
+				 int height);
+
+/**
+ * Compares an area of the old frame with the same area
+ * of the new frame, looking for a band of rows which has
+ * moved up or down, or failing that a band of columns
+ * which has moved left or right.  Both areas are 32 bits
+ * per pixel.
+ *
+ * \param sd          The detector.
+ * \param old_pixels  The area in the old frame.
+ * \param old_stride  Bytes between its rows.
+ * \param new_pixels  The area in the new frame.
+ * \param new_stride  Bytes between its rows.
+ * \param width       The size of the area, which must be
+ * \param height      no bigger than the detector was made for.
+ * \param move        Set to what moved, relative to the area.
+ * \return  TRUE if something moved far enough, and enough
+ *          of it, to be worth sending as a copy.
+ */
+gboolean scroll_detect_find (ScrollDetect *sd,
+			     const guchar *old_pixels,
+			     int old_stride,
+			     const guchar *new_pixels,
+			     int new_stride,
+			     int width,
+			     int height,
+			     ScrollDetectMove *move);
+
+void scroll_detect_free (ScrollDetect *sd);
+
+#endif /* !SCROLL_DETECT_H */
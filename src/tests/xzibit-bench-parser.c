@@ -0,0 +1,284 @@
+/*
+ * Microbenchmark for splitting the xzibit stream into blocks.
+ *
+ * Feeds a recorded stream, as received at bottom_fd, through
+ * the block parser in reads of various sizes, and through the
+ * byte-at-a-time parser it replaced, and reports throughput.
+ * The parser is measured both gathering up every block and
+ * streaming the RFB channels, as the plugin does once a
+ * window has been accepted.
+ * Without a recording, a synthetic one is made up: mostly
+ * small control and input blocks, with RFB blocks of up to
+ * 64K making up most of the bytes.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block-parser.h"
+
+#define GREETING "Xz 000.001\r\n"
+
+static const gsize read_sizes[] = { 1024, 4096, 65536 };
+
+int iterations = 20;
+int synthetic_blocks = 20000;
+gchar *recording = NULL;
+
+static const GOptionEntry options[] =
+{
+	{
+	  "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+	  "How many times to parse the stream", NULL },
+	{
+	  "blocks", 'b', 0, G_OPTION_ARG_INT, &synthetic_blocks,
+	  "How many blocks to make up if there's no recording", NULL },
+	{
+	  "file", 'f', 0, G_OPTION_ARG_FILENAME, &recording,
+	  "A recorded stream to parse", "FILE" },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+};
+
+/* What the callbacks saw, so that nothing is optimised away. */
+static guint64 seen_blocks = 0;
+static guint64 seen_bytes = 0;
+
+typedef enum {
+  MODE_BYTEWISE,
+  MODE_BLOCKS,
+  MODE_STREAMED,
+} BenchmarkMode;
+
+static const char *mode_names[] = { "bytewise", "parser", "streamed" };
+
+static void
+count_block (int channel,
+	     const guchar *payload,
+	     gsize length,
+	     gpointer user_data)
+{
+  seen_blocks++;
+  seen_bytes += length + (length? payload[length-1]: 0);
+}
+
+static void
+count_span (int channel,
+	    const guchar *data,
+	    gsize length,
+	    gpointer user_data)
+{
+  seen_bytes += length + data[length-1];
+}
+
+static GByteArray*
+make_up_stream (void)
+{
+  GByteArray *result = g_byte_array_new ();
+  guchar *payload = g_malloc (65535);
+  int i;
+
+  for (i=0; i<65535; i++)
+    payload[i] = random ();
+
+  g_byte_array_append (result, (guchar*) GREETING, strlen (GREETING));
+
+  for (i=0; i<synthetic_blocks; i++)
+    {
+      int channel = (random () % 4) + 1;
+      int length;
+      guchar header[4];
+
+      if (random () % 10 < 7)
+	{
+	  /* control messages and mouse movement */
+	  length = (random () % 8) + 2;
+	  if (random () % 2)
+	    channel = 0;
+	}
+      else
+	length = (random () % 65000) + 512;
+
+      header[0] = channel % 256;
+      header[1] = channel / 256;
+      header[2] = length % 256;
+      header[3] = length / 256;
+
+      g_byte_array_append (result, header, sizeof (header));
+      g_byte_array_append (result, payload, length);
+    }
+
+  g_free (payload);
+
+  return result;
+}
+
+/**
+ * The parser as it was: a switch for every byte, and
+ * a fresh allocation for every block.
+ */
+typedef struct {
+  int stage;
+  int channel;
+  int length;
+  guchar *buffer;
+} BytewiseParser;
+
+static void
+bytewise_feed (BytewiseParser *parser,
+	       const guchar *data,
+	       gsize count)
+{
+  gsize i;
+
+  for (i=0; i<count; i++)
+    {
+      switch (parser->stage)
+	{
+	case -4:
+	  parser->channel = data[i];
+	  break;
+
+	case -3:
+	  parser->channel |= data[i] * 256;
+	  break;
+
+	case -2:
+	  parser->length = data[i];
+	  break;
+
+	case -1:
+	  parser->length |= data[i] * 256;
+	  parser->buffer = g_malloc (parser->length);
+	  break;
+
+	default:
+	  if (parser->stage >= 0)
+	    {
+	      parser->buffer[parser->stage] = data[i];
+
+	      if (parser->stage == parser->length-1)
+		{
+		  count_block (parser->channel,
+			       parser->buffer,
+			       parser->length,
+			       NULL);
+		  g_free (parser->buffer);
+		  parser->stage = -5;
+		}
+	    }
+	}
+
+      parser->stage++;
+    }
+}
+
+static double
+megabytes_per_second (gsize bytes, double seconds)
+{
+  return (bytes / seconds) / (1024.0*1024.0);
+}
+
+static void
+run_benchmark (GByteArray *stream,
+	       gsize read_size,
+	       BenchmarkMode mode)
+{
+  GTimer *timer = g_timer_new ();
+  double elapsed;
+  int n;
+
+  seen_blocks = seen_bytes = 0;
+
+  g_timer_start (timer);
+  for (n=0; n<iterations; n++)
+    {
+      BlockParser *parser = NULL;
+      BytewiseParser old = { -3 - (int) sizeof (GREETING), 0, 0, NULL };
+      gsize offset;
+
+      if (mode != MODE_BYTEWISE)
+	parser = block_parser_new (GREETING, NULL, count_block, NULL);
+
+      if (mode == MODE_STREAMED)
+	{
+	  int channel;
+
+	  block_parser_set_span_cb (parser, count_span);
+	  for (channel=1; channel<=4; channel++)
+	    block_parser_set_streamed (parser, channel, TRUE);
+	}
+
+      for (offset=0; offset<stream->len; offset+=read_size)
+	{
+	  gsize count = MIN (read_size, stream->len - offset);
+
+	  if (mode == MODE_BYTEWISE)
+	    bytewise_feed (&old, stream->data + offset, count);
+	  else
+	    block_parser_feed (parser, stream->data + offset, count);
+	}
+
+      block_parser_free (parser);
+    }
+  elapsed = g_timer_elapsed (timer, NULL);
+
+  g_print ("%-9s reads of %5" G_GSIZE_FORMAT ": %8.1f MB/s  %8.0f blocks/ms\n",
+	   mode_names[mode],
+	   read_size,
+	   megabytes_per_second ((gsize) stream->len * iterations, elapsed),
+	   seen_blocks / (elapsed * 1000.0));
+
+  g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GByteArray *stream;
+  int i;
+
+  context = g_option_context_new ("Benchmark the xzibit block parser");
+  g_option_context_add_main_entries (context, options, NULL);
+  g_option_context_parse (context, &argc, &argv, &error);
+  if (error)
+    {
+      g_print ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  if (recording)
+    {
+      gchar *contents;
+      gsize length;
+
+      if (!g_file_get_contents (recording, &contents, &length, &error))
+	{
+	  g_print ("%s\n", error->message);
+	  g_error_free (error);
+	  return 1;
+	}
+
+      stream = g_byte_array_new ();
+      g_byte_array_append (stream, (guchar*) contents, length);
+      g_free (contents);
+    }
+  else
+    stream = make_up_stream ();
+
+  g_print ("Stream is %u bytes.\n", stream->len);
+
+  for (i=0; i<G_N_ELEMENTS (read_sizes); i++)
+    {
+      run_benchmark (stream, read_sizes[i], MODE_BYTEWISE);
+      run_benchmark (stream, read_sizes[i], MODE_BLOCKS);
+      run_benchmark (stream, read_sizes[i], MODE_STREAMED);
+    }
+
+  g_byte_array_free (stream, TRUE);
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Microbenchmark for the frame scanning kernels.
+ *
+ * Reports, for each kernel the CPU can run, how many
+ * gigabytes per second of 32-bit frame we can tile-hash
+ * and diff at 1080p and at 4K.
+ *
+ * First, checks that every kernel gives the same hashes,
+ * and notices two cells of a tile row being swapped.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixel-scan.h"
+#include "tile-hash.h"
+
+#define BYTES_PER_PIXEL 4
+#define MAX_RECTS 32
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+static const struct {
+  const char *name;
+  int width, height;
+} sizes[] = {
+  { "1080p", 1920, 1080 },
+  { "4K", 3840, 2160 },
+};
+
+int iterations = 50;
+
+static const GOptionEntry options[] =
+{
+	{
+	  "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+	  "How many frames to scan for each measurement", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+};
+
+/**
+ * Hashes a random tile, swaps its first two stripes on
+ * one row, and checks the hash and the dirty rectangles
+ * both notice.
+ *
+ * \param kernel    The kernel in use.
+ * \param expected  The hash the first kernel gave for the
+ *                  tile, or 0 if this is the first kernel;
+ *                  set to this kernel's hash.
+ * \return          TRUE if all was well.
+ */
+static gboolean
+check_kernel (const char *kernel,
+	      guint64 *expected)
+{
+  int rowstride = TILE_HASH_SIZE * BYTES_PER_PIXEL;
+  guchar tile[TILE_HASH_SIZE * TILE_HASH_SIZE * BYTES_PER_PIXEL];
+  guchar stripe[32];
+  guchar *row = tile + 5*rowstride;
+  TileHash *tiles = tile_hash_new (TILE_HASH_SIZE, TILE_HASH_SIZE);
+  TileHashRect rects[MAX_RECTS];
+  guint64 before, after;
+  gboolean ok = TRUE;
+  gsize i;
+
+  srandom (1);
+  for (i=0; i<sizeof (tile); i++)
+    tile[i] = random ();
+
+  before = pixel_scan_hash (tile, rowstride, rowstride, TILE_HASH_SIZE);
+  tile_hash_update (tiles, tile, rowstride, BYTES_PER_PIXEL,
+		    rects, MAX_RECTS);
+
+  if (*expected && before != *expected)
+    {
+      g_print ("%-6s gives a different hash from the others\n", kernel);
+      ok = FALSE;
+    }
+  *expected = before;
+
+  memcpy (stripe, row, 32);
+  memcpy (row, row + 32, 32);
+  memcpy (row + 32, stripe, 32);
+
+  after = pixel_scan_hash (tile, rowstride, rowstride, TILE_HASH_SIZE);
+
+  if (after == before ||
+      tile_hash_update (tiles, tile, rowstride, BYTES_PER_PIXEL,
+			rects, MAX_RECTS) == 0)
+    {
+      g_print ("%-6s doesn't notice two stripes being swapped\n", kernel);
+      ok = FALSE;
+    }
+
+  tile_hash_free (tiles);
+
+  return ok;
+}
+
+static double
+gigabytes_per_second (gsize bytes, double seconds)
+{
+  return (bytes / seconds) / (1024.0*1024.0*1024.0);
+}
+
+static void
+run_benchmark (const char *kernel,
+	       const char *size_name,
+	       int width, int height)
+{
+  int rowstride = width * BYTES_PER_PIXEL;
+  gsize frame_bytes = (gsize) rowstride * height;
+  guchar *frame = g_malloc (frame_bytes);
+  guchar *copy;
+  TileHash *tiles = tile_hash_new (width, height);
+  TileHashRect rects[MAX_RECTS];
+  GTimer *timer = g_timer_new ();
+  double hash_time, diff_time;
+  gsize i;
+  int n;
+
+  for (i=0; i<frame_bytes; i++)
+    frame[i] = random ();
+  copy = g_memdup (frame, frame_bytes);
+
+  /* Warm up, and give the detector a previous frame. */
+  tile_hash_update (tiles, frame, rowstride, BYTES_PER_PIXEL,
+		    rects, MAX_RECTS);
+
+  g_timer_start (timer);
+  for (n=0; n<iterations; n++)
+    tile_hash_update (tiles, frame, rowstride, BYTES_PER_PIXEL,
+		      rects, MAX_RECTS);
+  hash_time = g_timer_elapsed (timer, NULL);
+
+  /* Identical frames are the worst case for the diff:
+   * it has to look at every byte.
+   */
+  g_timer_start (timer);
+  for (n=0; n<iterations; n++)
+    pixel_scan_diff (frame, rowstride, copy, rowstride,
+		     rowstride, height, NULL, NULL);
+  diff_time = g_timer_elapsed (timer, NULL);
+
+  g_print ("%-6s %-5s  tile hash %6.2f GB/s   diff %6.2f GB/s\n",
+	   kernel, size_name,
+	   gigabytes_per_second (frame_bytes * iterations, hash_time),
+	   gigabytes_per_second (frame_bytes * iterations, diff_time));
+
+  g_timer_destroy (timer);
+  tile_hash_free (tiles);
+  g_free (copy);
+  g_free (frame);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  guint64 expected = 0;
+  gboolean ok = TRUE;
+  int k, s;
+
+  context = g_option_context_new ("Benchmark the frame scanning kernels");
+  g_option_context_add_main_entries (context, options, NULL);
+  g_option_context_parse (context, &argc, &argv, &error);
+  if (error)
+    {
+      g_print ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  g_print ("Default kernel here is %s.\n",
+	   pixel_scan_implementation ());
+
+  for (k=0; k<G_N_ELEMENTS (kernels); k++)
+    if (pixel_scan_set_implementation (kernels[k]))
+      ok &= check_kernel (kernels[k], &expected);
+
+  if (!ok)
+    return 1;
+
+  for (k=0; k<G_N_ELEMENTS (kernels); k++)
+    {
+      if (!pixel_scan_set_implementation (kernels[k]))
+	{
+	  g_print ("%-6s not supported on this CPU\n", kernels[k]);
+	  continue;
+	}
+
+      for (s=0; s<G_N_ELEMENTS (sizes); s++)
+	run_benchmark (kernels[k],
+		       sizes[s].name,
+		       sizes[s].width,
+		       sizes[s].height);
+    }
+
+  return 0;
+}
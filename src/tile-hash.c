@@ -0,0 +1,206 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/*
+ * Tiled change detection for captured frames.
+ *
+ * Copyright (c) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "tile-hash.h"
+#include "pixel-scan.h"
+
+struct _TileHash {
+  int width, height;
+  /**
+   * Size of the grid of tiles.  The tiles on the
+   * right and bottom edges may be partial.
+   */
+  int columns, rows;
+  /**
+   * The hash of each tile in the previous frame,
+   * in row-major order.
+   */
+  guint64 *hashes;
+  /**
+   * Whether each tile changed in the current frame.
+   */
+  gboolean *dirty;
+  /**
+   * FALSE if there is no previous frame to compare with.
+   */
+  gboolean valid;
+};
+
+TileHash*
+tile_hash_new (int width,
+               int height)
+{
+  TileHash *result = g_malloc (sizeof (TileHash));
+
+  result->width = width;
+  result->height = height;
+  result->columns = (width + TILE_HASH_SIZE - 1) / TILE_HASH_SIZE;
+  result->rows = (height + TILE_HASH_SIZE - 1) / TILE_HASH_SIZE;
+  result->hashes = g_new0 (guint64, result->columns * result->rows);
+  result->dirty = g_new0 (gboolean, result->columns * result->rows);
+  result->valid = FALSE;
+
+  return result;
+}
+
+/**
+ * Turns the dirty tiles into a short list of rectangles.
+ * Each run of dirty tiles along a row of tiles becomes a
+ * rectangle; a run which lines up exactly with a rectangle
+ * ending on the row above extends that rectangle instead.
+ * If we run out of room, the run is swallowed by the
+ * most recent rectangle, which is its nearest neighbour.
+ */
+static int
+merge_dirty_tiles (TileHash *th,
+                   TileHashRect *rects,
+                   int max_rects)
+{
+  int count = 0;
+  int tx, ty, i;
+
+  for (ty=0; ty<th->rows; ty++)
+    {
+      int y = ty * TILE_HASH_SIZE;
+      int height = MIN (TILE_HASH_SIZE, th->height - y);
+
+      tx = 0;
+      while (tx < th->columns)
+        {
+          int first, x, width;
+          gboolean merged = FALSE;
+
+          if (!th->dirty[ty*th->columns + tx])
+            {
+              tx++;
+              continue;
+            }
+
+          first = tx;
+          while (tx < th->columns && th->dirty[ty*th->columns + tx])
+            tx++;
+
+          x = first * TILE_HASH_SIZE;
+          width = MIN (tx * TILE_HASH_SIZE, th->width) - x;
+
+          for (i=0; i<count; i++)
+            {
+              if (rects[i].x == x &&
+                  rects[i].width == width &&
+                  rects[i].y + rects[i].height == y)
+                {
+                  rects[i].height += height;
+                  merged = TRUE;
+                  break;
+                }
+            }
+
+          if (merged)
+            continue;
+
+          if (count < max_rects)
+            {
+              rects[count].x = x;
+              rects[count].y = y;
+              rects[count].width = width;
+              rects[count].height = height;
+              count++;
+            }
+          else
+            {
+              TileHashRect *last = &rects[count-1];
+              int right = MAX (last->x + last->width, x + width);
+
+              last->x = MIN (last->x, x);
+              last->width = right - last->x;
+              last->height = y + height - last->y;
+            }
+        }
+    }
+
+  return count;
+}
+
+int
+tile_hash_update (TileHash *th,
+                  const guchar *pixels,
+                  int rowstride,
+                  int bytes_per_pixel,
+                  TileHashRect *rects,
+                  int max_rects)
+{
+  int tx, ty;
+  gboolean any_dirty = FALSE;
+
+  g_return_val_if_fail (max_rects > 0, 0);
+
+  for (ty=0; ty<th->rows; ty++)
+    {
+      int y = ty * TILE_HASH_SIZE;
+      int height = MIN (TILE_HASH_SIZE, th->height - y);
+
+      for (tx=0; tx<th->columns; tx++)
+        {
+          int x = tx * TILE_HASH_SIZE;
+          int width = MIN (TILE_HASH_SIZE, th->width - x);
+          int index = ty*th->columns + tx;
+          guint64 hash;
+
+          hash = pixel_scan_hash (pixels + y*rowstride + x*bytes_per_pixel,
+                                  rowstride,
+                                  width * bytes_per_pixel,
+                                  height);
+
+          th->dirty[index] = !th->valid || hash != th->hashes[index];
+          th->hashes[index] = hash;
+
+          any_dirty |= th->dirty[index];
+        }
+    }
+
+  th->valid = TRUE;
+
+  if (!any_dirty)
+    return 0;
+
+  return merge_dirty_tiles (th, rects, max_rects);
+}
+
+void
+tile_hash_invalidate (TileHash *th)
+{
+  th->valid = FALSE;
+}
+
+void
+tile_hash_free (TileHash *th)
+{
+  if (!th)
+    return;
+
+  g_free (th->hashes);
+  g_free (th->dirty);
+  g_free (th);
+}
+
+/* eof tile-hash.c */
@@ -0,0 +1,60 @@
+#ifndef TILE_HASH_H
+#define TILE_HASH_H 1
+
+#include <glib.h>
+
+/**
+ * The width and height of a tile, in pixels.
+ */
+#define TILE_HASH_SIZE 32
+
+typedef struct _TileHash TileHash;
+
+/**
+ * A rectangle of the frame which has changed.
+ */
+typedef struct _TileHashRect {
+  int x, y;
+  int width, height;
+} TileHashRect;
+
+/**
+ * Creates a change detector for frames of the given size.
+ * Until the first call to tile_hash_update(), every tile
+ * is considered to have changed.
+ */
+TileHash *tile_hash_new (int width,
+			 int height);
+
+/**
+ * Hashes every tile of a new frame and compares it with
+ * the hash of the same tile in the previous frame.
+ * Changed tiles are merged into rectangles.
+ *
+ * \param th              The detector.
+ * \param pixels          The new frame.
+ * \param rowstride       Bytes between the starts of rows.
+ * \param bytes_per_pixel Bytes in each pixel.
+ * \param rects           Where to put the changed rectangles.
+ * \param max_rects       How many rectangles "rects" can hold;
+ *                        if more would be needed, neighbouring
+ *                        rectangles are merged until they fit.
+ * \return  The number of changed rectangles; zero if the
+ *          frame is the same as last time.
+ */
+int tile_hash_update (TileHash *th,
+		      const guchar *pixels,
+		      int rowstride,
+		      int bytes_per_pixel,
+		      TileHashRect *rects,
+		      int max_rects);
+
+/**
+ * Forgets the previous frame, so that every tile is
+ * considered to have changed next time.
+ */
+void tile_hash_invalidate (TileHash *th);
+
+void tile_hash_free (TileHash *th);
+
+#endif /* !TILE_HASH_H */
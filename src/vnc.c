@@ -1,5 +1,12 @@
 #include "vnc.h"
+#include "tile-hash.h"
+#include "pixel-scan.h"
+#include "scroll-detect.h"
 #include <gtk/gtk.h>
+#include <clutter/clutter.h>
+#include <clutter/x11/clutter-x11.h>
+#include <stdlib.h>
+#include <string.h>
 #include <rfb/rfbproto.h>
 #include <rfb/rfb.h>
 #include <X11/Xlib.h>
@@ -7,6 +14,12 @@
 #include <X11/extensions/XInput2.h>
 #include <X11/extensions/XI2.h>
 #include <X11/extensions/XInput.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 /*
  * Define this if your X server is a bit crappy
@@ -39,15 +52,236 @@ char* window_types[][2] = {
   {0, 0}
 };
 
-typedef struct _VncPrivate {
+/**
+ * How a window's updates should be encoded.
+ */
+typedef struct _VncEncodingPolicy {
+  /**
+   * The RFB encoding to use, such as rfbEncodingTight;
+   * or -1 to use whatever the client prefers.
+   */
+  int encoding;
+  /**
+   * The Tight JPEG quality level, from 0 to 9.
+   * Tight sends only tiles which look like photographs
+   * as JPEG; text and flat colours stay lossless.
+   * -1 means never use JPEG at all.
+   */
+  int jpeg_quality;
+  /**
+   * The zlib compression level, from 0 to 9, used by
+   * Zlib, ZRLE and Tight.
+   */
+  int zlib_level;
+} VncEncodingPolicy;
+
+struct _VncPrivate;
+
+/**
+ * One client of a VNC server: one viewer of the window,
+ * somewhere on the far side of the plugin.
+ */
+typedef struct _VncClient {
+  struct _VncPrivate *server;
+  /**
+   * The plugin's end of the connection, and ours.
+   */
   int fd;
   int other_fd;
+  /**
+   * The watch on "other_fd" which tells us the client
+   * has sent something, or 0 while we're queued.
+   */
+  GIOChannel *input_channel;
+  guint input_watch;
+  /**
+   * What the plugin has passed on from the client which
+   * doesn't make a whole message yet, and how much of
+   * the message after it we can let go by unseen; see
+   * vnc_client_input().  Only touched on the main thread.
+   */
+  GByteArray *input;
+  gsize skip;
+  /**
+   * How many messages of the handshake we've seen, and
+   * how many there are: the version, the security type
+   * if the version is 3.7 or later, and ClientInit.
+   */
+  int handshake_seen, handshake_length;
+  /**
+   * Whether we lost track of what the client sent, in
+   * which case we leave its encodings to libvncserver.
+   */
+  gboolean lost;
+} VncClient;
+
+typedef struct _VncPrivate {
+  /**
+   * The VncClients, oldest first; each is forgotten
+   * once it hangs up.  The first is made along with
+   * the server, and the rest are added once it's
+   * running.  All of them are served from the same
+   * captures.
+   */
+  GSList *clients;
+  /**
+   * Clients added while we were queued, which
+   * libvncserver hasn't been told about yet.  The
+   * encoder holding the lock may be blocked writing
+   * to a client which only the main thread drains,
+   * so rather than wait for it, we add them once it
+   * has finished.  Only touched on the main thread.
+   */
+  GSList *new_clients;
   int width, height;
   GdkWindow *window;
-  GdkPixbuf *screenshot;
-  int screenshot_checksum;
-  gboolean screenshot_checksum_valid;
+  /**
+   * The pixels we serve over RFB: 32 bits per pixel,
+   * with each row aligned to FRAMEBUFFER_ALIGNMENT.
+   * This is allocated once, when the server starts,
+   * and only the parts which change are written to.
+   */
+  guchar *framebuffer;
+  /**
+   * Where captures land before we compare them with
+   * the framebuffer.  Same size and layout.  Not
+   * allocated until we need it if we capture using
+   * shared memory.
+   */
+  guchar *scratch;
+  /**
+   * A wrapper around "scratch", so that gdk can
+   * read the window straight into it.
+   */
+  GdkPixbuf *scratch_pixbuf;
+  /**
+   * Bytes between the starts of rows of "framebuffer"
+   * and "scratch".
+   */
+  int rowstride;
+  /**
+   * Whether "framebuffer" holds a complete frame yet.
+   */
+  gboolean have_frame;
+  /**
+   * If we're capturing using MIT-SHM, the segment the
+   * X server writes into; its shmaddr is NULL otherwise.
+   * It's big enough for the whole window, and captures
+   * of smaller areas are packed at its start.
+   */
+  XShmSegmentInfo shm;
+  /**
+   * The window's visual and depth, which shared
+   * memory captures are made in.
+   */
+  Visual *visual;
+  int depth;
+  /**
+   * Whether the framebuffer is in the layout of the
+   * visual, because we started out capturing using
+   * shared memory, rather than RGBX.
+   */
+  gboolean visual_format;
+  /**
+   * The compositor's texture for this window, if the
+   * plugin gave us one, in which case we read the
+   * pixels from that rather than asking the X server.
+   * NULL otherwise, or once the texture has gone away.
+   */
+  ClutterActor *texture;
+  /**
+   * Where the window's contents start within "texture",
+   * which also holds the frame.
+   */
+  int texture_x, texture_y;
+  /**
+   * The XDamage object watching this window, or None
+   * if the server has no DAMAGE extension; in that case
+   * we fall back to polling the whole window.
+   */
+  Damage damage;
+  /**
+   * Areas of the window which have been damaged
+   * since we last looked.
+   */
+  GdkRegion *damaged;
+  /**
+   * Hashes of the tiles of the last whole-window grab,
+   * so that we can tell which parts of it changed.
+   */
+  TileHash *tiles;
+  /**
+   * Finds content which has scrolled between frames.
+   */
+  ScrollDetect *scroll;
+  VncEncodingPolicy policy;
+  /**
+   * What each client listed in its SetEncodings, as
+   * ADVERTISED_* flags, keyed by libvncserver's socket
+   * for it.  It's written on the main thread before the
+   * plugin passes the SetEncodings on, so it's up to
+   * date by the time libvncserver reads it, and read by
+   * the encoders.  "advertised_lock" guards it, and is
+   * only held to look it up or change it.
+   */
+  GHashTable *advertised;
+  GMutex *advertised_lock;
   rfbScreenInfoPtr rfb_screen;
+  /**
+   * Held by whoever is using "framebuffer" or
+   * "rfb_screen": the main thread while it commits a
+   * capture, or an encoder thread while it talks to
+   * the client.
+   */
+  GMutex *lock;
+  /**
+   * Whether this window is waiting for, or in, an
+   * encoder thread.  Each window is queued at most
+   * once, which bounds the queue.  Only touched on
+   * the main thread.
+   */
+  gboolean queued;
+  /**
+   * Whether something happened while we were queued
+   * which means we need to go round again.
+   */
+  gboolean requeue;
+  /**
+   * How long, in milliseconds, until we next look for
+   * changes.  This shrinks while the window keeps
+   * changing, and grows while it's idle or while the
+   * client can't keep up.
+   */
+  guint interval;
+  /**
+   * The timeout which will next look for changes.
+   */
+  guint capture_source;
+  /**
+   * Whether we slowed down last time because the
+   * client wasn't reading what we'd sent.
+   */
+  gboolean throttled;
+  /**
+   * Whether the plugin has told us that the link
+   * beyond it is backed up.
+   */
+  gboolean congested;
+  /**
+   * Whether the last encode held back updates for a
+   * client which wasn't being read, so that we should
+   * encode again once it catches up, even if nothing
+   * has changed.  Only touched with "lock" held.
+   */
+  gboolean held;
+  /**
+   * For working out how often we really send frames:
+   * the time since we last worked it out, how many
+   * frames we've sent since then, and the answer.
+   */
+  GTimer *fps_timer;
+  int frames;
+  double observed_fps;
   XDevice *xtest_pointer;
   XDevice *xtest_keyboard;
   int master_pointer;
@@ -69,12 +303,130 @@ int vnc_latestSerial = 0;
 vnc_mouse_movement_cb mouse_movement_cb = NULL;
 gpointer mouse_movement_user_data = NULL;
 
+/**
+ * Whether the X server supports the DAMAGE extension.
+ * -1 means we haven't asked yet.
+ */
+static int damage_available = -1;
+static int damage_event_base = 0;
+
+/**
+ * Whether the X server supports MIT-SHM and we're
+ * allowed to use it.  -1 means we haven't asked yet.
+ */
+static int shm_available = -1;
+
+/**
+ * If there are more changed rectangles than this on
+ * a single tick, we merge them; one large XGetImage or
+ * update is cheaper than many small ones.
+ */
+#define MAX_DIRTY_RECTS 32
+
+/**
+ * Rows of the framebuffer start on multiples of this
+ * many bytes, which keeps the scanning kernels on
+ * aligned loads and whole cache lines.
+ */
+#define FRAMEBUFFER_ALIGNMENT 64
+
+/**
+ * We don't look for scrolling in changed areas with
+ * fewer pixels than this; it's cheaper to resend them.
+ */
+#define SCROLL_MIN_AREA (64*64)
+
+/**
+ * How many threads encode updates and talk to the
+ * clients, between all the shared windows.
+ */
+#define ENCODER_THREADS 2
+
+/**
+ * The pool of encoder threads, or NULL if we haven't
+ * needed it yet.
+ */
+static GThreadPool *encoders = NULL;
+
+/**
+ * The shortest and longest times, in milliseconds,
+ * between looks at a window, and where we start.
+ * The shortest is about one frame at 60Hz; the longest
+ * is a heartbeat for windows which aren't changing.
+ */
+#define MIN_INTERVAL 16
+#define MAX_INTERVAL 1000
+#define START_INTERVAL 100
+
+/**
+ * If more than this many bytes are waiting for the
+ * plugin to read them from a server's socket, we stop
+ * producing frames until it catches up.
+ */
+#define MAX_BACKLOG (256*1024)
+
+/**
+ * Whether to report on frame pacing.
+ */
+static gboolean debug_pacing = FALSE;
+
+/**
+ * Whether the clients are on this machine, in which
+ * case compressing updates costs more than it saves.
+ */
+static gboolean clients_are_local = FALSE;
+
+/**
+ * What the encoding policy settings may be called,
+ * and what they mean.
+ */
+static const struct {
+  const char *name;
+  int encoding;
+} encoding_names[] = {
+  { "auto", -1 },
+  { "raw", rfbEncodingRaw },
+  { "zlib", rfbEncodingZlib },
+  { "zrle", rfbEncodingZRLE },
+  { "tight", rfbEncodingTight },
+};
+
+#define DEFAULT_JPEG_QUALITY 6
+#define DEFAULT_ZLIB_LEVEL 6
+
+/**
+ * What a client listed in its SetEncodings: the
+ * encoding the window's policy chose, and any JPEG
+ * quality level.
+ */
+#define ADVERTISED_ENCODING 1
+#define ADVERTISED_QUALITY 2
+
+/**
+ * An input event from a client, on its way from an
+ * encoder thread to the main thread, since Xlib and
+ * gdk may only be used from the main thread.
+ */
+typedef struct _VncInputEvent {
+  VncPrivate *private;
+  gboolean is_keyboard;
+  int button_mask;
+  int x, y;
+  rfbBool down;
+  rfbKeySym key_sym;
+} VncInputEvent;
+
 static void
 ensure_servers (void)
 {
   if (servers)
     return;
 
+  /* Before GLib 2.32, threads must be set up before
+   * anything makes a mutex, as vnc_start() does. */
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
   servers = g_hash_table_new_full (g_int_hash,
 				   g_int_equal,
 				   g_free,
@@ -107,88 +459,1155 @@ fakeMouseClick (GdkWindow *window,
 			True,
 			CurrentTime);
 
-  /* we don't seem to get a release event, so... */
+  /* we don't seem to get a release event, so... */
+
+  XTestFakeButtonEvent (display,
+			1, False, 200);
+
+#else
+
+#error "XInput2 for mouse not yet implemented"
+
+#endif
+
+}
+
+static gboolean
+ensure_damage (void)
+{
+  int error_base;
+
+  if (damage_available == -1)
+    {
+      damage_available = XDamageQueryExtension (gdk_x11_get_default_xdisplay (),
+						&damage_event_base,
+						&error_base);
+
+      if (!damage_available)
+	g_warning ("No DAMAGE extension; polling shared windows instead");
+    }
+
+  return damage_available;
+}
+
+static gboolean
+ensure_shm (void)
+{
+  if (shm_available == -1)
+    {
+      shm_available = XShmQueryExtension (gdk_x11_get_default_xdisplay ()) &&
+	!g_getenv ("XZIBIT_NO_SHM");
+
+      if (!shm_available)
+	g_warning ("No MIT-SHM; reading shared windows over the wire");
+    }
+
+  return shm_available;
+}
+
+/**
+ * Sets up a shared memory segment for capturing the
+ * given window, if the server and the window's visual
+ * allow it.  Only 32-bit truecolour visuals are worth
+ * the trouble, since those can be served as they are.
+ *
+ * \return  TRUE if we can capture using shared memory.
+ */
+static gboolean
+attach_shm (VncPrivate *private,
+	    Window id)
+{
+  Display *display = gdk_x11_get_default_xdisplay ();
+  XWindowAttributes attributes;
+  XImage *probe;
+
+  private->shm.shmaddr = NULL;
+
+  if (!ensure_shm ())
+    return FALSE;
+
+  if (!XGetWindowAttributes (display, id, &attributes) ||
+      attributes.visual->class != TrueColor)
+    return FALSE;
+
+  private->visual = attributes.visual;
+  private->depth = attributes.depth;
+
+  probe = XShmCreateImage (display,
+			   private->visual,
+			   private->depth,
+			   ZPixmap,
+			   NULL,
+			   &private->shm,
+			   private->width,
+			   private->height);
+
+  if (!probe)
+    return FALSE;
+
+  if (probe->bits_per_pixel != 32)
+    {
+      XDestroyImage (probe);
+      return FALSE;
+    }
+
+  private->shm.shmid = shmget (IPC_PRIVATE,
+			       probe->bytes_per_line * probe->height,
+			       IPC_CREAT | 0600);
+  XDestroyImage (probe);
+
+  if (private->shm.shmid == -1)
+    {
+      g_warning ("Could not create shared memory segment; "
+		 "reading over the wire instead");
+      return FALSE;
+    }
+
+  private->shm.shmaddr = shmat (private->shm.shmid, NULL, 0);
+  private->shm.readOnly = False;
+
+  if (private->shm.shmaddr == (char*) -1)
+    {
+      shmctl (private->shm.shmid, IPC_RMID, NULL);
+      private->shm.shmaddr = NULL;
+      return FALSE;
+    }
+
+  gdk_error_trap_push ();
+  XShmAttach (display, &private->shm);
+  XSync (display, False);
+
+  /* Once the server has attached, nobody else needs
+   * to find the segment, and this way it goes away
+   * when we do.
+   */
+  shmctl (private->shm.shmid, IPC_RMID, NULL);
+
+  if (gdk_error_trap_pop ())
+    {
+      shmdt (private->shm.shmaddr);
+      private->shm.shmaddr = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Allocates a zeroed buffer with aligned rows for
+ * the given window size.
+ */
+static guchar*
+new_aligned_buffer (int rowstride,
+		    int height)
+{
+  gpointer result = NULL;
+
+  if (posix_memalign (&result,
+		      FRAMEBUFFER_ALIGNMENT,
+		      (gsize) rowstride * height)!=0)
+    g_error ("Could not allocate a %dx%d framebuffer",
+	     rowstride, height);
+
+  memset (result, 0, (gsize) rowstride * height);
+
+  return result;
+}
+
+/**
+ * Makes sure we have somewhere to read the window
+ * into other than shared memory.
+ */
+static void
+ensure_scratch (VncPrivate *private)
+{
+  if (private->scratch)
+    return;
+
+  private->scratch = new_aligned_buffer (private->rowstride,
+					 private->height);
+  private->scratch_pixbuf = gdk_pixbuf_new_from_data (private->scratch,
+						      GDK_COLORSPACE_RGB,
+						      TRUE, 8,
+						      private->width,
+						      private->height,
+						      private->rowstride,
+						      NULL, NULL);
+}
+
+/**
+ * Stops capturing using shared memory.  The
+ * framebuffer stays in the layout of the visual.
+ */
+static void
+detach_shm (VncPrivate *private)
+{
+  gdk_error_trap_push ();
+  XShmDetach (gdk_x11_get_default_xdisplay (), &private->shm);
+  XSync (gdk_x11_get_default_xdisplay (), False);
+  gdk_error_trap_pop ();
+
+  shmdt (private->shm.shmaddr);
+  private->shm.shmaddr = NULL;
+}
+
+/**
+ * Rearranges pixels gdk has read, which are RGBX,
+ * into the layout of the window's visual.
+ */
+static void
+convert_to_visual (VncPrivate *private,
+		   guchar *pixels,
+		   int width, int height)
+{
+  Visual *visual = private->visual;
+  int red_shift = g_bit_nth_lsf (visual->red_mask, -1);
+  int green_shift = g_bit_nth_lsf (visual->green_mask, -1);
+  int blue_shift = g_bit_nth_lsf (visual->blue_mask, -1);
+  int x, y;
+
+  for (y=0; y<height; y++)
+    {
+      guchar *in = pixels + y * private->rowstride;
+      guint32 *out = (guint32*) in;
+
+      for (x=0; x<width; x++)
+	out[x] = in[x*4] << red_shift |
+	  in[x*4+1] << green_shift |
+	  in[x*4+2] << blue_shift;
+    }
+}
+
+/**
+ * Tells libvncserver that our pixels are in the
+ * layout of the given visual, so that shared memory
+ * captures need no conversion.
+ */
+static void
+set_format_from_visual (rfbScreenInfoPtr screen,
+			Visual *visual)
+{
+  rfbPixelFormat *format = &screen->serverFormat;
+
+  format->redShift = g_bit_nth_lsf (visual->red_mask, -1);
+  format->greenShift = g_bit_nth_lsf (visual->green_mask, -1);
+  format->blueShift = g_bit_nth_lsf (visual->blue_mask, -1);
+  format->redMax = visual->red_mask >> format->redShift;
+  format->greenMax = visual->green_mask >> format->greenShift;
+  format->blueMax = visual->blue_mask >> format->blueShift;
+  format->bigEndian =
+    ImageByteOrder (gdk_x11_get_default_xdisplay ()) == MSBFirst;
+}
+
+/**
+ * Reads a rectangle of the window.
+ *
+ * \param stride  Set to the number of bytes between
+ *                the starts of rows of the result.
+ * \return  The top left pixel of the rectangle, in the
+ *          same format as the framebuffer, or NULL if
+ *          the window couldn't be read.  The pixels stay
+ *          valid until the next call.
+ */
+static const guchar*
+grab_rect (VncPrivate *private,
+	   int x, int y,
+	   int width, int height,
+	   int *stride)
+{
+  gboolean shm_failed = FALSE;
+
+  if (private->texture)
+    {
+      CoglHandle whole, area;
+      guchar *target = private->scratch + y * private->rowstride + x * 4;
+      int got = 0;
+
+      whole = clutter_texture_get_cogl_texture (CLUTTER_TEXTURE (private->texture));
+
+      if (whole != COGL_INVALID_HANDLE &&
+	  private->texture_x + x + width <= cogl_texture_get_width (whole) &&
+	  private->texture_y + y + height <= cogl_texture_get_height (whole))
+	{
+	  area = cogl_texture_new_from_sub_texture (whole,
+						    private->texture_x + x,
+						    private->texture_y + y,
+						    width, height);
+	  got = cogl_texture_get_data (area,
+				       COGL_PIXEL_FORMAT_RGBA_8888,
+				       private->rowstride,
+				       target);
+	  cogl_handle_unref (area);
+	}
+
+      if (got)
+	{
+	  *stride = private->rowstride;
+	  return target;
+	}
+
+      /* Otherwise, the window's probably been resized
+       * under us; ask the X server instead.
+       */
+    }
+
+  if (private->shm.shmaddr)
+    {
+      XImage *image;
+      gboolean ok;
+
+      image = XShmCreateImage (gdk_x11_get_default_xdisplay (),
+			       private->visual,
+			       private->depth,
+			       ZPixmap,
+			       private->shm.shmaddr,
+			       &private->shm,
+			       width, height);
+
+      if (!image)
+	return NULL;
+
+      gdk_error_trap_push ();
+      ok = XShmGetImage (gdk_x11_get_default_xdisplay (),
+			 GDK_WINDOW_XID (private->window),
+			 image,
+			 x, y,
+			 AllPlanes);
+      if (gdk_error_trap_pop ())
+	ok = FALSE;
+
+      *stride = image->bytes_per_line;
+
+      /* This frees the XImage but not the segment,
+       * which belongs to the shm info.
+       */
+      image->data = NULL;
+      XDestroyImage (image);
+
+      if (ok)
+	return (guchar*) private->shm.shmaddr;
+
+      /* Otherwise, try over the wire instead. */
+      shm_failed = TRUE;
+    }
+
+  ensure_scratch (private);
+
+  /* gdk converts to RGBX as it goes, and only
+   * within the rectangle.
+   */
+  if (gdk_pixbuf_get_from_drawable (private->scratch_pixbuf,
+				    private->window,
+				    gdk_colormap_get_system (),
+				    x, y,
+				    x, y,
+				    width, height)==NULL)
+    return NULL;
+
+  if (shm_failed)
+    {
+      /* The window can be read, so it's shared memory
+       * that's the trouble, and it won't get better.
+       */
+      g_warning ("MIT-SHM capture failed; reading over the wire instead");
+      detach_shm (private);
+    }
+
+  if (private->visual_format)
+    convert_to_visual (private,
+		       private->scratch + y * private->rowstride + x * 4,
+		       width, height);
+
+  *stride = private->rowstride;
+  return private->scratch + y * private->rowstride + x * 4;
+}
+
+/**
+ * Copies the rows of a freshly grabbed rectangle which
+ * differ from the framebuffer into the framebuffer,
+ * and tells libvncserver about them.
+ *
+ * \param pixels  The top left pixel of the grab.
+ * \param stride  Bytes between rows of the grab.
+ * \return  TRUE if anything changed.
+ */
+static gboolean
+commit_rows (VncPrivate *private,
+	     const guchar *pixels,
+	     int stride,
+	     int x, int y,
+	     int width, int height)
+{
+  gsize offset = y * private->rowstride + x * 4;
+  int first, last, row;
+
+  if (width <= 0 || height <= 0 ||
+      !pixel_scan_diff (pixels,
+			stride,
+			private->framebuffer + offset,
+			private->rowstride,
+			width * 4,
+			height,
+			&first, &last))
+    return FALSE;
+
+  for (row=first; row<=last; row++)
+    {
+      memcpy (private->framebuffer + offset + row * private->rowstride,
+	      pixels + row * stride,
+	      width * 4);
+    }
+
+  rfbMarkRectAsModified (private->rfb_screen,
+			 x, y + first,
+			 x + width,
+			 y + last + 1);
+
+  return TRUE;
+}
+
+/**
+ * Like commit_rows(), but first looks for content which
+ * has scrolled since the last frame.  If there is some,
+ * we move it within the framebuffer and tell the client
+ * to do the same with a CopyRect, so that only the
+ * pixels which are really new get encoded.
+ */
+static gboolean
+commit_rect (VncPrivate *private,
+	     const guchar *pixels,
+	     int stride,
+	     int x, int y,
+	     int width, int height)
+{
+  ScrollDetectMove move;
+  int mx, my;
+
+  if (width * height < SCROLL_MIN_AREA ||
+      !scroll_detect_find (private->scroll,
+			   private->framebuffer +
+			   y * private->rowstride + x * 4,
+			   private->rowstride,
+			   pixels,
+			   stride,
+			   width, height,
+			   &move))
+    return commit_rows (private, pixels, stride,
+			x, y, width, height);
+
+  mx = x + move.x;
+  my = y + move.y;
+
+  rfbDoCopyRect (private->rfb_screen,
+		 mx, my,
+		 mx + move.width,
+		 my + move.height,
+		 move.dx, move.dy);
+
+  /* Now send whatever's left: the bands above and
+   * below what moved, the bands to either side of it,
+   * and, in case two lines hashed the same, anything
+   * the copy didn't get right.
+   */
+  commit_rows (private,
+	       pixels, stride,
+	       x, y,
+	       width, move.y);
+  commit_rows (private,
+	       pixels + (move.y + move.height) * stride, stride,
+	       x, my + move.height,
+	       width, height - move.y - move.height);
+  commit_rows (private,
+	       pixels + move.y * stride, stride,
+	       x, my,
+	       move.x, move.height);
+  commit_rows (private,
+	       pixels + move.y * stride + (move.x + move.width) * 4, stride,
+	       mx + move.width, my,
+	       width - move.x - move.width, move.height);
+  commit_rows (private,
+	       pixels + move.y * stride + move.x * 4, stride,
+	       mx, my,
+	       move.width, move.height);
+
+  return TRUE;
+}
+
+/**
+ * Reads back only the parts of the window which have
+ * been damaged since the last tick.  Windows with no
+ * damage cost nothing at all.
+ *
+ * \return  TRUE if anything changed.
+ */
+static gboolean
+capture_damage (VncPrivate *private)
+{
+  GdkRectangle whole = { 0, 0, private->width, private->height };
+  GdkRectangle *rects;
+  GdkRegion *bounds;
+  gboolean changed = FALSE;
+  int n_rects, i;
+
+  if (gdk_region_empty (private->damaged))
+    return FALSE;
+
+  bounds = gdk_region_rectangle (&whole);
+  gdk_region_intersect (private->damaged, bounds);
+  gdk_region_destroy (bounds);
+
+  gdk_region_get_rectangles (private->damaged,
+			     &rects, &n_rects);
+
+  if (n_rects > MAX_DIRTY_RECTS)
+    {
+      gdk_region_get_clipbox (private->damaged,
+			      &rects[0]);
+      n_rects = 1;
+    }
+
+  gdk_region_destroy (private->damaged);
+  private->damaged = gdk_region_new ();
+
+  for (i=0; i<n_rects; i++)
+    {
+      GdkRectangle *r = &rects[i];
+      const guchar *pixels;
+      int stride;
+
+      pixels = grab_rect (private,
+			  r->x, r->y,
+			  r->width, r->height,
+			  &stride);
+
+      if (!pixels)
+	{
+	  g_warning ("Could not read back damaged area; bailing");
+	  break;
+	}
+
+      /* Damage is often reported for areas which were
+       * repainted with the same pixels, so check.
+       */
+      changed |= commit_rect (private,
+			      pixels, stride,
+			      r->x, r->y,
+			      r->width, r->height);
+    }
+
+  g_free (rects);
+
+  return changed;
+}
+
+/**
+ * Grabs the whole window and works out which tiles
+ * of it changed since the last grab.  This is what we
+ * do when we can't use DAMAGE, and for the very first
+ * frame.
+ *
+ * \return  TRUE if anything changed.
+ */
+static gboolean
+capture_whole_window (VncPrivate *private)
+{
+  TileHashRect rects[MAX_DIRTY_RECTS];
+  const guchar *pixels;
+  gboolean changed = FALSE;
+  int stride;
+  int n_rects, i;
+
+  pixels = grab_rect (private,
+		      0, 0,
+		      private->width,
+		      private->height,
+		      &stride);
+
+  if (!pixels)
+    {
+      g_warning ("Screenshot was null; bailing");
+      return FALSE;
+    }
+
+  n_rects = tile_hash_update (private->tiles,
+			      pixels,
+			      stride,
+			      4,
+			      rects,
+			      G_N_ELEMENTS (rects));
+
+  for (i=0; i<n_rects; i++)
+    {
+      TileHashRect *r = &rects[i];
+
+      changed |= commit_rect (private,
+			      pixels + r->y * stride + r->x * 4,
+			      stride,
+			      r->x, r->y,
+			      r->width, r->height);
+    }
+
+  if (!private->have_frame)
+    {
+      /* The framebuffer started out black, so parts of
+       * the window which are black won't have been
+       * marked; make sure the client gets everything.
+       */
+      rfbMarkRectAsModified (private->rfb_screen,
+			     0, 0,
+			     private->width, private->height);
+      private->have_frame = TRUE;
+      changed = TRUE;
+    }
+
+  return changed;
+}
+
+static void wake_capture (VncPrivate *private);
+
+/**
+ * Called by the compositor when part of a window's
+ * texture is redrawn.  This is our damage when we're
+ * reading from the texture.
+ */
+static void
+texture_updated (ClutterX11TexturePixmap *texture,
+		 gint x, gint y,
+		 gint width, gint height,
+		 gpointer data)
+{
+  VncPrivate *private = (VncPrivate*) data;
+  GdkRectangle area;
+
+  area.x = x - private->texture_x;
+  area.y = y - private->texture_y;
+  area.width = width;
+  area.height = height;
+
+  gdk_region_union_with_rect (private->damaged,
+			      &area);
+  wake_capture (private);
+}
+
+/**
+ * Reads a CARDINAL property of a window.
+ *
+ * \return  The value, or "fallback" if there isn't one.
+ */
+static int
+get_cardinal_property (Window id,
+		       const char *name,
+		       int fallback)
+{
+  Atom type;
+  int format;
+  unsigned long count, remaining;
+  unsigned char *value = NULL;
+  int result = fallback;
+
+  if (XGetWindowProperty (gdk_x11_get_default_xdisplay (),
+			  id,
+			  gdk_x11_get_xatom_by_name (name),
+			  0, 1, False,
+			  gdk_x11_get_xatom_by_name ("CARDINAL"),
+			  &type, &format,
+			  &count, &remaining,
+			  &value)==Success &&
+      value && format==32 && count==1)
+    result = (int) *((long*) value);
+
+  if (value)
+    XFree (value);
+
+  return result;
+}
+
+/**
+ * Parses the name of an encoding.
+ *
+ * \return  The encoding, -1 for "auto", or "fallback"
+ *          if we don't know the name.
+ */
+static int
+parse_encoding (const char *name,
+		int fallback)
+{
+  int i;
+
+  if (!name)
+    return fallback;
+
+  for (i=0; i<G_N_ELEMENTS (encoding_names); i++)
+    {
+      if (g_ascii_strcasecmp (name, encoding_names[i].name)==0)
+	return encoding_names[i].encoding;
+    }
+
+  g_warning ("Unknown encoding '%s'", name);
+
+  return fallback;
+}
+
+/**
+ * Works out how a window's updates should be encoded.
+ * The XZIBIT_ENCODING, XZIBIT_JPEG_QUALITY and
+ * XZIBIT_ZLIB_LEVEL environment variables set the
+ * defaults, and the _XZIBIT_ENCODING, _XZIBIT_JPEG_QUALITY
+ * and _XZIBIT_ZLIB_LEVEL properties of the window
+ * override them.  If the encoding is still "auto", we
+ * send Raw to local clients, and Tight, with JPEG for
+ * photographic tiles only, to anyone else.
+ */
+static void
+choose_encoding_policy (VncPrivate *private,
+			Window id)
+{
+  VncEncodingPolicy *policy = &private->policy;
+  const char *quality = g_getenv ("XZIBIT_JPEG_QUALITY");
+  const char *level = g_getenv ("XZIBIT_ZLIB_LEVEL");
+  gchar *name = NULL;
+  Atom type;
+  int format;
+  unsigned long count, remaining;
+
+  policy->encoding = parse_encoding (g_getenv ("XZIBIT_ENCODING"), -1);
+  policy->jpeg_quality = quality? atoi (quality): DEFAULT_JPEG_QUALITY;
+  policy->zlib_level = level? atoi (level): DEFAULT_ZLIB_LEVEL;
+
+  if (XGetWindowProperty (gdk_x11_get_default_xdisplay (),
+			  id,
+			  gdk_x11_get_xatom_by_name ("_XZIBIT_ENCODING"),
+			  0, 32, False,
+			  gdk_x11_get_xatom_by_name ("STRING"),
+			  &type, &format,
+			  &count, &remaining,
+			  (unsigned char**) &name)==Success && name)
+    {
+      policy->encoding = parse_encoding (name, policy->encoding);
+      XFree (name);
+    }
+
+  policy->jpeg_quality = get_cardinal_property (id,
+						"_XZIBIT_JPEG_QUALITY",
+						policy->jpeg_quality);
+  policy->zlib_level = get_cardinal_property (id,
+					      "_XZIBIT_ZLIB_LEVEL",
+					      policy->zlib_level);
+
+  if (policy->jpeg_quality < 0 || policy->jpeg_quality > 9)
+    policy->jpeg_quality = -1;
+
+  policy->zlib_level = CLAMP (policy->zlib_level, 0, 9);
+
+  if (policy->encoding == -1)
+    policy->encoding = clients_are_local? rfbEncodingRaw: rfbEncodingTight;
+}
+
+/**
+ * Called by libvncserver just before it encodes an
+ * update for a client.  The client said which encodings
+ * it understands when it connected, but we know more
+ * about the window and the link than it does, so we
+ * choose among them.  libvncserver doesn't check that
+ * the client understands what we choose, so we never
+ * choose anything it didn't list; if it didn't list
+ * what the policy wants, libvncserver's own choice,
+ * the first it listed, stands.
+ */
+static void
+apply_encoding_policy (struct _rfbClientRec* cl)
+{
+  VncPrivate *private = (VncPrivate*) cl->screen->screenData;
+  int advertised;
+
+  g_mutex_lock (private->advertised_lock);
+  advertised = GPOINTER_TO_INT (g_hash_table_lookup (private->advertised,
+						     GINT_TO_POINTER (cl->sock)));
+  g_mutex_unlock (private->advertised_lock);
+
+  /* Every client understands Raw. */
+  if (private->policy.encoding == rfbEncodingRaw ||
+      (advertised & ADVERTISED_ENCODING))
+    cl->preferredEncoding = private->policy.encoding;
+
+  /* Any client can be spared JPEG, but only one which
+   * gave a quality level can be sent it. */
+  if (private->policy.jpeg_quality == -1 ||
+      (advertised & ADVERTISED_QUALITY))
+    cl->tightQualityLevel = private->policy.jpeg_quality;
+
+  /* Any zlib stream can be read, whatever its level. */
+  cl->tightCompressLevel = private->policy.zlib_level;
+  cl->zlibCompressLevel = private->policy.zlib_level;
+}
+
+static void queue_encoding (VncPrivate *private);
+static gboolean client_has_input (GIOChannel *source,
+				  GIOCondition condition,
+				  gpointer data);
+
+/**
+ * Starts listening for input from a client.
+ */
+static void
+watch_client (VncClient *client)
+{
+  client->input_watch = g_io_add_watch (client->input_channel,
+					G_IO_IN | G_IO_HUP | G_IO_ERR |
+					G_IO_NVAL,
+					client_has_input,
+					client);
+}
+
+/**
+ * Tells libvncserver about the clients added since
+ * it last heard.  Only called while we're not queued,
+ * so that no encoder has the lock.
+ */
+static void
+add_new_clients (VncPrivate *private)
+{
+  GSList *cursor;
+
+  if (!private->new_clients)
+    return;
+
+  g_mutex_lock (private->lock);
+  for (cursor = private->new_clients; cursor; cursor = cursor->next)
+    rfbNewClient (private->rfb_screen,
+		  ((VncClient*) cursor->data)->other_fd);
+  g_mutex_unlock (private->lock);
+
+  g_slist_free (private->new_clients);
+  private->new_clients = NULL;
+}
+
+/**
+ * Called on the main thread when an encoder thread
+ * has finished with a window.
+ */
+static gboolean
+encoding_finished (gpointer data)
+{
+  VncPrivate *private = (VncPrivate*) data;
+  GSList *cursor;
+
+  private->queued = FALSE;
+
+  add_new_clients (private);
+
+  if (private->requeue)
+    {
+      private->requeue = FALSE;
+      queue_encoding (private);
+      return FALSE;
+    }
+
+  for (cursor = private->clients; cursor; cursor = cursor->next)
+    {
+      VncClient *client = cursor->data;
+
+      if (!client->input_watch)
+	watch_client (client);
+    }
+
+  return FALSE;
+}
+
+/**
+ * Returns how many bytes have been written to a
+ * socket which the other end hasn't read yet.
+ */
+static int
+socket_backlog (int fd)
+{
+  int unsent = 0;
+
+  if (ioctl (fd, SIOCOUTQ, &unsent) != 0)
+    return 0;
+
+  return unsent;
+}
+
+/**
+ * Runs in an encoder thread, with the lock held: puts
+ * on hold the clients which the plugin isn't reading,
+ * so that libvncserver doesn't send them updates.
+ * Otherwise it would block this thread writing to
+ * them, and finally drop them.  Their updates build
+ * up until they're let go.
+ */
+static void
+hold_clients (VncPrivate *private)
+{
+  rfbClientIteratorPtr iterator;
+  rfbClientPtr cl;
+
+  private->held = FALSE;
+
+  iterator = rfbGetClientIterator (private->rfb_screen);
+  while ((cl = rfbClientIteratorNext (iterator)))
+    {
+      cl->onHold = private->congested ||
+	socket_backlog (cl->sock) > MAX_BACKLOG;
+
+      if (cl->onHold)
+	private->held = TRUE;
+    }
+  rfbReleaseClientIterator (iterator);
+}
+
+/**
+ * Runs in an encoder thread: reads whatever the
+ * client has sent, and sends it any updates it's
+ * asked for.
+ */
+static void
+encode_window (gpointer data,
+	       gpointer user_data)
+{
+  VncPrivate *private = (VncPrivate*) data;
+
+  g_mutex_lock (private->lock);
+
+  hold_clients (private);
+
+  /* We were queued because there's something to do,
+   * so there's no point waiting.
+   */
+  rfbProcessEvents (private->rfb_screen,
+		    0);
+
+  g_mutex_unlock (private->lock);
+
+  g_idle_add (encoding_finished,
+	      private);
+}
+
+/**
+ * Hands a window to the encoder threads, unless it's
+ * already there, in which case it'll go round again
+ * when it comes back.
+ */
+static void
+queue_encoding (VncPrivate *private)
+{
+  GSList *cursor;
+
+  if (private->queued)
+    {
+      private->requeue = TRUE;
+      return;
+    }
+
+  if (!encoders)
+    {
+      encoders = g_thread_pool_new (encode_window,
+				    NULL,
+				    ENCODER_THREADS,
+				    FALSE,
+				    NULL);
+    }
+
+  for (cursor = private->clients; cursor; cursor = cursor->next)
+    {
+      VncClient *client = cursor->data;
+
+      if (client->input_watch)
+	{
+	  /* The encoder will read the input; until then,
+	   * we don't want to hear about it again.
+	   */
+	  g_source_remove (client->input_watch);
+	  client->input_watch = 0;
+	}
+    }
+
+  private->queued = TRUE;
+  g_thread_pool_push (encoders,
+		      private,
+		      NULL);
+}
+
+static gboolean
+client_has_input (GIOChannel *source,
+		  GIOCondition condition,
+		  gpointer data)
+{
+  VncClient *client = (VncClient*) data;
+  VncPrivate *private = client->server;
+
+  /* queue_encoding() removes this watch */
+  client->input_watch = 0;
+
+  /* libvncserver closes its end once it notices,
+   * so we may see that rather than the hangup.
+   * Either way, the plugin has closed or will close
+   * "fd", and "other_fd" is libvncserver's, so we
+   * only have to forget the client.
+   */
+  if (condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+    {
+      g_mutex_lock (private->advertised_lock);
+      g_hash_table_remove (private->advertised,
+			   GINT_TO_POINTER (client->other_fd));
+      g_mutex_unlock (private->advertised_lock);
+
+      private->clients = g_slist_remove (private->clients, client);
+      g_io_channel_unref (client->input_channel);
+      g_byte_array_free (client->input, TRUE);
+      g_free (client);
+    }
+
+  /* Even after a hangup, so that libvncserver
+   * notices it. */
+  queue_encoding (private);
+
+  return FALSE;
+}
+
+/**
+ * Returns how many bytes the server has written
+ * which the plugin hasn't read yet, for whichever
+ * client is furthest behind.
+ */
+static int
+client_backlog (VncPrivate *private)
+{
+  GSList *cursor;
+  int result = 0;
+
+  for (cursor = private->clients; cursor; cursor = cursor->next)
+    {
+      VncClient *client = cursor->data;
+
+      result = MAX (result, socket_backlog (client->other_fd));
+    }
+
+  return result;
+}
+
+/**
+ * Works out how many frames per second we really
+ * sent, about once a second.
+ */
+static void
+update_observed_fps (VncPrivate *private)
+{
+  double elapsed = g_timer_elapsed (private->fps_timer, NULL);
+
+  if (elapsed < 1.0)
+    return;
+
+  private->observed_fps = private->frames / elapsed;
+  private->frames = 0;
+  g_timer_start (private->fps_timer);
 
-  XTestFakeButtonEvent (display,
-			1, False, 200);
+  if (debug_pacing)
+    g_print ("%08x: target %.1f fps, observed %.1f fps%s\n",
+	     (unsigned int) GDK_WINDOW_XID (private->window),
+	     1000.0 / private->interval,
+	     private->observed_fps,
+	     private->throttled? " (throttled)": "");
+}
 
-#else
+static gboolean run_rfb_event_loop (gpointer data);
 
-#error "XInput2 for mouse not yet implemented"
+static void
+schedule_capture (VncPrivate *private)
+{
+  private->capture_source = g_timeout_add (private->interval,
+					   run_rfb_event_loop,
+					   private);
+}
 
-#endif
+/**
+ * Called when we hear of damage.  If we've slowed
+ * down because the window was idle, look again soon
+ * rather than leaving the change unseen for up to
+ * MAX_INTERVAL.
+ */
+static void
+wake_capture (VncPrivate *private)
+{
+  if (private->interval <= START_INTERVAL || private->throttled)
+    return;
 
+  g_source_remove (private->capture_source);
+  private->interval = START_INTERVAL;
+  schedule_capture (private);
 }
 
+/**
+ * Captures the window on the main thread, which is
+ * where we must talk to X and the compositor.  The
+ * expensive part, encoding, happens elsewhere.
+ *
+ * Afterwards, decides when to look again: sooner if
+ * the window changed, later if it didn't, and much
+ * later if the client isn't keeping up.
+ */
 static gboolean
 run_rfb_event_loop (gpointer data)
 {
   VncPrivate *private = (VncPrivate*) data;
-  int checksum = 0, pixelcount, i;
-  char *pixels;
-
-  /* FIXME: We really want to snoop on what the
-     compositor already knows
-  */
+  gboolean changed, held;
 
-  GdkPixbuf *screenshot =
-    gdk_pixbuf_get_from_drawable (NULL,
-				  private->window,
-				  gdk_colormap_get_system (),
-				  0, 0, 0, 0,
-				  private->width,
-				  private->height);
+  private->throttled = private->congested ||
+    client_backlog (private) > MAX_BACKLOG;
 
-  if (screenshot==NULL)
+  if (private->throttled)
     {
-      g_warning ("Screenshot was null; bailing");
-      return TRUE;
+      /* Leave the damage to build up; sending more
+       * now would only make the backlog worse.
+       */
+      private->interval = MIN (private->interval * 2, MAX_INTERVAL);
     }
-
-  pixels = gdk_pixbuf_get_pixels (screenshot);
-  pixelcount = gdk_pixbuf_get_width(screenshot) * ((gdk_pixbuf_get_n_channels(screenshot) * gdk_pixbuf_get_bits_per_sample(screenshot)+7)/8);
-  pixelcount += (gdk_pixbuf_get_height(screenshot)-1) * gdk_pixbuf_get_rowstride(screenshot);
-  for (i=0; i < pixelcount; i++) {
-    checksum += pixels[i];
-  }
-
-  if (!private->screenshot_checksum_valid || checksum != private->screenshot_checksum)
+  else if (g_mutex_trylock (private->lock))
     {
-      private->screenshot_checksum = checksum;
-      private->screenshot_checksum_valid = TRUE;
+      if ((private->damage != None || private->texture) &&
+	  private->have_frame)
+	changed = capture_damage (private);
+      else
+	changed = capture_whole_window (private);
 
-      if (private->screenshot)
-	{
-	  g_object_unref (private->screenshot);
-	}
-
-      private->screenshot = gdk_pixbuf_add_alpha (screenshot,
-						  FALSE, 0, 0, 0);
-
-      private->rfb_screen->frameBuffer = gdk_pixbuf_get_pixels (private->screenshot);
+      held = private->held;
 
-      rfbMarkRectAsModified(private->rfb_screen,
-			    0, 0,
-			    gdk_pixbuf_get_width (screenshot),
-			    gdk_pixbuf_get_height (screenshot));
+      g_mutex_unlock (private->lock);
 
-      g_object_unref (screenshot);
+      /* Clients we held back last time are being
+       * read again, so they can have what they missed.
+       */
+      if (held && !changed)
+	queue_encoding (private);
 
+      if (changed)
+	{
+	  queue_encoding (private);
+	  private->frames++;
+	  private->interval = MAX (private->interval / 2, MIN_INTERVAL);
+	}
+      else
+	private->interval = MIN (private->interval + private->interval / 4,
+				 MAX_INTERVAL);
     }
 
-  rfbProcessEvents(private->rfb_screen,
-		   40000);
+  /* Otherwise an encoder is using the framebuffer.
+   * Rather than wait for it, leave the damage to build
+   * up until next time, at the same pace.
+   */
 
-  return TRUE;
+  update_observed_fps (private);
+  schedule_capture (private);
+
+  return FALSE;
 }
 
 static void
-handle_mouse_event (int buttonMask,
-		    int x, int y,
-		    struct _rfbClientRec* cl)
+handle_mouse_event (VncPrivate *private,
+		    int buttonMask,
+		    int x, int y)
 {
-  VncPrivate *private = (VncPrivate*) cl->screen->screenData;
-
   if (mouse_movement_cb)
     {
       mouse_movement_cb (GDK_WINDOW_XID (private->window),
@@ -206,11 +1625,10 @@ handle_mouse_event (int buttonMask,
 }
 
 static void
-handle_keyboard_event (rfbBool down,
-		       rfbKeySym keySym,
-		       struct _rfbClientRec* cl)
+handle_keyboard_event (VncPrivate *private,
+		       rfbBool down,
+		       rfbKeySym keySym)
 {
-  VncPrivate *private = (VncPrivate*) cl->screen->screenData;
   Display *display = gdk_x11_get_default_xdisplay();
   int current_pointer;
   int count;
@@ -296,6 +1714,63 @@ handle_keyboard_event (rfbBool down,
 #endif
 }
 
+static gboolean
+deliver_input_event (gpointer data)
+{
+  VncInputEvent *event = (VncInputEvent*) data;
+
+  if (event->is_keyboard)
+    handle_keyboard_event (event->private,
+			   event->down,
+			   event->key_sym);
+  else
+    handle_mouse_event (event->private,
+			event->button_mask,
+			event->x, event->y);
+
+  g_free (event);
+
+  return FALSE;
+}
+
+/**
+ * Called by libvncserver, in an encoder thread, when
+ * the client moves or clicks the mouse.
+ */
+static void
+queue_mouse_event (int buttonMask,
+		   int x, int y,
+		   struct _rfbClientRec* cl)
+{
+  VncInputEvent *event = g_new0 (VncInputEvent, 1);
+
+  event->private = (VncPrivate*) cl->screen->screenData;
+  event->button_mask = buttonMask;
+  event->x = x;
+  event->y = y;
+
+  g_idle_add (deliver_input_event, event);
+}
+
+/**
+ * Called by libvncserver, in an encoder thread, when
+ * the client presses or releases a key.
+ */
+static void
+queue_keyboard_event (rfbBool down,
+		      rfbKeySym keySym,
+		      struct _rfbClientRec* cl)
+{
+  VncInputEvent *event = g_new0 (VncInputEvent, 1);
+
+  event->private = (VncPrivate*) cl->screen->screenData;
+  event->is_keyboard = TRUE;
+  event->down = down;
+  event->key_sym = keySym;
+
+  g_idle_add (deliver_input_event, event);
+}
+
 static void
 add_mpx_for_window (Window window, VncPrivate *private)
 {
@@ -357,12 +1832,43 @@ add_mpx_for_window (Window window, VncPrivate *private)
   g_free (name);
 }
 
+/**
+ * Makes a new client for a server, with a pair of
+ * connected sockets, and adds it to the server's list.
+ *
+ * \return  The client, or NULL if we couldn't make
+ *          the sockets.
+ */
+static VncClient*
+new_client (VncPrivate *private)
+{
+  VncClient *client;
+  int sockets[2];
+
+  if (socketpair (AF_LOCAL, SOCK_STREAM, 0, sockets) != 0)
+    {
+      g_warning ("Could not make a socket pair for a VNC client");
+      return NULL;
+    }
+
+  client = g_malloc0 (sizeof (VncClient));
+  client->server = private;
+  client->fd = sockets[0];
+  client->other_fd = sockets[1];
+  client->input_channel = g_io_channel_unix_new (client->other_fd);
+  client->input = g_byte_array_new ();
+  client->handshake_length = 3;
+
+  private->clients = g_slist_append (private->clients, client);
+
+  return client;
+}
+
 void
 vnc_create (Window id)
 {
   VncPrivate *private = NULL;
   int *key;
-  int sockets[2];
 
   ensure_servers ();
 
@@ -380,12 +1886,23 @@ vnc_create (Window id)
   key = g_malloc (sizeof(int));
   *key = id;
 
-  socketpair (AF_LOCAL, SOCK_STREAM, 0, sockets);
-
   private = g_malloc (sizeof(VncPrivate));
-  private->fd = sockets[0];
-  private->other_fd = sockets[1];
+  private->clients = NULL;
+  private->new_clients = NULL;
+  private->rfb_screen = NULL;
+  if (!new_client (private))
+    {
+      g_free (private);
+      g_free (key);
+      return;
+    }
+  private->advertised = g_hash_table_new (g_direct_hash, g_direct_equal);
+  private->advertised_lock = g_mutex_new ();
   private->width = private->height = 0;
+  private->texture = NULL;
+  private->shm.shmaddr = NULL;
+  private->congested = FALSE;
+  private->held = FALSE;
 
   g_hash_table_insert (servers,
 		       key,
@@ -430,9 +1947,43 @@ vnc_start (Window id)
   private->height = height;
   g_warning ("Window is %dx%d", width, height);
   private->window = gdk_window_foreign_new (id);
-  private->screenshot = NULL;
-  private->screenshot_checksum = 0;
-  private->screenshot_checksum_valid = FALSE;
+  private->rowstride = (width * 4 + FRAMEBUFFER_ALIGNMENT - 1) &
+    ~(FRAMEBUFFER_ALIGNMENT - 1);
+  private->framebuffer = new_aligned_buffer (private->rowstride, height);
+
+  private->scratch = NULL;
+  private->scratch_pixbuf = NULL;
+  if (private->texture || !attach_shm (private, id))
+    ensure_scratch (private);
+  private->have_frame = FALSE;
+  private->tiles = tile_hash_new (width, height);
+  private->scroll = scroll_detect_new (width, height);
+  private->damage = None;
+  private->damaged = gdk_region_new ();
+
+  if (private->texture)
+    {
+      /* The compositor already listens for damage,
+       * and tells the texture about it.
+       */
+      g_signal_connect (private->texture,
+			"update-area",
+			G_CALLBACK (texture_updated),
+			private);
+    }
+  else if (ensure_damage ())
+    {
+      gdk_error_trap_push ();
+      private->damage = XDamageCreate (gdk_x11_get_default_xdisplay (),
+				       id,
+				       XDamageReportRawRectangles);
+      if (gdk_error_trap_pop ())
+	{
+	  g_warning ("Could not watch %x for damage; polling it instead",
+		     (unsigned int) id);
+	  private->damage = None;
+	}
+    }
 
   add_mpx_for_window (id, private);
 
@@ -440,24 +1991,51 @@ vnc_start (Window id)
 				     0, NULL,
 				     width,
 				     height,
-				     /* FIXME don't hardcode these */
-				     8, 1, 4);
+				     /* eight bits each of red, green
+				      * and blue, in four bytes; the
+				      * capture backend may move them
+				      * around below
+				      */
+				     8, 3, 4);
 
   private->rfb_screen->desktopName = "Chicken Man"; /* FIXME */
   private->rfb_screen->autoPort = FALSE;
   private->rfb_screen->port = 0;
-  private->rfb_screen->fdFromParent = private->other_fd;
-  private->rfb_screen->frameBuffer = NULL;
+  private->rfb_screen->fdFromParent =
+    ((VncClient*) private->clients->data)->other_fd;
+  private->rfb_screen->frameBuffer = (char*) private->framebuffer;
+  private->rfb_screen->paddedWidthInBytes = private->rowstride;
+  /* We only run the encoder when there's something
+   * to do, so there may be no later chance to send
+   * an update which was put off.
+   */
+  private->rfb_screen->deferUpdateTime = 0;
+
+  private->visual_format = private->shm.shmaddr != NULL;
+  if (private->visual_format)
+    set_format_from_visual (private->rfb_screen,
+			    private->visual);
 
   rfbInitServer (private->rfb_screen);
 
   private->rfb_screen->screenData = private;
-  private->rfb_screen->ptrAddEvent = handle_mouse_event;
-  private->rfb_screen->kbdAddEvent = handle_keyboard_event;
+  private->rfb_screen->ptrAddEvent = queue_mouse_event;
+  private->rfb_screen->kbdAddEvent = queue_keyboard_event;
+
+  choose_encoding_policy (private, id);
+  private->rfb_screen->displayHook = apply_encoding_policy;
+
+  private->lock = g_mutex_new ();
+  private->queued = FALSE;
+  private->requeue = FALSE;
+  watch_client (private->clients->data);
 
-  g_timeout_add (100,
-		 run_rfb_event_loop,
-		 private);
+  private->interval = START_INTERVAL;
+  private->throttled = FALSE;
+  private->fps_timer = g_timer_new ();
+  private->frames = 0;
+  private->observed_fps = 0.0;
+  schedule_capture (private);
 
 }
 
@@ -472,12 +2050,364 @@ vnc_fd (Window id)
   private = g_hash_table_lookup (servers,
 				 &id);
 
-  if (private)
-    return private->fd;
+  if (private && private->clients)
+    return ((VncClient*) private->clients->data)->fd;
   else
     return -1;
 }
 
+int
+vnc_add_client (Window id)
+{
+  VncPrivate *private = NULL;
+  VncClient *client;
+
+  if (!servers)
+    return -1;
+
+  private = g_hash_table_lookup (servers,
+				 &id);
+
+  if (!private || !private->rfb_screen)
+    return -1;
+
+  client = new_client (private);
+  if (!client)
+    return -1;
+
+  g_warning ("Adding VNC client %d for %08x",
+	     g_slist_length (private->clients),
+	     (unsigned int) id);
+
+  private->new_clients = g_slist_append (private->new_clients, client);
+
+  /* If we're queued, encoding_finished() will add
+   * and watch it for us.
+   */
+  if (!private->queued)
+    {
+      add_new_clients (private);
+      watch_client (client);
+    }
+
+  return client->fd;
+}
+
+/**
+ * Returns how long the message from a client at the
+ * start of "message" is, given "available" bytes of
+ * it; 0 if we can't tell yet; -1 if we don't know the
+ * message.
+ */
+static gssize
+client_message_length (VncClient *client,
+		       const guchar *message,
+		       gsize available)
+{
+  if (client->handshake_seen < client->handshake_length)
+    return client->handshake_seen==0? sz_rfbProtocolVersionMsg: 1;
+
+  switch (message[0])
+    {
+    case rfbSetPixelFormat:
+      return sz_rfbSetPixelFormatMsg;
+
+    case rfbSetEncodings:
+      if (available < sz_rfbSetEncodingsMsg)
+	return 0;
+      return sz_rfbSetEncodingsMsg + 4 * (message[2] << 8 | message[3]);
+
+    case rfbFramebufferUpdateRequest:
+      return sz_rfbFramebufferUpdateRequestMsg;
+
+    case rfbKeyEvent:
+      return sz_rfbKeyEventMsg;
+
+    case rfbPointerEvent:
+      return sz_rfbPointerEventMsg;
+
+    case rfbClientCutText:
+      if (available < sz_rfbClientCutTextMsg)
+	return 0;
+      return sz_rfbClientCutTextMsg +
+	((gsize) message[4] << 24 | message[5] << 16 |
+	 message[6] << 8 | message[7]);
+
+    default:
+      return -1;
+    }
+}
+
+/**
+ * Records which encodings a client listed, from its
+ * SetEncodings message.
+ */
+static void
+note_encodings (VncClient *client,
+		const guchar *message,
+		gsize length)
+{
+  VncPrivate *private = client->server;
+  int advertised = 0;
+  gsize i;
+
+  for (i=sz_rfbSetEncodingsMsg; i+4<=length; i+=4)
+    {
+      guint32 encoding = (guint32) message[i] << 24 | message[i+1] << 16 |
+	message[i+2] << 8 | message[i+3];
+
+      if (encoding == (guint32) private->policy.encoding)
+	advertised |= ADVERTISED_ENCODING;
+      else if (encoding >= rfbEncodingQualityLevel0 &&
+	       encoding <= rfbEncodingQualityLevel9)
+	advertised |= ADVERTISED_QUALITY;
+    }
+
+  g_mutex_lock (private->advertised_lock);
+  g_hash_table_insert (private->advertised,
+		       GINT_TO_POINTER (client->other_fd),
+		       GINT_TO_POINTER (advertised));
+  g_mutex_unlock (private->advertised_lock);
+}
+
+/**
+ * Stops following what a client sends, and leaves its
+ * encodings to libvncserver from now on.
+ */
+static void
+lose_track (VncClient *client)
+{
+  VncPrivate *private = client->server;
+
+  client->lost = TRUE;
+  g_byte_array_set_size (client->input, 0);
+
+  g_mutex_lock (private->advertised_lock);
+  g_hash_table_remove (private->advertised,
+		       GINT_TO_POINTER (client->other_fd));
+  g_mutex_unlock (private->advertised_lock);
+}
+
+void
+vnc_client_input (Window id,
+		  int fd,
+		  const guchar *data,
+		  gsize length)
+{
+  VncPrivate *private = NULL;
+  VncClient *client = NULL;
+  GByteArray *input;
+  GSList *cursor;
+  gsize count;
+
+  if (servers)
+    private = g_hash_table_lookup (servers,
+				   &id);
+
+  if (!private)
+    return;
+
+  for (cursor = private->clients; cursor; cursor = cursor->next)
+    if (((VncClient*) cursor->data)->fd == fd)
+      client = cursor->data;
+
+  if (!client || client->lost)
+    return;
+
+  /* The rest of a message we don't need to look at. */
+  count = MIN (length, client->skip);
+  client->skip -= count;
+  length -= count;
+  if (data)
+    data += count;
+
+  if (!length)
+    return;
+
+  if (!data)
+    {
+      lose_track (client);
+      return;
+    }
+
+  input = client->input;
+  g_byte_array_append (input, data, length);
+
+  while (input->len)
+    {
+      gssize needed = client_message_length (client,
+					     input->data,
+					     input->len);
+
+      if (needed<0)
+	{
+	  g_warning ("VNC client sent message type %d, which we don't know; "
+		     "leaving its encodings to libvncserver",
+		     input->data[0]);
+	  lose_track (client);
+	  return;
+	}
+
+      if (needed==0)
+	break;
+
+      if (client->handshake_seen < client->handshake_length)
+	{
+	  if (needed > input->len)
+	    break;
+
+	  /* "RFB 003.00x\n": before 3.7, there's no
+	   * choice of security type to send. */
+	  if (client->handshake_seen==0 &&
+	      (input->data[8]-'0')*100 +
+	      (input->data[9]-'0')*10 +
+	      (input->data[10]-'0') < 7)
+	    client->handshake_length = 2;
+
+	  client->handshake_seen++;
+	}
+      else if (input->data[0] == rfbSetEncodings)
+	{
+	  if (needed > input->len)
+	    break;
+
+	  note_encodings (client, input->data, needed);
+	}
+      else if (needed > input->len)
+	{
+	  client->skip = needed - input->len;
+	  g_byte_array_set_size (input, 0);
+	  break;
+	}
+
+      g_byte_array_remove_range (input, 0, needed);
+    }
+}
+
+gboolean
+vnc_handle_xevent (XEvent *event)
+{
+  XDamageNotifyEvent *notify = (XDamageNotifyEvent*) event;
+  VncPrivate *private;
+  Window drawable;
+  GdkRectangle area;
+
+  if (!servers || damage_available!=1 ||
+      event->type != damage_event_base + XDamageNotify)
+    return FALSE;
+
+  drawable = notify->drawable;
+  private = g_hash_table_lookup (servers,
+				 &drawable);
+
+  if (!private || private->damage != notify->damage)
+    return FALSE;
+
+  area.x = notify->area.x;
+  area.y = notify->area.y;
+  area.width = notify->area.width;
+  area.height = notify->area.height;
+
+  gdk_region_union_with_rect (private->damaged,
+			      &area);
+  wake_capture (private);
+
+  return TRUE;
+}
+
+void
+vnc_set_texture (Window id,
+		 ClutterActor *texture,
+		 int x_offset,
+		 int y_offset)
+{
+  VncPrivate *private = NULL;
+
+  if (!servers)
+    return;
+
+  private = g_hash_table_lookup (servers,
+				 &id);
+
+  if (!private)
+    return;
+
+  if (private->width != 0)
+    {
+      g_warning ("Texture supplied for %x, which has already started",
+		 (unsigned int) id);
+      return;
+    }
+
+  if (!CLUTTER_IS_X11_TEXTURE_PIXMAP (texture))
+    {
+      /* We can't hear about damage to it, so it's
+       * no use to us.
+       */
+      return;
+    }
+
+  private->texture = texture;
+  private->texture_x = x_offset;
+  private->texture_y = y_offset;
+
+  g_object_add_weak_pointer (G_OBJECT (texture),
+			     (gpointer*) &private->texture);
+}
+
+gboolean
+vnc_get_pacing (Window id,
+		double *target_fps,
+		double *observed_fps)
+{
+  VncPrivate *private = NULL;
+
+  if (!servers)
+    return FALSE;
+
+  private = g_hash_table_lookup (servers,
+				 &id);
+
+  if (!private || private->width == 0)
+    return FALSE;
+
+  if (target_fps)
+    *target_fps = 1000.0 / private->interval;
+
+  if (observed_fps)
+    *observed_fps = private->observed_fps;
+
+  return TRUE;
+}
+
+void
+vnc_set_congested (Window id,
+		   gboolean congested)
+{
+  VncPrivate *private = NULL;
+
+  if (!servers)
+    return;
+
+  private = g_hash_table_lookup (servers,
+				 &id);
+
+  if (private)
+    private->congested = congested;
+}
+
+void
+vnc_set_debug_pacing (gboolean debug)
+{
+  debug_pacing = debug;
+}
+
+void
+vnc_set_clients_local (gboolean local)
+{
+  clients_are_local = local;
+}
+
 void
 vnc_supply_pixmap (Window id,
 		   GdkPixbuf *pixbuf)
@@ -2,7 +2,9 @@
 #define VNC_H 1
 
 #include <X11/X.h>
+#include <X11/Xlib.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <clutter/clutter.h>
 
 extern int vnc_latestTime;
 extern int vnc_latestSerial;
@@ -23,12 +25,112 @@ void vnc_create (Window id);
 void vnc_start (Window id);
 
 /**
- * Returns the file descriptor which the server for the
- * given X ID is listening on.  If there is no server
- * for the given X ID, returns -1.
+ * Returns the file descriptor for the oldest client of
+ * the server for the given X ID which hasn't hung up;
+ * until the server starts, that's the one made along
+ * with it.  If there is no server for the given X ID,
+ * or it has no clients left, returns -1; use
+ * vnc_add_client() to give a running server another.
  */
 int vnc_fd (Window id);
 
+/**
+ * Adds another client to the running server for the
+ * given X ID, so that one capture of the window can
+ * be sent to several viewers.
+ *
+ * \return  The file descriptor for the new client, or
+ *          -1 if there is no running server for the
+ *          given X ID.
+ */
+int vnc_add_client (Window id);
+
+/**
+ * Tells the server for the given X ID what the plugin
+ * is passing on to it from one of its clients, so that
+ * we know which encodings the client understands.  It
+ * must be called before the data is written, unless
+ * "data" is NULL.
+ *
+ * \param id      The X ID.
+ * \param fd      The client's file descriptor, as
+ *                returned by vnc_fd() or vnc_add_client().
+ * \param data    The data, or NULL if it went some way
+ *                we couldn't see, such as splice().
+ * \param length  How long it is.
+ */
+void vnc_client_input (Window id,
+		       int fd,
+		       const guchar *data,
+		       gsize length);
+
+/**
+ * Offers an X event to the VNC servers.  If it's
+ * damage to one of the windows we're serving, we
+ * note it so that only that area gets read back.
+ *
+ * \return  TRUE if the event was ours, in which case
+ *          nobody else needs to see it.
+ */
+gboolean vnc_handle_xevent (XEvent *event);
+
+/**
+ * Tells the VNC server for the given X ID where the
+ * compositor keeps the window's pixels, so that it can
+ * read them from there rather than from the X server.
+ * This also works when the window is partly covered.
+ * Must be called after vnc_create() and before
+ * vnc_start(); otherwise, does nothing.
+ *
+ * \param id        The window.
+ * \param texture   The window's texture actor.
+ * \param x_offset  Where the window's contents start
+ * \param y_offset  within the texture.
+ */
+void vnc_set_texture (Window id,
+		      ClutterActor *texture,
+		      int x_offset,
+		      int y_offset);
+
+/**
+ * Reports how often the VNC server for the given X ID
+ * is looking for changes, and how often it really
+ * sends them.  Either pointer may be NULL.
+ *
+ * \param id            The window.
+ * \param target_fps    Set to how many times a second
+ *                      we look for changes.
+ * \param observed_fps  Set to how many frames a second
+ *                      we sent, over the last second.
+ * \return  FALSE if there is no such server running.
+ */
+gboolean vnc_get_pacing (Window id,
+			 double *target_fps,
+			 double *observed_fps);
+
+/**
+ * Tells the VNC server for the given X ID whether the
+ * connection its updates go out over is backed up.
+ * While it is, the server stops producing frames, and
+ * damage builds up until it can send again.
+ */
+void vnc_set_congested (Window id,
+			gboolean congested);
+
+/**
+ * Turns on or off printing the pacing of every
+ * VNC server, about once a second.
+ */
+void vnc_set_debug_pacing (gboolean debug);
+
+/**
+ * Says whether the clients are on this machine.  If
+ * they are, and a window doesn't say otherwise, we send
+ * updates uncompressed, since that's cheapest; if not,
+ * we compress them.  Affects servers started afterwards.
+ */
+void vnc_set_clients_local (gboolean local);
+
 /**
  * Supplies a pixmap to the VNC server for the
  * given X ID.  If there is no VNC server for the
@@ -32,10 +32,14 @@
  */
 
 #include "mutter-plugin.h"
+#include "compositor-mutter.h"
+#include "window.h"
 #include "vnc.h"
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <X11/extensions/XI2.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include <stdarg.h>
 #include <stdlib.h>
 
@@ -56,8 +60,66 @@
 #include <gio/gunixsocketaddress.h>
 
 #include "get-avatar.h"
+#include "output-queue.h"
+#include "block-parser.h"
+#include "capabilities.h"
+#include "broadcast.h"
 
 #define XZIBIT_PORT 1770
+
+/**
+ * When more than this many bytes are waiting to go
+ * out over a connection, we stop reading anything more
+ * to send over it, and tell the VNC servers to stop
+ * capturing, until it drains to OUTPUT_LOW_WATER.
+ */
+#define OUTPUT_HIGH_WATER (1024*1024)
+#define OUTPUT_LOW_WATER (256*1024)
+
+/**
+ * The most we read from libvncserver at once.  The
+ * output queue sends what we read as blocks of
+ * OUTPUT_QUEUE_PIECE, so that control messages don't
+ * wait long behind video; reading more at once only
+ * saves system calls.  Long blocks, where the other
+ * side allows them, are for control messages, such as
+ * icons, which can't be split.
+ */
+#define CLIENT_READ_SIZE (256*1024)
+
+/**
+ * A window shared with several peers at once is
+ * captured and encoded once for all of them, as a
+ * broadcast.  Peers which accept it within this many
+ * seconds, while we still have everything the
+ * broadcast has sent, up to BROADCAST_HISTORY bytes,
+ * join it; later ones start another.  Setting the
+ * XZIBIT_BROADCAST environment variable to 0 encodes
+ * separately for each peer instead.
+ */
+#define BROADCAST_JOIN_TIME 10
+#define BROADCAST_HISTORY (8*1024*1024)
+
+/**
+ * We stop reading a broadcast from libvncserver while
+ * its slowest peer is this many bytes behind.
+ */
+#define BROADCAST_MAX_LAG (1024*1024)
+
+/**
+ * The highest _XZIBIT_PRIORITY we honour: a window
+ * at this priority gets this many times the share of
+ * the connection of a window at priority 1.
+ */
+#define MAX_PRIORITY 16
+
+/**
+ * How often, in milliseconds, we send the pointer
+ * position over a window, at most: about one frame.
+ * The XZIBIT_POINTER_INTERVAL environment variable
+ * overrides this; 0 sends every motion event.
+ */
+#define DEFAULT_POINTER_INTERVAL 16
 #define TUBE_SERVICE "x-xzibit"
 
 #define MUTTER_TYPE_XZIBIT_PLUGIN            (mutter_xzibit_plugin_get_type ())
@@ -89,6 +151,56 @@ int highest_channel = 0;
  */
 char xzibit_header[] = "Xz 000.001\r\n";
 
+/**
+ * The atoms we use.  They're interned all at once,
+ * in start(), so that we never have to ask the X
+ * server about them while we're handling an event.
+ */
+enum {
+  ATOM_XZIBIT_SHARE,
+  ATOM_XZIBIT_PRIORITY,
+  ATOM_XZIBIT_RESULT,
+  ATOM_XZIBIT_SOURCE,
+  ATOM_XZIBIT_TARGET,
+  ATOM_NET_WM_NAME,
+  ATOM_NET_WM_WINDOW_TYPE,
+  ATOM_WM_NAME,
+  ATOM_WM_TRANSIENT_FOR,
+  ATOM_ATOM,
+  ATOM_CARDINAL,
+  ATOM_INTEGER,
+  ATOM_STRING,
+  ATOM_UTF8_STRING,
+  ATOM_WINDOW,
+  ATOM_COUNT
+};
+
+static char *atom_names[ATOM_COUNT] = {
+  "_XZIBIT_SHARE",
+  "_XZIBIT_PRIORITY",
+  "_XZIBIT_RESULT",
+  "_XZIBIT_SOURCE",
+  "_XZIBIT_TARGET",
+  "_NET_WM_NAME",
+  "_NET_WM_WINDOW_TYPE",
+  "WM_NAME",
+  "WM_TRANSIENT_FOR",
+  "ATOM",
+  "CARDINAL",
+  "INTEGER",
+  "STRING",
+  "UTF8_STRING",
+  "WINDOW",
+};
+
+static Atom atoms[ATOM_COUNT];
+
+/**
+ * The atom for each entry in window_types, in the
+ * same order.
+ */
+static Atom *window_type_atoms = NULL;
+
 /**
  * The plugin we expose to the outside world.
  * There are no user-servicable parts.
@@ -130,6 +242,21 @@ static gboolean xevent_filter (MutterPlugin *plugin,
 static gboolean copy_top_to_server (GIOChannel *source,
                                     GIOCondition condition,
                                     gpointer data);
+static void bottom_greeting_received (gpointer data);
+static void bottom_block_received (int channel,
+                                   const guchar *payload,
+                                   gsize length,
+                                   gpointer data);
+static void bottom_span_received (int channel,
+                                  const guchar *data,
+                                  gsize length,
+                                  gpointer user_data);
+static gboolean copy_client_to_bottom (GIOChannel *source,
+                                       GIOCondition condition,
+                                       gpointer data);
+static gboolean copy_broadcast_to_viewers (GIOChannel *source,
+                                           GIOCondition condition,
+                                           gpointer data);
 static gboolean copy_bottom_to_client (GIOChannel *source,
                                        GIOCondition condition,
                                        gpointer data);
@@ -139,6 +266,9 @@ static gboolean accept_connections (GIOChannel *source,
 
 static const MutterPluginInfo * plugin_info (MutterPlugin *plugin);
 
+static void supply_texture (MutterPlugin *plugin,
+                            Window window);
+
 static void window_set_result_property (Display *dpy,
                                         Window window,
                                         guint32 value);
@@ -165,9 +295,14 @@ struct _MutterXzibitPluginPrivate
    *                        \\  ||
    *                          {TUBES}
    *                            \\
-   *                             ()=bottom_fd
+   *                             ()=fd (one per XzibitPeer)
    *                             ||
-   *            [libvncserver]---()=client_fd (in forwarded_windows*)
+   *            [libvncserver]---()=client_fd (in forwarded_windows*,
+   *                                           or shared through
+   *                                           an XzibitBroadcast)
+   *
+   * Unless relay_in_process is set, there is no server_fd:
+   * top_fd is handed to xzibit-rfb-client once it starts.
    */
 
   /**
@@ -177,17 +312,33 @@ struct _MutterXzibitPluginPrivate
   int listening_fd;
 
   /**
-   * File descriptor connected remotely to the
-   * listening socket.
+   * The XzibitPeers we're sending windows to, keyed
+   * by their targets.
    */
-  int bottom_fd;
+  GHashTable *peers;
 
   /**
    * Forwarded windows, with connections to libvncserver.
+   * Channels are unique across all peers, so the first
+   * table maps each to one ForwardedWindow.  A window
+   * can be sent to several peers, so the second maps
+   * each X ID to a GList of ForwardedWindows.
    */
   GHashTable *forwarded_windows_by_xzibit_id;
   GHashTable *forwarded_windows_by_x11_id;
 
+  /**
+   * The latest XzibitBroadcast of each window, keyed
+   * by X ID.  Older ones live on, without an entry
+   * here, while they still have peers.
+   */
+  GHashTable *broadcasts;
+  /**
+   * Whether windows shared with several peers are
+   * broadcast; see BROADCAST_JOIN_TIME.
+   */
+  gboolean broadcast_enabled;
+
   /**
    * X display we're using, if known.
    * (We store this as soon as we know it,
@@ -197,29 +348,27 @@ struct _MutterXzibitPluginPrivate
   Display *dpy;
 
   /**
-   * State of the data received at bottom_fd.
-   * Below -4: receiving original header.
-   * -4, -3: receiving channel number.
-   * -2, -1: receiving block length.
-   * Non-negative: "n" through receiving the block.
+   * Where we read data from libvncserver into; NULL
+   * until we first need it.
    */
-  int bottom_stage;
+  guchar *client_buffer;
   /**
-   * Target channel of the block currently being
-   * received from bottom_fd, if known.
+   * If this is FALSE, each connection from the other
+   * side is handed over to its xzibit-rfb-client
+   * once that's running, and the compositor never
+   * sees that traffic.  If it's TRUE, we relay it.
    */
-  int bottom_channel;
+  gboolean relay_in_process;
   /**
-   * Length of the block currently being
-   * received from bottom_fd, if known.
+   * The least time, in milliseconds, between two
+   * pointer positions we send over one window.
    */
-  int bottom_length;
+  guint pointer_interval;
   /**
-   * Dynamic buffer to hold the block currently
-   * being received from bottom_fd; null if we're
-   * not currently receiving a block.
+   * WindowInfo for windows we've looked at, keyed by
+   * their X IDs.
    */
-  unsigned char *bottom_buffer;
+  GHashTable *window_info;
   /**
    * A handle on the bus.
    */
@@ -259,17 +408,136 @@ typedef struct _XzibitRfbClient {
    */
   int top_fd;
 
+  /**
+   * Data waiting to be written to top_fd.
+   */
+  OutputQueue *top_queue;
+
   /**
    * A socket connected to the xzibit-rfb-client
    * program.
    */
   int server_fd;
 
+  /**
+   * The watch for data from server_fd, or 0 while
+   * top_queue is congested.
+   */
+  GIOChannel *server_channel;
+  guint server_watch;
+  /**
+   * Set once xzibit-rfb-client has closed its end,
+   * after which we don't start another.
+   */
+  gboolean server_gone;
+
+  /**
+   * A pipe for splicing from top_fd to server_fd;
+   * both ends are -1 until we first need it.
+   * splice_broken is set if the kernel won't splice
+   * these descriptors.
+   */
+  int splice_pipe[2];
+  gboolean splice_broken;
+
 } XzibitRfbClient;
 
 /**
- * Everything we need to know about one
- * shared window.
+ * Everything we need to know about one remote xzibit
+ * we're sending windows to: one connection over a
+ * tube, to the contact named in _XZIBIT_TARGET.
+ */
+typedef struct _XzibitPeer {
+  /**
+   * The plugin it's associated with.
+   */
+  MutterPlugin *plugin;
+  /**
+   * The contact at the other end.
+   */
+  gchar *target;
+  /**
+   * The connection to the other side, or -1
+   * until the tube is open.
+   */
+  int fd;
+  /**
+   * The tube, and the connection over it which fd
+   * belongs to; NULL until the tube is open.
+   */
+  TpChannel *tube;
+  GSocketConnection *connection;
+  /**
+   * Data waiting to be written to fd; NULL
+   * until we first need it.
+   */
+  OutputQueue *queue;
+  /**
+   * Splits the data received at fd into blocks.
+   */
+  BlockParser *parser;
+  /**
+   * A pipe for splicing RFB data from fd to
+   * libvncserver; both ends are -1 until we first
+   * need it.  splice_broken is set if the kernel
+   * won't splice these descriptors.
+   */
+  int splice_pipe[2];
+  gboolean splice_broken;
+  /**
+   * The longest block we may send to fd.  This is
+   * BLOCK_PARSER_SHORT_MAX until the other side says it
+   * will take long blocks.
+   */
+  gsize max_block;
+  /**
+   * What the other side told us it supports, as
+   * CAPABILITY_* bits; 0 until it does.
+   */
+  guint32 capabilities;
+  /**
+   * Whether we're setting up the tube.
+   */
+  gboolean connecting;
+  /**
+   * ForwardedWindows shared with this peer while the
+   * tube was being set up, which we haven't told the
+   * other side about yet.
+   */
+  GList *waiting;
+} XzibitPeer;
+
+/**
+ * One connection to libvncserver for a window, whose
+ * output goes to several peers.
+ */
+typedef struct _XzibitBroadcast {
+  MutterPlugin *plugin;
+  Window window;
+  Broadcast *broadcast;
+  /**
+   * The connection, and the watch for data from it,
+   * or 0 while the slowest peer is too far behind.
+   * client_channel is NULL once libvncserver has
+   * hung up.
+   */
+  int client_fd;
+  GIOChannel *client_channel;
+  guint client_watch;
+  /**
+   * The timeout after which peers can't join.
+   */
+  guint join_timeout;
+  /**
+   * The ForwardedWindows receiving it.
+   */
+  GList *subscriptions;
+} XzibitBroadcast;
+
+/**
+ * Everything we need to know about sending one
+ * shared window to one peer.  A window shared with
+ * several peers has one of these for each.
  */
 typedef struct _ForwardedWindow {
   /**
@@ -282,21 +550,70 @@ typedef struct _ForwardedWindow {
    */
   unsigned int channel;
   /**
-   * Which rfb-client is dealing with this connection.
+   * The peer we're sending it to.
    */
-  unsigned int rfb_client;
+  XzibitPeer *peer;
   /**
    * The X ID of the window we represent.
    */
   Window window;
   /**
    * The file descriptor which connects us to
-   * libvncserver.
+   * libvncserver.  If the window is broadcast, this
+   * is the broadcast's, and it isn't ours to close.
    */
   int client_fd;
+  /**
+   * The broadcast we're receiving, if any, and our
+   * place in it.
+   */
+  XzibitBroadcast *broadcast;
+  BroadcastViewer *viewer;
+  /**
+   * The watch for data from client_fd, or 0 while
+   * the peer's queue is congested.
+   */
+  GIOChannel *client_channel;
+  guint client_watch;
+  /**
+   * Whether the other side limits what we send on this
+   * channel by giving us credit, and if so, how many
+   * bytes we may send before it gives us more.
+   */
+  gboolean credit_limited;
+  gsize credit;
+  /**
+   * The latest pointer position over the window, and
+   * whether we still have to send it.  While
+   * pointer_timeout is set, we sent a position less
+   * than pointer_interval ago, so any newer one waits
+   * for it.
+   */
+  int pointer_x, pointer_y;
+  gboolean pointer_pending;
+  guint pointer_timeout;
 
 } ForwardedWindow;
 
+/**
+ * What we remember about a window's properties, so
+ * that we don't have to ask the X server again.
+ * PropertyNotify tells us when it's out of date.
+ */
+typedef struct _WindowInfo {
+  /**
+   * Its _XZIBIT_SHARE, if we know it.
+   */
+  gboolean sharing_known;
+  guint32 sharing;
+  /**
+   * Its WM_TRANSIENT_FOR, or None if it hasn't
+   * got one, if we know it.
+   */
+  gboolean parent_known;
+  Window parent;
+} WindowInfo;
+
 typedef struct _XzibitSendingWindow {
   Display *dpy;
   Window window;
@@ -307,10 +624,12 @@ typedef struct _XzibitSendingWindow {
   GSocketConnection *tube_connection;
 
   TpAccount *account;
-  int *target_fd;
   MutterPlugin *plugin;
 
-  ForwardedWindow *forward_data;
+  /**
+   * The peer whose tube we're setting up.
+   */
+  XzibitPeer *peer;
 
 } XzibitSendingWindow;
 
@@ -568,16 +887,108 @@ vnc_mouse_callback (Window window,
 {
   MutterPlugin *plugin = user_data;
   MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  ForwardedWindow *fw;
+  GList *subscriptions;
   
-  fw = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
-                            &window);
+  subscriptions = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                       &window);
 
-  if (!fw)
+  if (!subscriptions)
     return;
 
   g_print ("Mouse callback.  Window is %x.  (%d, %d) %p\n",
-           (int) window, x, y, fw);
+           (int) window, x, y, subscriptions->data);
+}
+
+/**
+ * Reports how many system calls it's taking us to
+ * send each block to a peer, and how long each class
+ * of traffic is waiting.
+ */
+static void
+report_peer_output_counts (XzibitPeer *peer)
+{
+  guint64 blocks, syscalls;
+  int i;
+
+  if (!peer->queue)
+    return;
+
+  output_queue_get_counts (peer->queue,
+                           &blocks, &syscalls);
+
+  if (blocks)
+    g_print ("Sent %" G_GUINT64_FORMAT " blocks to %s in %"
+             G_GUINT64_FORMAT " syscalls (%.2f per block)\n",
+             blocks, peer->target, syscalls,
+             (double) syscalls / blocks);
+
+  for (i=0; i<OUTPUT_CLASS_COUNT; i++)
+    {
+      guint64 count;
+      double mean, max;
+
+      output_queue_get_delay (peer->queue, (OutputClass) i,
+                              &count, &mean, &max);
+
+      if (count)
+        g_print ("  class %d: %" G_GUINT64_FORMAT
+                 " blocks waited %.2fms on average, %.2fms at most\n",
+                 i, count, mean*1000, max*1000);
+    }
+}
+
+/**
+ * In debug mode, reports every so often on each peer.
+ */
+static gboolean
+report_output_counts (gpointer data)
+{
+  MutterPlugin *plugin = (MutterPlugin*) data;
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, priv->peers);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    report_peer_output_counts ((XzibitPeer*) value);
+
+  return TRUE;
+}
+
+/**
+ * Fills in "atoms" and "window_type_atoms", in a
+ * single round trip.
+ */
+static void
+intern_atoms (void)
+{
+  char **names;
+  Atom *results;
+  int count = 0, i;
+
+  while (window_types[count][0])
+    count++;
+
+  names = g_malloc (sizeof (char*) * (ATOM_COUNT + count));
+  results = g_malloc (sizeof (Atom) * (ATOM_COUNT + count));
+
+  for (i=0; i<ATOM_COUNT; i++)
+    names[i] = atom_names[i];
+  for (i=0; i<count; i++)
+    names[ATOM_COUNT+i] = window_types[i][1];
+
+  XInternAtoms (gdk_x11_get_default_xdisplay (),
+                names, ATOM_COUNT + count,
+                False, results);
+
+  memcpy (atoms, results, sizeof (Atom) * ATOM_COUNT);
+
+  window_type_atoms = g_malloc (sizeof (Atom) * (count+1));
+  memcpy (window_type_atoms, results + ATOM_COUNT, sizeof (Atom) * count);
+  window_type_atoms[count] = None;
+
+  g_free (names);
+  g_free (results);
 }
 
 /**
@@ -599,15 +1010,13 @@ start (MutterPlugin *plugin)
     {
       g_warning ("(xzibit plugin is in debug mode)");
 
-      /* which means nothing at all at the moment */
+      vnc_set_debug_pacing (TRUE);
+      g_timeout_add_seconds (10, report_output_counts, plugin);
     }
 
   priv->dpy = NULL;
 
-  priv->bottom_stage = -3 - sizeof(xzibit_header);
-  priv->bottom_channel = 0;
-  priv->bottom_length = 0;
-  priv->bottom_buffer = NULL;
+  intern_atoms ();
 
   if (!test_command || strcmp (test_command, "")==0)
     start_mode = XZIBIT_START_MODE_TUBES;
@@ -616,6 +1025,9 @@ start (MutterPlugin *plugin)
   else
     start_mode = XZIBIT_START_MODE_TEST_SERVER;
 
+  /* The test harness runs both ends on one machine. */
+  vnc_set_clients_local (start_mode != XZIBIT_START_MODE_TUBES);
+
   g_warning ("In ordinary tubes mode.");
 
   priv->dbus = tp_dbus_daemon_dup (&error);
@@ -734,7 +1146,16 @@ start (MutterPlugin *plugin)
                       plugin);
     }
 
-  priv->bottom_fd = -1;
+  priv->peers =
+    g_hash_table_new (g_str_hash,
+                      g_str_equal);
+  priv->client_buffer = NULL;
+  /* When debugging, keep the connections from the other
+   * side passing through here, so they can be watched. */
+  priv->relay_in_process = mutter_plugin_debug_mode (plugin);
+  priv->pointer_interval = g_getenv ("XZIBIT_POINTER_INTERVAL")?
+    atoi (g_getenv ("XZIBIT_POINTER_INTERVAL")):
+    DEFAULT_POINTER_INTERVAL;
   priv->forwarded_windows_by_xzibit_id =
     g_hash_table_new_full (g_int_hash,
                            g_int_equal,
@@ -745,6 +1166,18 @@ start (MutterPlugin *plugin)
                            g_int_equal,
                            g_free,
                            NULL);
+  priv->broadcasts =
+    g_hash_table_new_full (g_int_hash,
+                           g_int_equal,
+                           g_free,
+                           NULL);
+  priv->broadcast_enabled =
+    g_strcmp0 (g_getenv ("XZIBIT_BROADCAST"), "0") != 0;
+  priv->window_info =
+    g_hash_table_new_full (g_direct_hash,
+                           g_direct_equal,
+                           NULL,
+                           g_free);
 
   vnc_set_mouse_callback (vnc_mouse_callback,
                           plugin);
@@ -787,19 +1220,224 @@ mutter_xzibit_plugin_init (MutterXzibitPlugin *self)
 }
 
 /**
- * Sends a series of bytes from a particular channel from
- * the side that's sending windows.
+ * Reads the _XZIBIT_PRIORITY of a window: how large a
+ * share of the connection its updates get while other
+ * windows are busy too.
+ *
+ * \return  The priority, from 1 to MAX_PRIORITY; 1 if
+ *          the window doesn't say.
+ */
+static guint
+get_priority (Window window)
+{
+  Atom actual_type;
+  int actual_format;
+  unsigned long n_items, bytes_after;
+  unsigned char *property = NULL;
+  guint result = 1;
+
+  if (XGetWindowProperty (gdk_x11_get_default_xdisplay (),
+                          window,
+                          atoms[ATOM_XZIBIT_PRIORITY],
+                          0, 1, False,
+                          atoms[ATOM_CARDINAL],
+                          &actual_type, &actual_format,
+                          &n_items, &bytes_after,
+                          &property)==Success &&
+      property && actual_format==32 && n_items==1)
+    result = CLAMP (*((long*) property), 1, MAX_PRIORITY);
+
+  if (property)
+    XFree (property);
+
+  return result;
+}
+
+/**
+ * Tells the peer's queue the priority of a window
+ * we're sending.
+ */
+static void
+update_priority (ForwardedWindow *fw)
+{
+  if (!fw->peer->queue)
+    return;
+
+  output_queue_set_weight (fw->peer->queue,
+                           fw->channel,
+                           get_priority (fw->window));
+}
+
+/**
+ * Returns whether we can't send what libvncserver
+ * gives us for a forwarded window: we can't while the
+ * peer's queue is backed up, or while the other side
+ * has given us no credit for the window's channel.
+ */
+static gboolean
+client_blocked (ForwardedWindow *fw)
+{
+  return (fw->peer->queue &&
+          output_queue_is_congested (fw->peer->queue)) ||
+    (fw->credit_limited && fw->credit==0);
+}
+
+/**
+ * Returns whether a broadcast's slowest peer is too
+ * far behind for us to read any more of it.
+ */
+static gboolean
+broadcast_blocked (XzibitBroadcast *xb)
+{
+  return broadcast_get_lag (xb->broadcast) >= BROADCAST_MAX_LAG;
+}
+
+/**
+ * Returns whether we should stop capturing a window,
+ * because one of the peers we're sending it to can't
+ * take any more.  Every peer is sent the same
+ * captures, so the window goes at the pace of the
+ * slowest.
+ */
+static gboolean
+window_blocked (MutterPlugin *plugin,
+                Window window)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
+  GList *cursor;
+
+  for (cursor = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                     &window);
+       cursor;
+       cursor = cursor->next)
+    {
+      ForwardedWindow *fw = cursor->data;
+
+      if (fw->broadcast)
+        {
+          if (broadcast_blocked (fw->broadcast))
+            return TRUE;
+        }
+      else if (fw->client_fd != -1 && client_blocked (fw))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void pump_viewer (ForwardedWindow *fw);
+static void update_broadcast_watch (XzibitBroadcast *xb);
+
+/**
+ * Starts or stops reading from a forwarded window's
+ * connection to libvncserver, according to whether
+ * we can send what it gives us, and tells the server
+ * whether to capture.  If the window is broadcast,
+ * sends the peer as much of the broadcast as it can
+ * take instead.
+ */
+static void
+update_client_watch (ForwardedWindow *fw)
+{
+  gboolean blocked;
+
+  if (fw->client_fd == -1)
+    return;
+
+  if (fw->broadcast)
+    {
+      pump_viewer (fw);
+      update_broadcast_watch (fw->broadcast);
+      return;
+    }
+
+  blocked = client_blocked (fw);
+
+  vnc_set_congested (fw->window,
+                     window_blocked (fw->plugin, fw->window));
+
+  if (blocked && fw->client_watch)
+    {
+      g_source_remove (fw->client_watch);
+      fw->client_watch = 0;
+    }
+  else if (!blocked && !fw->client_watch && fw->client_channel)
+    {
+      fw->client_watch = g_io_add_watch (fw->client_channel,
+                                         G_IO_IN,
+                                         copy_client_to_bottom,
+                                         fw);
+    }
+}
+
+/**
+ * Called when a peer's queue backs up, or drains.
+ */
+static void
+bottom_congestion_changed (OutputQueue *queue,
+                           gboolean congested,
+                           gpointer data)
+{
+  XzibitPeer *peer = (XzibitPeer*) data;
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (peer->plugin)->priv;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, priv->forwarded_windows_by_xzibit_id);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      ForwardedWindow *fw = (ForwardedWindow*) value;
+
+      if (fw->peer == peer)
+        update_client_watch (fw);
+    }
+}
+
+/**
+ * Returns the queue for data going out to a peer.
+ * The peer must be connected.
+ */
+static OutputQueue*
+get_bottom_queue (XzibitPeer *peer)
+{
+  if (!peer->queue)
+    {
+      peer->queue = output_queue_new (peer->fd);
+      output_queue_set_congestion_callback (peer->queue,
+                                            OUTPUT_HIGH_WATER,
+                                            OUTPUT_LOW_WATER,
+                                            bottom_congestion_changed,
+                                            peer);
+    }
+
+  return peer->queue;
+}
+
+/**
+ * Returns the class of traffic on a channel we're
+ * sending windows on: the control channel carries
+ * control messages, and every other channel carries
+ * RFB updates.
+ */
+static OutputClass
+class_of_channel (int channel)
+{
+  return channel==0? OUTPUT_CLASS_CONTROL: OUTPUT_CLASS_VIDEO;
+}
+
+/**
+ * Sends a series of bytes from a particular channel to
+ * a peer, from the side that's sending windows.
  *
  * \todo  This isn't used anywhere near as much as I thought
  *        it would be.  Probably it should be replaced by
  *        send_buffer_from_bottom.
  */
 static void
-send_from_bottom (MutterPlugin *plugin,
+send_from_bottom (XzibitPeer *peer,
                   int channel,
                   ...)
 {
-  MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
   va_list ap;
   unsigned char *buffer = NULL;
   int count=0, i;
@@ -811,86 +1449,69 @@ send_from_bottom (MutterPlugin *plugin,
     }
   va_end (ap);
 
-  buffer = g_malloc (count+4);
+  buffer = g_malloc (count);
 
   va_start (ap, channel);
   for (i=0; i<count; i++)
     {
-      buffer[i+4] = (unsigned char) (va_arg (ap, int));
+      buffer[i] = (unsigned char) (va_arg (ap, int));
     }
   va_end (ap); 
 
-  /* add in the header */
-  buffer[0] = channel % 256;
-  buffer[1] = channel / 256;
-  buffer[2] = count % 256;
-  buffer[3] = count / 256;
-
   DEBUG_FLOW ("sent normal from BOTTOM towards TOP",
               buffer, count);
 
-  if (write (priv->bottom_fd, buffer, count+4)!=count+4)
-    {
-      g_warning ("Could not send message; things may break");
-    }
-
-  fsync (priv->bottom_fd);
+  output_queue_append_block (get_bottom_queue (peer),
+                             class_of_channel (channel),
+                             channel,
+                             NULL, 0,
+                             buffer, count);
 
   g_free (buffer);
 }
 
 /**
  * Sends the contents of a block of memory to a
- * particular channel from the side that's sending
- * windows.
+ * particular channel of a peer, from the side that's
+ * sending windows.
  */
 static void
-send_buffer_from_bottom (MutterPlugin *plugin,
+send_buffer_from_bottom (XzibitPeer *peer,
                          int channel,
                          unsigned char *buffer,
                          int length)
 {
-  MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  char header_buffer[4];
-
   if (length==-1)
     length = strlen (buffer);
 
   DEBUG_FLOW ("sent buffer from BOTTOM towards TOP",
               buffer, length);
 
-  header_buffer[0] = channel % 256;
-  header_buffer[1] = channel / 256;
-  header_buffer[2] = length % 256;
-  header_buffer[3] = length / 256;
-
-  if (write (priv->bottom_fd, header_buffer, 4)!=4 ||
-          write (priv->bottom_fd, buffer, length)!=length)
-    {
-      g_warning ("Could not send buffer; things may break");
-    }
-
-  fsync (priv->bottom_fd);
+  output_queue_append_block (get_bottom_queue (peer),
+                             class_of_channel (channel),
+                             channel,
+                             NULL, 0,
+                             buffer, length);
 }
 
 /**
  * Sends metadata to the control channel, from the side
  * that's sending windows.
  *
+ * \param peer            The peer to send it to
  * \param xzibit_id       ID of the window we're talking about
  * \param metadata_type   The type of the metadata (see spec)
  * \param metadata        Pointer to the metadata itself
  * \param metadata_length Length of the metadata
  */
 static void
-send_metadata_from_bottom (MutterPlugin *plugin,
+send_metadata_from_bottom (XzibitPeer *peer,
                            int xzibit_id,
                            int metadata_type,
                            char *metadata,
                            int metadata_length)
 {
-  MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  char preamble[9];
+  char preamble[5];
 
   if (metadata_length==-1)
     metadata_length = strlen (metadata);
@@ -898,25 +1519,17 @@ send_metadata_from_bottom (MutterPlugin *plugin,
   DEBUG_FLOW ("sent metadata from BOTTOM towards TOP",
               metadata, metadata_length);
 
-  preamble[0] = 0; /* channel 0, always */
-  preamble[1] = 0;
-  preamble[2] = (metadata_length+5) % 256;
-  preamble[3] = (metadata_length+5) / 256;
-  preamble[4] = 3; /* set metadata */
-  preamble[5] = xzibit_id % 256;
-  preamble[6] = xzibit_id / 256;
-  preamble[7] = metadata_type % 256;
-  preamble[8] = metadata_type / 256;
-
-  if (write (priv->bottom_fd, preamble,
-              sizeof(preamble))!=sizeof(preamble) ||
-          write (priv->bottom_fd, metadata,
-              metadata_length)!=metadata_length)
-    {
-      g_warning ("Could not write metadata; things may break");
-    }
-
-  fsync (priv->bottom_fd);
+  preamble[0] = 3; /* set metadata */
+  preamble[1] = xzibit_id % 256;
+  preamble[2] = xzibit_id / 256;
+  preamble[3] = metadata_type % 256;
+  preamble[4] = metadata_type / 256;
+
+  output_queue_append_block (get_bottom_queue (peer),
+                             OUTPUT_CLASS_CONTROL,
+                             0, /* control channel, always */
+                             preamble, sizeof (preamble),
+                             metadata, metadata_length);
 }
 
 /**
@@ -931,66 +1544,447 @@ copy_client_to_bottom (GIOChannel *source,
 {
   ForwardedWindow *forward_data =
     (ForwardedWindow*) data;
-  char buffer[1024];
+  MutterXzibitPluginPrivate *priv =
+    MUTTER_XZIBIT_PLUGIN (forward_data->plugin)->priv;
+  gsize wanted;
   int count;
 
+  if (!priv->client_buffer)
+    priv->client_buffer = g_malloc (CLIENT_READ_SIZE);
+
+  /* The queue splits it into pieces, so read as
+   * much as we can, but no more than the other side
+   * has given us credit for.
+   */
+  wanted = CLIENT_READ_SIZE;
+  if (forward_data->credit_limited)
+    wanted = MIN (wanted, forward_data->credit);
+
   count = recv (g_io_channel_unix_get_fd (source),
-                buffer,
-                sizeof(buffer),
+                priv->client_buffer,
+                wanted,
                 MSG_DONTWAIT);
 
   DEBUG_FLOW ("forwarded from CLIENT to BOTTOM",
-              buffer, count);
+              priv->client_buffer, count);
 
   if (count<0)
     {
-      if (errno==EWOULDBLOCK)
-        return;
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
+        return TRUE;
 
       g_error ("xzibit bus has died; can't really carry on");
     }
 
-  send_buffer_from_bottom (forward_data->plugin,
+  if (count==0)
+    {
+      /* libvncserver has dropped this client, and
+       * there'll be nothing more from it. */
+      g_io_channel_unref (forward_data->client_channel);
+      forward_data->client_channel = NULL;
+      forward_data->client_watch = 0;
+      close (forward_data->client_fd);
+      forward_data->client_fd = -1;
+      return FALSE;
+    }
+
+  send_buffer_from_bottom (forward_data->peer,
                            forward_data->channel,
-                           buffer,
+                           priv->client_buffer,
                            count);
 
+  if (forward_data->credit_limited)
+    {
+      forward_data->credit -= count;
+
+      if (forward_data->credit==0)
+        update_client_watch (forward_data);
+    }
+
+  /* If that filled the queue or used up our credit,
+   * the watch has gone. */
+  return forward_data->client_watch != 0;
+}
+
+/**
+ * Sends a peer as much of the broadcast it's receiving
+ * as it will take.
+ */
+static void
+pump_viewer (ForwardedWindow *fw)
+{
+  const guchar *data;
+  gsize count;
+
+  while (!client_blocked (fw) &&
+         (count = broadcast_viewer_peek (fw->viewer, &data)))
+    {
+      count = MIN (count, CLIENT_READ_SIZE);
+      if (fw->credit_limited)
+        count = MIN (count, fw->credit);
+
+      send_buffer_from_bottom (fw->peer,
+                               fw->channel,
+                               (unsigned char*) data,
+                               count);
+      broadcast_viewer_consume (fw->viewer, count);
+
+      if (fw->credit_limited)
+        fw->credit -= count;
+    }
+}
+
+/**
+ * Starts or stops reading a broadcast from
+ * libvncserver, according to how far behind its
+ * slowest peer is, and tells the server whether
+ * to capture.
+ */
+static void
+update_broadcast_watch (XzibitBroadcast *xb)
+{
+  gboolean blocked = broadcast_blocked (xb);
+
+  vnc_set_congested (xb->window,
+                     window_blocked (xb->plugin, xb->window));
+
+  if (blocked && xb->client_watch)
+    {
+      g_source_remove (xb->client_watch);
+      xb->client_watch = 0;
+    }
+  else if (!blocked && !xb->client_watch && xb->client_channel)
+    {
+      xb->client_watch = g_io_add_watch (xb->client_channel,
+                                         G_IO_IN,
+                                         copy_broadcast_to_viewers,
+                                         xb);
+    }
+}
+
+/**
+ * Reads a broadcast from libvncserver once, and sends
+ * it on to every peer receiving it which can take it.
+ */
+static gboolean
+copy_broadcast_to_viewers (GIOChannel *source,
+                           GIOCondition condition,
+                           gpointer data)
+{
+  XzibitBroadcast *xb = (XzibitBroadcast*) data;
+  MutterXzibitPluginPrivate *priv =
+    MUTTER_XZIBIT_PLUGIN (xb->plugin)->priv;
+  GList *cursor;
+  int count;
+
+  if (!priv->client_buffer)
+    priv->client_buffer = g_malloc (CLIENT_READ_SIZE);
+
+  count = recv (xb->client_fd,
+                priv->client_buffer,
+                CLIENT_READ_SIZE,
+                MSG_DONTWAIT);
+
+  DEBUG_FLOW ("broadcast from CLIENT to BOTTOM",
+              priv->client_buffer, count);
+
+  if (count<0)
+    {
+      if (errno==EWOULDBLOCK)
+        return TRUE;
+
+      g_error ("xzibit bus has died; can't really carry on");
+    }
+
+  if (count==0)
+    {
+      /* libvncserver has dropped it; the peers can
+       * still have what's left.
+       */
+      g_io_channel_unref (xb->client_channel);
+      xb->client_channel = NULL;
+      xb->client_watch = 0;
+      return FALSE;
+    }
+
+  broadcast_append (xb->broadcast,
+                    priv->client_buffer,
+                    count);
+
+  for (cursor = xb->subscriptions; cursor; cursor = cursor->next)
+    pump_viewer ((ForwardedWindow*) cursor->data);
+
+  update_broadcast_watch (xb);
+
+  /* If the slowest peer is too far behind, the watch
+   * has gone. */
+  return xb->client_watch != 0;
+}
+
+/**
+ * Called when peers can no longer join a broadcast.
+ */
+static gboolean
+broadcast_join_timeout (gpointer data)
+{
+  XzibitBroadcast *xb = (XzibitBroadcast*) data;
+
+  xb->join_timeout = 0;
+  broadcast_stop_joining (xb->broadcast);
+
+  return FALSE;
+}
+
+/**
+ * Makes a new connection to a window's VNC server.
+ * If we're already sending the window to someone
+ * else, this is one more client of the same server,
+ * so it's only captured once.
+ *
+ * \param window      The window.
+ * \param new_server  Set to whether we created the server,
+ *                    in which case the caller must start it.
+ * \return            The connection, or -1 if we
+ *                    couldn't make one.
+ */
+static int
+connect_to_server (Window window,
+                   gboolean *new_server)
+{
+  int fd;
+
+  *new_server = FALSE;
+
+  /* This fails if there's no running server; one
+   * with no clients left is still running.
+   */
+  fd = vnc_add_client (window);
+
+  if (fd==-1 && vnc_fd (window)==-1)
+    {
+      vnc_create (window);
+      fd = vnc_fd (window);
+      *new_server = fd!=-1;
+    }
+
+  return fd;
+}
+
+/**
+ * Starts a broadcast of a window: a new connection to
+ * its VNC server, which starts the server if there
+ * isn't one yet.
+ *
+ * \param plugin      The plugin.
+ * \param window      The window.
+ * \param new_server  Set to whether we created the server,
+ *                    in which case the caller must start it.
+ * \return            The broadcast, or NULL if we
+ *                    couldn't connect.
+ */
+static XzibitBroadcast*
+start_broadcast (MutterPlugin *plugin,
+                 Window window,
+                 gboolean *new_server)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
+  XzibitBroadcast *xb;
+  int *key;
+  int fd;
+
+  fd = connect_to_server (window, new_server);
+
+  if (fd==-1)
+    return NULL;
+
+  xb = g_malloc (sizeof (XzibitBroadcast));
+  xb->plugin = plugin;
+  xb->window = window;
+  xb->broadcast = broadcast_new (BROADCAST_HISTORY);
+  xb->client_fd = fd;
+  xb->client_channel = g_io_channel_unix_new (fd);
+  xb->client_watch = g_io_add_watch (xb->client_channel,
+                                     G_IO_IN,
+                                     copy_broadcast_to_viewers,
+                                     xb);
+  xb->join_timeout = g_timeout_add_seconds (BROADCAST_JOIN_TIME,
+                                            broadcast_join_timeout,
+                                            xb);
+  xb->subscriptions = NULL;
+
+  key = g_malloc (sizeof (int));
+  *key = window;
+  g_hash_table_insert (priv->broadcasts, key, xb);
+
+  return xb;
+}
+
+/**
+ * Makes a subscription receive the latest broadcast of
+ * its window, if it can still be joined, or a new one
+ * if not.
+ *
+ * \param fw          The subscription.
+ * \param new_server  Set as for start_broadcast().
+ * \return            FALSE if we couldn't.
+ */
+static gboolean
+join_broadcast (ForwardedWindow *fw,
+                gboolean *new_server)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (fw->plugin)->priv;
+  XzibitBroadcast *xb = g_hash_table_lookup (priv->broadcasts,
+                                             &fw->window);
+  BroadcastViewer *viewer = NULL;
+
+  *new_server = FALSE;
+
+  if (xb)
+    viewer = broadcast_viewer_new (xb->broadcast);
+
+  if (!viewer)
+    {
+      xb = start_broadcast (fw->plugin, fw->window, new_server);
+
+      if (!xb)
+        return FALSE;
+
+      viewer = broadcast_viewer_new (xb->broadcast);
+    }
+
+  fw->broadcast = xb;
+  fw->viewer = viewer;
+  fw->client_fd = xb->client_fd;
+  xb->subscriptions = g_list_append (xb->subscriptions, fw);
+
   return TRUE;
 }
 
+/**
+ * Stops a subscription receiving its broadcast, and
+ * ends the broadcast if nobody else is receiving it.
+ */
+static void
+leave_broadcast (ForwardedWindow *fw)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (fw->plugin)->priv;
+  XzibitBroadcast *xb = fw->broadcast;
+
+  broadcast_viewer_free (fw->viewer);
+  xb->subscriptions = g_list_remove (xb->subscriptions, fw);
+  fw->broadcast = NULL;
+  fw->viewer = NULL;
+  fw->client_fd = -1;
+
+  if (xb->subscriptions)
+    {
+      /* The slowest peer may have gone. */
+      update_broadcast_watch (xb);
+      return;
+    }
+
+  if (g_hash_table_lookup (priv->broadcasts, &xb->window) == xb)
+    g_hash_table_remove (priv->broadcasts, &xb->window);
+
+  if (xb->client_watch)
+    g_source_remove (xb->client_watch);
+  if (xb->client_channel)
+    g_io_channel_unref (xb->client_channel);
+  if (xb->join_timeout)
+    g_source_remove (xb->join_timeout);
+  close (xb->client_fd);
+
+  broadcast_free (xb->broadcast);
+  g_free (xb);
+}
+
 /**
  * Finishes sharing a window; this is the second half of share_window().
- * It's either called immediately, if the tube is already open, or later,
- * if the tube wasn't open, when the tube is ready.
+ * It's either called immediately, if the peer's tube is already open, or
+ * later, if the tube wasn't open, when the tube is ready.
  */
 static void
-share_window_finish (Display *dpy,
-                     XzibitSendingWindow* window, MutterPlugin *plugin,
-                     int xzibit_id,
-                     ForwardedWindow *forward_data)
+share_window_finish (ForwardedWindow *forward_data)
 {
+  int xzibit_id = forward_data->channel;
+
   /* Tell our counterpart about it */
 
-  send_from_bottom (plugin,
+  send_from_bottom (forward_data->peer,
                     0, /* control channel */
                     1, /* opcode */
                     xzibit_id % 256,
                     xzibit_id / 256,
                     -1);
+}
 
-  g_free (window);
+/**
+ * Fills in a FRAMING message, offering to take blocks
+ * of up to BLOCK_PARSER_LONG_MAX bytes.
+ */
+static void
+make_framing_message (unsigned char message[5])
+{
+  message[0] = 10; /* "FRAMING" */
+  message[1] = BLOCK_PARSER_LONG_MAX & 0xFF;
+  message[2] = (BLOCK_PARSER_LONG_MAX >> 8) & 0xFF;
+  message[3] = (BLOCK_PARSER_LONG_MAX >> 16) & 0xFF;
+  message[4] = (BLOCK_PARSER_LONG_MAX >> 24) & 0xFF;
 }
 
 /**
- * Called once at the beginning of each new connection.
+ * Fills in a CAPABILITIES message, saying what we
+ * support.
  */
 static void
-introduce_yourself (MutterPlugin *plugin)
+make_capabilities_message (unsigned char message[CAPABILITIES_MESSAGE_LENGTH])
 {
-  /* Set our avatar. */
+  message[0] = 11; /* "CAPABILITIES" */
+  message[1] = CAPABILITIES_SUPPORTED & 0xFF;
+  message[2] = (CAPABILITIES_SUPPORTED >> 8) & 0xFF;
+  message[3] = (CAPABILITIES_SUPPORTED >> 16) & 0xFF;
+  message[4] = (CAPABILITIES_SUPPORTED >> 24) & 0xFF;
+}
 
-  MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  char *buffer = g_malloc (priv->avatar->len + 1);
+/**
+ * Called once at the beginning of each new connection,
+ * before anything else is sent on it.
+ */
+static void
+introduce_yourself (XzibitPeer *peer)
+{
+  unsigned char capabilities[CAPABILITIES_MESSAGE_LENGTH];
+  unsigned char framing[5];
+
+  /* Say what we can do. */
+
+  make_capabilities_message (capabilities);
+  send_buffer_from_bottom (peer,
+                           0,
+                           capabilities,
+                           sizeof (capabilities));
+
+  /* Offer long blocks; from now on, we mustn't send
+   * a short block of exactly 0xFFFF bytes. */
+
+  make_framing_message (framing);
+  send_buffer_from_bottom (peer,
+                           0,
+                           framing,
+                           sizeof (framing));
+}
+
+/**
+ * Sets our avatar on a connection, once the other
+ * side has greeted us.
+ */
+static void
+send_avatar (XzibitPeer *peer)
+{
+  MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (peer->plugin)->priv;
+  char *buffer;
+
+  buffer = g_malloc (priv->avatar->len + 1);
 
   buffer[0] = 6; /* "AVATAR" */
 
@@ -998,7 +1992,7 @@ introduce_yourself (MutterPlugin *plugin)
           priv->avatar->str,
           priv->avatar->len);
   
-  send_buffer_from_bottom (plugin,
+  send_buffer_from_bottom (peer,
                            0,
                            buffer,
                            priv->avatar->len + 1);
@@ -1095,6 +2089,162 @@ client_create_tube_finish (GAsyncResult *result,
   return g_object_ref (data->connection);
 }
 
+/**
+ * Stops sending a window to a peer, without telling
+ * the other side, and frees the ForwardedWindow.
+ */
+static void
+forget_subscription (ForwardedWindow *fw)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (fw->plugin)->priv;
+  GList *subscriptions;
+  int *key;
+
+  if (fw->pointer_timeout)
+    g_source_remove (fw->pointer_timeout);
+
+  if (fw->client_watch)
+    g_source_remove (fw->client_watch);
+
+  if (fw->client_channel)
+    g_io_channel_unref (fw->client_channel);
+
+  /* libvncserver notices this, and forgets the client. */
+  if (fw->broadcast)
+    leave_broadcast (fw);
+  else if (fw->client_fd != -1)
+    close (fw->client_fd);
+
+  fw->peer->waiting = g_list_remove (fw->peer->waiting, fw);
+
+  subscriptions = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                       &fw->window);
+  subscriptions = g_list_remove (subscriptions, fw);
+
+  if (subscriptions)
+    {
+      key = g_malloc (sizeof (int));
+      *key = (int) fw->window;
+
+      g_hash_table_insert (priv->forwarded_windows_by_x11_id,
+                           key,
+                           subscriptions);
+    }
+  else
+    g_hash_table_remove (priv->forwarded_windows_by_x11_id,
+                         &fw->window);
+
+  /* This frees it. */
+  g_hash_table_remove (priv->forwarded_windows_by_xzibit_id,
+                       &fw->channel);
+}
+
+/**
+ * Called when a peer's tube is open: starts listening
+ * to the other side, says what we can do, and then
+ * tells it about the windows which were waiting.
+ */
+static void
+peer_connected (XzibitPeer *peer,
+                int fd)
+{
+  GIOChannel *channel;
+  GList *cursor;
+
+  peer->fd = fd;
+  peer->connecting = FALSE;
+
+  channel = g_io_channel_unix_new (fd);
+  g_io_add_watch (channel,
+                  G_IO_IN | G_IO_HUP | G_IO_ERR,
+                  copy_bottom_to_client,
+                  peer);
+  g_io_channel_unref (channel);
+
+  introduce_yourself (peer);
+
+  for (cursor = peer->waiting; cursor; cursor = cursor->next)
+    share_window_finish ((ForwardedWindow*) cursor->data);
+
+  g_list_free (peer->waiting);
+  peer->waiting = NULL;
+}
+
+/**
+ * Called when a peer's connection has closed or
+ * failed: forgets every window we were sending it,
+ * and then the peer itself, so that the next window
+ * shared with the same contact opens a new tube.
+ */
+static void
+forget_peer (XzibitPeer *peer)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (peer->plugin)->priv;
+  GHashTableIter iter;
+  gpointer value;
+  GList *subscriptions = NULL, *cursor;
+
+  g_hash_table_iter_init (&iter, priv->forwarded_windows_by_xzibit_id);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    if (((ForwardedWindow*) value)->peer == peer)
+      subscriptions = g_list_prepend (subscriptions, value);
+
+  /* Each of these changes the table. */
+  for (cursor = subscriptions; cursor; cursor = cursor->next)
+    forget_subscription ((ForwardedWindow*) cursor->data);
+  g_list_free (subscriptions);
+
+  g_hash_table_remove (priv->peers, peer->target);
+
+  output_queue_free (peer->queue);
+  block_parser_free (peer->parser);
+
+  if (peer->splice_pipe[0] != -1)
+    {
+      close (peer->splice_pipe[0]);
+      close (peer->splice_pipe[1]);
+    }
+
+  /* This closes fd. */
+  if (peer->connection)
+    g_object_unref (peer->connection);
+  else if (peer->fd != -1)
+    close (peer->fd);
+
+  if (peer->tube)
+    {
+      tp_cli_channel_call_close (peer->tube, -1, NULL, NULL, NULL, NULL);
+      g_object_unref (peer->tube);
+    }
+
+  g_free (peer->target);
+  g_free (peer);
+}
+
+/**
+ * Called when we couldn't open a peer's tube: every
+ * window which was waiting for it fails, and the
+ * next window shared with the peer tries again.
+ * Frees the sending window.
+ */
+static void
+tube_failed (XzibitSendingWindow *window)
+{
+  XzibitPeer *peer = window->peer;
+
+  while (peer->waiting)
+    {
+      ForwardedWindow *fw = peer->waiting->data;
+
+      window_set_result_property (window->dpy, fw->window,
+                                  301);
+      forget_subscription (fw);
+    }
+
+  peer->connecting = FALSE;
+  g_free (window);
+}
+
 /**
  * Part four of setting up the tube.
  */
@@ -1106,7 +2256,6 @@ create_tube_cb (GObject *source_object,
   XzibitSendingWindow* window = user_data;
   GSocket *socket = NULL;
   int fd = 0;
-  GIOChannel *channel;
   GError *error = NULL;
 
   g_warning ("create_tube_cb");
@@ -1119,9 +2268,8 @@ create_tube_cb (GObject *source_object,
     {
       g_warning ("Couldn't finish the tube: %s",
                  error->message);
-      window_set_result_property (window->dpy, window->window,
-                                  301);
       g_clear_error (&error);
+      tube_failed (window);
       return;
     }
 
@@ -1130,8 +2278,7 @@ create_tube_cb (GObject *source_object,
   if (socket == NULL)
     {
       g_warning ("The connection had no socket");
-      window_set_result_property (window->dpy, window->window,
-                                  301);
+      tube_failed (window);
       return;
     }
 
@@ -1148,22 +2295,15 @@ create_tube_cb (GObject *source_object,
                               102);
 
   /*
-   * ...and share the window.
+   * ...and share the windows.  The peer keeps the
+   * tube open until the connection goes away.
    */
 
-  *(window->target_fd) = fd;
-
-  channel = g_io_channel_unix_new (fd);
-  g_io_add_watch (channel,
-                  G_IO_IN,
-                  copy_bottom_to_client,
-                  window->plugin);
+  window->peer->tube = window->channel;
+  window->peer->connection = window->tube_connection;
+  peer_connected (window->peer, fd);
 
-  share_window_finish (window->dpy,
-                       window,
-                       window->plugin,
-                       window->forward_data->channel,
-                       window->forward_data);
+  g_free (window);
 }
 
 /**
@@ -1401,9 +2541,7 @@ connection_prepare_cb (GObject *object,
       !capabilities_has_stream_tube (tp_connection_get_capabilities (connection)))
     {
       g_warning ("Problem finishing preparation of source account");
-      window_set_result_property (window->dpy, window->window,
-                                  301);
-      g_free (window);
+      tube_failed (window);
       return;
     }
 
@@ -1453,9 +2591,7 @@ account_prepare_cb (GObject *object,
     {
       g_warning ("Problem creating source account: %s",
                  error->message);
-      window_set_result_property (window->dpy, window->window,
-                                  301);
-      g_free (window);
+      tube_failed (window);
       return;
     }
 
@@ -1468,9 +2604,7 @@ account_prepare_cb (GObject *object,
        * error code from the others.  The account
        * does exist: it's just not online.
        */
-      window_set_result_property (window->dpy, window->window,
-                                  301);
-      g_free (window);
+      tube_failed (window);
       return;
     }
 
@@ -1480,7 +2614,54 @@ account_prepare_cb (GObject *object,
 }
 
 /**
- * Initiates the sharing of a given window.
+ * Returns the peer for a given target, creating it,
+ * unconnected, if we haven't sent it anything before.
+ */
+static XzibitPeer*
+get_peer (MutterPlugin *plugin,
+          const gchar *target)
+{
+  MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
+  XzibitPeer *peer;
+
+  if (!target)
+    target = "";
+
+  peer = g_hash_table_lookup (priv->peers, target);
+
+  if (peer)
+    return peer;
+
+  peer = g_malloc (sizeof (XzibitPeer));
+  peer->plugin = plugin;
+  peer->target = g_strdup (target);
+  peer->fd = -1;
+  peer->tube = NULL;
+  peer->connection = NULL;
+  peer->queue = NULL;
+  peer->parser = block_parser_new (xzibit_header,
+                                   bottom_greeting_received,
+                                   bottom_block_received,
+                                   peer);
+  block_parser_set_span_cb (peer->parser,
+                            bottom_span_received);
+  peer->splice_pipe[0] = peer->splice_pipe[1] = -1;
+  peer->splice_broken = FALSE;
+  peer->max_block = BLOCK_PARSER_SHORT_MAX;
+  peer->capabilities = 0;
+  peer->connecting = FALSE;
+  peer->waiting = NULL;
+
+  g_hash_table_insert (priv->peers,
+                       peer->target,
+                       peer);
+
+  return peer;
+}
+
+/**
+ * Initiates the sharing of a given window with the
+ * target of a sending window.  Frees the sending window.
  */
 static void
 share_window (Display *dpy,
@@ -1488,22 +2669,47 @@ share_window (Display *dpy,
 {
   MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
   GError *error = NULL;
-  unsigned char message[11];
-  int xzibit_id = ++highest_channel;
+  XzibitPeer *peer = get_peer (plugin, window->target);
+  GList *subscriptions, *cursor;
+  int xzibit_id;
   ForwardedWindow *forward_data;
-  int *client_fd, *key;
+  int *key;
 
-  g_print ("[%s] Share window %x...",
+  g_print ("[%s] Share window %x with %s...",
            gdk_display_get_name (gdk_display_get_default()),
-           (int) window->window
+           (int) window->window,
+           peer->target
            );
 
+  subscriptions = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                       &window->window);
+
+  for (cursor = subscriptions; cursor; cursor = cursor->next)
+    if (((ForwardedWindow*) cursor->data)->peer == peer)
+      {
+        /* already there */
+        g_free (window);
+        return;
+      }
+
+  xzibit_id = ++highest_channel;
+
   forward_data = g_malloc(sizeof(ForwardedWindow));
   forward_data->plugin = plugin;
   forward_data->channel = xzibit_id;
   forward_data->window = window->window;
-  forward_data->rfb_client = 1; /* for now */
-  forward_data->client_fd = vnc_fd (window->window);
+  forward_data->peer = peer;
+  /* We connect to libvncserver when they accept. */
+  forward_data->client_fd = -1;
+  forward_data->broadcast = NULL;
+  forward_data->viewer = NULL;
+  forward_data->client_channel = NULL;
+  forward_data->client_watch = 0;
+  forward_data->credit_limited = FALSE;
+  forward_data->credit = 0;
+  forward_data->pointer_x = forward_data->pointer_y = 0;
+  forward_data->pointer_pending = FALSE;
+  forward_data->pointer_timeout = 0;
 
   key = g_malloc (sizeof (int));
   *key = xzibit_id;
@@ -1517,70 +2723,104 @@ share_window (Display *dpy,
 
   g_hash_table_insert (priv->forwarded_windows_by_x11_id,
                        key,
-                       forward_data);
+                       g_list_append (subscriptions, forward_data));
 
-  /* make sure we have the bottom connection */
+  /* make sure we have the connection to the peer */
 
-  if (priv->bottom_fd==-1)
+  if (peer->fd!=-1)
     {
-      /*
-       * the tube isn't yet open.  Create it,
-       * open a connection to it, and put the
-       * fd in priv->bottom_fd.
-       */
+      share_window_finish (forward_data);
+      g_free (window);
+      return;
+    }
 
-      if (window->source)
-        {
-          if (!g_str_has_prefix (window->source, TP_ACCOUNT_OBJECT_PATH_BASE))
-            {
-              gchar *account_id = window->source;
-              
-              window->source = g_strconcat (TP_ACCOUNT_OBJECT_PATH_BASE,
-                                            account_id, NULL);
+  peer->waiting = g_list_append (peer->waiting, forward_data);
+  window->peer = peer;
 
-              g_free (account_id);
-            }
+  if (peer->connecting)
+    {
+      /* it'll go when the tube's open */
+      g_free (window);
+      return;
+    }
 
-          priv->sending_account =
-            window->account = tp_account_new (priv->dbus,
-                                              window->source, &error);
-          if (priv->sending_account == NULL)
-            {
-              g_warning ("No such sending account: %s", window->source);
-              window_set_result_property (dpy, window->window,
-                                          301);
-              g_free (window);
-              return;
-            }
+  /*
+   * the tube isn't yet open.  Create it,
+   * open a connection to it, and give the
+   * fd to the peer.
+   */
 
-          window->forward_data = forward_data;
-          window->target_fd = &(priv->bottom_fd);
-          window->plugin = plugin;
+  if (!window->source)
+    {
+      g_warning ("No sending account.");
+      tube_failed (window);
+      return;
+    }
 
-          tp_proxy_prepare_async (TP_PROXY (priv->sending_account),
-                                  NULL,
-                                  account_prepare_cb, window);
+  if (!g_str_has_prefix (window->source, TP_ACCOUNT_OBJECT_PATH_BASE))
+    {
+      gchar *account_id = window->source;
+              
+      window->source = g_strconcat (TP_ACCOUNT_OBJECT_PATH_BASE,
+                                    account_id, NULL);
 
-          priv->avatar = get_avatar ();
-          
-          return;
-        }
-      else
-        {
-          g_warning ("No sending account.");
-          window_set_result_property (dpy, window->window,
-                                      301);
-          g_free (window);
-          return;
-        }
+      g_free (account_id);
     }
 
-  share_window_finish (dpy, window, plugin,
-                       xzibit_id, forward_data);
+  priv->sending_account =
+    window->account = tp_account_new (priv->dbus,
+                                      window->source, &error);
+  if (priv->sending_account == NULL)
+    {
+      g_warning ("No such sending account: %s", window->source);
+      tube_failed (window);
+      return;
+    }
+
+  window->plugin = plugin;
+  peer->connecting = TRUE;
+
+  tp_proxy_prepare_async (TP_PROXY (priv->sending_account),
+                          NULL,
+                          account_prepare_cb, window);
+
+  if (!priv->avatar)
+    priv->avatar = get_avatar ();
+}
+
+/**
+ * Stops sending a window to one peer, and tells
+ * the other side.
+ */
+static void
+unshare_subscription (ForwardedWindow *fw)
+{
+  XzibitPeer *peer = fw->peer;
+
+  /* If we aren't connected yet, they never heard of it. */
+  if (peer->fd!=-1)
+    send_from_bottom (peer,
+                      0, /* control channel */
+                      2, /* opcode */
+                      fw->channel % 256,
+                      fw->channel / 256,
+                      -1);
+
+  block_parser_set_streamed (peer->parser,
+                             fw->channel,
+                             FALSE);
+
+  /* in case the channel is used again */
+  if (peer->queue)
+    output_queue_set_weight (peer->queue,
+                             fw->channel,
+                             1);
+
+  forget_subscription (fw);
 }
 
 /**
- * Forces a window to stop being shared.
+ * Forces a window to stop being shared with anyone.
  * (This is in response to the window closing or
  * having its sharing property removed; we don't
  * need to update anything on the X server.)
@@ -1590,30 +2830,18 @@ unshare_window (Display *dpy,
                 Window window, MutterPlugin *plugin)
 {
   MutterXzibitPluginPrivate *priv   = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  ForwardedWindow *fw;
+  GList *subscriptions;
 
   g_print ("[%s] Unshare window %x...",
            gdk_display_get_name (gdk_display_get_default()),
            (int) window
            );
 
-  fw = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
-                            &window);
-
-  if (!fw)
-    return;
-
-  send_from_bottom (plugin,
-                    0, /* control channel */
-                    2, /* opcode */
-                    fw->channel % 256,
-                    fw->channel / 256,
-                    -1);
-
-  g_hash_table_remove (priv->forwarded_windows_by_x11_id,
-                       &window);
-  g_hash_table_remove (priv->forwarded_windows_by_xzibit_id,
-                       &fw->channel);
+  /* Each of these changes the list. */
+  while ((subscriptions =
+          g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                               &window)))
+    unshare_subscription ((ForwardedWindow*) subscriptions->data);
 }
 
 static void
@@ -1623,8 +2851,8 @@ window_set_result_property (Display *dpy,
 {
   XChangeProperty (dpy,
                    window,
-                   gdk_x11_get_xatom_by_name ("_XZIBIT_RESULT"),
-                   gdk_x11_get_xatom_by_name ("INTEGER"),
+                   atoms[ATOM_XZIBIT_RESULT],
+                   atoms[ATOM_INTEGER],
                    32,
                    PropModeReplace,
                    (const unsigned char*) &value,
@@ -1632,7 +2860,8 @@ window_set_result_property (Display *dpy,
 }
 
 XzibitSendingWindow* sending_window_new (Display *dpy,
-                                         Window window)
+                                         Window window,
+                                         const gchar *target)
 {
   XzibitSendingWindow *result = g_malloc (sizeof (XzibitSendingWindow));
   Atom actual_type;
@@ -1644,14 +2873,18 @@ XzibitSendingWindow* sending_window_new (Display *dpy,
              result, dpy);
   result->dpy = dpy;
   result->window = window;
+  result->target = g_strdup (target);
+  result->account = NULL;
+  result->plugin = NULL;
+  result->peer = NULL;
 
   if (XGetWindowProperty(dpy,
                          window,
-                         gdk_x11_get_xatom_by_name ("_XZIBIT_SOURCE"),
+                         atoms[ATOM_XZIBIT_SOURCE],
                          0,
                          1024,
                          False,
-                         gdk_x11_get_xatom_by_name ("UTF8_STRING"),
+                         atoms[ATOM_UTF8_STRING],
                          &actual_type,
                          &actual_format,
                          &n_items,
@@ -1666,28 +2899,58 @@ XzibitSendingWindow* sending_window_new (Display *dpy,
     }
   XFree (property);
 
+  return result;
+}
+
+/**
+ * Returns the contacts a window should be shared with:
+ * its _XZIBIT_TARGET holds one or more, separated by
+ * NULs.  Free the result with g_strfreev().
+ */
+static gchar**
+get_targets (Display *dpy,
+             Window window)
+{
+  GPtrArray *result = g_ptr_array_new ();
+  Atom actual_type;
+  int actual_format;
+  unsigned long n_items, bytes_after;
+  unsigned char *property = NULL;
+
   if (XGetWindowProperty(dpy,
                          window,
-                         gdk_x11_get_xatom_by_name ("_XZIBIT_TARGET"),
+                         atoms[ATOM_XZIBIT_TARGET],
                          0,
                          1024,
                          False,
-                         gdk_x11_get_xatom_by_name ("UTF8_STRING"),
+                         atoms[ATOM_UTF8_STRING],
                          &actual_type,
                          &actual_format,
                          &n_items,
                          &bytes_after,
-                         &property)==Success)
-    {
-      result->target = g_strdup (property);
-    }
-  else
+                         &property)==Success &&
+      property && actual_format==8)
     {
-      result->target = NULL;
+      const char *cursor = (const char*) property;
+      const char *end = cursor + n_items;
+
+      while (cursor < end)
+        {
+          gsize length = strnlen (cursor, end - cursor);
+
+          if (length)
+            g_ptr_array_add (result, g_strndup (cursor, length));
+
+          cursor += length + 1;
+        }
     }
-  XFree (property);
 
-  return result;
+  if (property)
+    XFree (property);
+
+  g_ptr_array_add (result, NULL);
+
+  return (gchar**) g_ptr_array_free (result, FALSE);
 }
 
 /**
@@ -1698,7 +2961,8 @@ static void
 set_sharing_state (Display *dpy,
                    Window window, int sharing_state, MutterPlugin *plugin)
 {
-  XzibitSendingWindow *sending;
+  gchar **targets;
+  int i;
 
   if (sharing_state == 2 || sharing_state == 3)
     {
@@ -1711,9 +2975,21 @@ set_sharing_state (Display *dpy,
   switch (sharing_state)
     {
     case 1:
-      /* we are starting to share this window */
-      sending = sending_window_new (dpy, window);
-      share_window (dpy, sending, plugin);
+      /* we are starting to share this window,
+       * with everyone it names */
+      targets = get_targets (dpy, window);
+
+      if (!targets[0])
+        share_window (dpy,
+                      sending_window_new (dpy, window, NULL),
+                      plugin);
+
+      for (i=0; targets[i]; i++)
+        share_window (dpy,
+                      sending_window_new (dpy, window, targets[i]),
+                      plugin);
+
+      g_strfreev (targets);
       break;
 
     case 0:
@@ -1725,6 +3001,103 @@ set_sharing_state (Display *dpy,
     }
 }
 
+#ifdef HAVE_SPLICE
+
+/**
+ * The most we put into a splice pipe at once;
+ * this is the default capacity of a pipe.
+ */
+#define SPLICE_CHUNK 65536
+
+/**
+ * Moves up to "length" bytes from one descriptor to
+ * another through a pipe, so that they never come
+ * through our address space.  "from" is read without
+ * blocking; "to" must block, because the pipe has to
+ * be empty again before anything else is written to
+ * "to", or the stream would be out of order.
+ *
+ * \param from       Where the data is waiting.
+ * \param to         Where it goes.
+ * \param pipe_fds   The pipe; both ends are -1 until
+ *                   it's first needed.
+ * \param length     The most to move.
+ * \param broken     Set to TRUE if splicing can't work
+ *                   here, so the caller can stop trying.
+ * \return  How much was moved, or zero or less if
+ *          nothing was, in which case the caller should
+ *          read() "from" as usual to see why.
+ */
+static gssize
+splice_through_pipe (int from,
+                     int to,
+                     int *pipe_fds,
+                     gsize length,
+                     gboolean *broken)
+{
+  gssize moved, left, count;
+
+  if (pipe_fds[0]==-1 &&
+      pipe (pipe_fds)!=0)
+    {
+      g_warning ("Could not make a pipe for splicing: %s",
+                 strerror (errno));
+      *broken = TRUE;
+      return -1;
+    }
+
+  moved = splice (from, NULL,
+                  pipe_fds[1], NULL,
+                  MIN (length, SPLICE_CHUNK),
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if (moved<=0)
+    {
+      if (moved<0 && (errno==EINVAL || errno==ENOSYS))
+        *broken = TRUE;
+
+      return moved;
+    }
+
+  left = moved;
+  while (left)
+    {
+      count = splice (pipe_fds[0], NULL,
+                      to, NULL,
+                      left,
+                      SPLICE_F_MOVE);
+
+      if (count<0 && errno==EINTR)
+        continue;
+
+      if (count<=0)
+        {
+          char discard[4096];
+
+          g_warning ("Could not pass on spliced data; "
+                     "things will break.");
+
+          while (left)
+            {
+              count = read (pipe_fds[0],
+                            discard,
+                            MIN (left, sizeof (discard)));
+              if (count<=0)
+                break;
+              left -= count;
+            }
+
+          break;
+        }
+
+      left -= count;
+    }
+
+  return moved;
+}
+
+#endif /* HAVE_SPLICE */
+
 /**
  * Copies data about received windows from our display
  * program out to the socket.  This data is already
@@ -1738,7 +3111,7 @@ copy_server_to_top (GIOChannel *source,
   XzibitRfbClient *server_details = (XzibitRfbClient*) data;
   MutterPlugin *plugin = server_details->plugin;
   MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  char buffer[4096];
+  char buffer[65536];
   int fd = g_io_channel_unix_get_fd (source);
   int count;
 
@@ -1756,25 +3129,107 @@ copy_server_to_top (GIOChannel *source,
 
   if (count==0)
     {
-      return;
+      /* xzibit-rfb-client has gone, so the connection
+       * is no use; tell the other side. */
+      g_warning ("xzibit-rfb-client has closed its connection");
+      g_io_channel_unref (server_details->server_channel);
+      server_details->server_channel = NULL;
+      server_details->server_watch = 0;
+      close (server_details->server_fd);
+      server_details->server_fd = -1;
+      server_details->server_gone = TRUE;
+      shutdown (server_details->top_fd, SHUT_RDWR);
+      return FALSE;
     }
 
   DEBUG_FLOW ("forwarding from SERVER to TOP", buffer, count);
 
-  if (write (server_details->top_fd,
-             buffer,
-             count)<count)
-    {
-      g_warning ("Error in writing to our socket.");
-    }
+  output_queue_append (server_details->top_queue,
+                       buffer,
+                       count);
 
-  return TRUE;
+  /* If that filled the queue, the watch has gone. */
+  return server_details->server_watch != 0;
+}
+
+/**
+ * Starts an xzibit-rfb-client to deal with one
+ * connection from the other side.
+ *
+ * \param server_details  The connection.
+ * \param fd              The descriptor the program
+ *                        should talk xzibit on.
+ */
+static void
+spawn_rfb_client (XzibitRfbClient *server_details,
+                  int fd)
+{
+  char *argvl[6];
+  char *fd_as_string,
+    *id_as_string;
+
+  fd_as_string = g_strdup_printf ("%d",
+                                  fd);
+  id_as_string = g_strdup_printf ("%d",
+                                  server_details->id);
+
+  argvl[0] = "xzibit-rfb-client";
+  argvl[1] = "-f";
+  argvl[2] = fd_as_string;
+  argvl[3] = "-r";
+  argvl[4] = id_as_string;
+  argvl[5] = 0;
+
+  g_spawn_async (
+                 "/",
+                 (gchar**) argvl,
+                 NULL,
+                 G_SPAWN_SEARCH_PATH|
+                 G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
+                 NULL, NULL,
+                 NULL,
+                 NULL /* FIXME: check errors */
+                 );
+
+  g_free (fd_as_string);
+  g_free (id_as_string);
+}
+
+/**
+ * Gives top_fd itself to a new xzibit-rfb-client, so
+ * that everything on the connection goes directly
+ * between the program and the other side without our
+ * relaying it.  Whatever we've queued for top_fd goes
+ * first.  Afterwards, we have nothing more to do with
+ * the connection.
+ */
+static void
+hand_over_top (XzibitRfbClient *server_details)
+{
+  int fd = server_details->top_fd;
+
+  /* xzibit-rfb-client expects a blocking socket;
+   * this also makes the flush below finish. */
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+
+  if (!output_queue_flush (server_details->top_queue))
+    g_warning ("Could not send the greeting to the other side; "
+               "things will break.");
+
+  output_queue_free (server_details->top_queue);
+  server_details->top_queue = NULL;
+
+  spawn_rfb_client (server_details, fd);
+
+  close (fd);
+  server_details->top_fd = -1;
 }
 
 /**
  * Copies data received from our socket about received windows
  * to our display program.  If the display program isn't
- * running, it creates it first.
+ * running, it creates it first, and unless we're relaying
+ * in-process, hands the socket over to it.
  */
 static gboolean
 copy_top_to_server (GIOChannel *source,
@@ -1784,20 +3239,25 @@ copy_top_to_server (GIOChannel *source,
   XzibitRfbClient *server_details = (XzibitRfbClient*) data;
   MutterPlugin *plugin = server_details->plugin;
   MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  char buffer[1024];
+  char buffer[65536];
   int count;
-  int i;
-  int q;
+
+  if (server_details->server_gone)
+    return FALSE;
 
   if (server_details->server_fd == -1)
     {
       /* No remote client?  Make one. */
 
-      char *argvl[6];
       int sockets[2];
-      char *fd_as_string,
-        *id_as_string;
-      GIOChannel *channel;
+
+      if (!priv->relay_in_process)
+        {
+          hand_over_top (server_details);
+
+          /* it isn't ours to watch any more */
+          return FALSE;
+        }
 
       socketpair (AF_LOCAL,
                   SOCK_STREAM,
@@ -1805,50 +3265,47 @@ copy_top_to_server (GIOChannel *source,
                   sockets);
 
       server_details->server_fd = sockets[0];
-      channel = g_io_channel_unix_new (server_details->server_fd);
-      g_io_add_watch (channel,
-                      G_IO_IN,
-                      copy_server_to_top,
-                      server_details);
-
-      fd_as_string = g_strdup_printf ("%d",
-                                      sockets[1]);
-      id_as_string = g_strdup_printf ("%d",
-                                      server_details->id);
-
-      argvl[0] = "xzibit-rfb-client";
-      argvl[1] = "-f";
-      argvl[2] = fd_as_string;
-      argvl[3] = "-r";
-      argvl[4] = id_as_string;
-      argvl[5] = 0;
-
-      g_spawn_async (
-                     "/",
-                     (gchar**) argvl,
-                     NULL,
-                     G_SPAWN_SEARCH_PATH|
-                     G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                     NULL, NULL,
-                     NULL,
-                     NULL /* FIXME: check errors */
-                     );
-
-      g_free (fd_as_string);
-      g_free (id_as_string);
+      server_details->server_channel =
+        g_io_channel_unix_new (server_details->server_fd);
+      server_details->server_watch =
+        g_io_add_watch (server_details->server_channel,
+                        G_IO_IN,
+                        copy_server_to_top,
+                        server_details);
+
+      spawn_rfb_client (server_details, sockets[1]);
+
+      /* the child has its own copy */
+      close (sockets[1]);
     }
 
+#ifdef HAVE_SPLICE
+  if (!server_details->splice_broken &&
+      splice_through_pipe (server_details->top_fd,
+                           server_details->server_fd,
+                           server_details->splice_pipe,
+                           SPLICE_CHUNK,
+                           &server_details->splice_broken) > 0)
+    return TRUE;
+#endif /* HAVE_SPLICE */
+
   count = read (server_details->top_fd,
                 buffer,
                 sizeof(buffer));
 
   if (count==0)
-    return;
+    {
+      /* The other side has gone; so can
+       * xzibit-rfb-client. */
+      if (server_details->server_fd != -1)
+        shutdown (server_details->server_fd, SHUT_WR);
+      return FALSE;
+    }
 
   if (count<0)
     {
-      if (errno==EWOULDBLOCK)
-        return;
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
+        return TRUE;
 
       perror ("xzibit");
 
@@ -1880,6 +3337,34 @@ copy_top_to_server (GIOChannel *source,
   return TRUE;
 }
 
+/**
+ * Called when the queue to top_fd backs up, or drains.
+ * While it's backed up, we stop reading from
+ * xzibit-rfb-client.
+ */
+static void
+top_congestion_changed (OutputQueue *queue,
+                        gboolean congested,
+                        gpointer data)
+{
+  XzibitRfbClient *server_details = (XzibitRfbClient*) data;
+
+  if (congested && server_details->server_watch)
+    {
+      g_source_remove (server_details->server_watch);
+      server_details->server_watch = 0;
+    }
+  else if (!congested && !server_details->server_watch &&
+           server_details->server_channel)
+    {
+      server_details->server_watch =
+        g_io_add_watch (server_details->server_channel,
+                        G_IO_IN,
+                        copy_server_to_top,
+                        server_details);
+    }
+}
+
 /**
  * Handles a connection on the passive socket
  * which has been waiting for someone to connect to it.
@@ -1896,6 +3381,8 @@ accept_connections (GIOChannel *source,
   XzibitRfbClient *server_details;
   struct sockaddr_in remote_address;
   socklen_t remote_address_size = sizeof (remote_address);
+  unsigned char capabilities[CAPABILITIES_MESSAGE_LENGTH];
+  unsigned char framing[5];
 
   g_print ("Connection on our socket.\n");
 
@@ -1906,6 +3393,12 @@ accept_connections (GIOChannel *source,
    * xzibit-rfb-client when needed.
    */
   server_details->server_fd = -1;
+  server_details->server_channel = NULL;
+  server_details->server_watch = 0;
+  server_details->server_gone = FALSE;
+  server_details->splice_pipe[0] = server_details->splice_pipe[1] = -1;
+  server_details->splice_broken = FALSE;
+  server_details->top_queue = NULL;
   server_details->top_fd = accept (priv->listening_fd,
                                    (struct sockaddr*) &remote_address,
                                    &remote_address_size);
@@ -1928,18 +3421,36 @@ accept_connections (GIOChannel *source,
       return;
     }
 
+  server_details->top_queue = output_queue_new (server_details->top_fd);
+  output_queue_set_congestion_callback (server_details->top_queue,
+                                        OUTPUT_HIGH_WATER,
+                                        OUTPUT_LOW_WATER,
+                                        top_congestion_changed,
+                                        server_details);
+
   DEBUG_FLOW ("sending header",
               xzibit_header,
               sizeof(xzibit_header)-1);
-  if (write (server_details->top_fd,
-              xzibit_header,
-              sizeof(xzibit_header)-1 /* no trailing null */)
-          !=sizeof(xzibit_header)-1)
-    {
-      g_warning ("Could not write header to remote socket; "
-              "things will break");
-    }
-  fsync (server_details->top_fd);
+  output_queue_append (server_details->top_queue,
+                       xzibit_header,
+                       sizeof(xzibit_header)-1 /* no trailing null */);
+
+  /* Say what we can do, and offer long blocks.
+   * xzibit-rfb-client will use them if the other
+   * side offers them too. */
+  make_capabilities_message (capabilities);
+  output_queue_append_block (server_details->top_queue,
+                             OUTPUT_CLASS_CONTROL,
+                             0, /* control channel */
+                             NULL, 0,
+                             capabilities, sizeof (capabilities));
+
+  make_framing_message (framing);
+  output_queue_append_block (server_details->top_queue,
+                             OUTPUT_CLASS_CONTROL,
+                             0, /* control channel */
+                             NULL, 0,
+                             framing, sizeof (framing));
 
   if (priv->avatar->len!=0)
     {
@@ -1956,25 +3467,16 @@ accept_connections (GIOChannel *source,
       DEBUG_FLOW ("sending avatar header",
                   avatar_header,
                   sizeof (avatar_header));
-      if (write (server_details->top_fd,
-                 avatar_header,
-                 sizeof (avatar_header)) != sizeof (avatar_header))
-        {
-          g_warning ("Could not write avatar header; "
-                     "things will break");
-        }
-        
+      output_queue_append (server_details->top_queue,
+                           avatar_header,
+                           sizeof (avatar_header));
 
       DEBUG_FLOW ("sending avatar",
              priv->avatar->str,
              priv->avatar->len);
-      if (write (server_details->top_fd,
-                 priv->avatar->str,
-                 priv->avatar->len) != priv->avatar->len)
-        {
-          g_warning ("Could not write avatar; "
-                     "things will break");
-        }
+      output_queue_append (server_details->top_queue,
+                           priv->avatar->str,
+                           priv->avatar->len);
 
     }
 
@@ -1987,17 +3489,193 @@ accept_connections (GIOChannel *source,
   return TRUE;
 }
 
+/**
+ * Writes all of a buffer to a forwarded window's
+ * connection to libvncserver.
+ */
+static void
+write_to_client (ForwardedWindow *fw,
+                 const guchar *buffer,
+                 gsize length)
+{
+  GByteArray *filtered = NULL;
+
+  if (fw->viewer)
+    {
+      /* libvncserver thinks a broadcast has one client,
+       * so it only sees what that client would send. */
+      filtered = g_byte_array_new ();
+      broadcast_viewer_filter_input (fw->viewer,
+                                     buffer, length,
+                                     filtered);
+      buffer = filtered->data;
+      length = filtered->len;
+    }
+
+  /* So that it knows which encodings the client
+   * understands. */
+  vnc_client_input (fw->window, fw->client_fd, buffer, length);
+
+  while (length)
+    {
+      gssize count = write (fw->client_fd, buffer, length);
+
+      if (count<0)
+        {
+          if (errno==EINTR)
+            continue;
+
+          g_warning ("Could not send received data to client; "
+                     "things will break.");
+          break;
+        }
+
+      buffer += count;
+      length -= count;
+    }
+
+  if (filtered)
+    g_byte_array_free (filtered, TRUE);
+
+  if (fw->viewer && !broadcast_viewer_is_compatible (fw->viewer))
+    {
+      g_warning ("Channel %d can't follow the broadcast of %x; "
+                 "closing it",
+                 fw->channel, (int) fw->window);
+      unshare_subscription (fw);
+    }
+}
+
+/**
+ * What we tell the other side about a window
+ * when we start sending it.
+ */
+typedef struct _WindowMetadata {
+  /**
+   * Its title; never NULL.
+   */
+  gchar *name;
+  /**
+   * Its type, as a letter from window_types,
+   * or an empty string if we don't know.
+   */
+  char type[2];
+  /**
+   * The events we've already selected on it.
+   */
+  long event_mask;
+} WindowMetadata;
+
+/**
+ * Returns the value of a property from an XCB reply,
+ * as a string, or NULL if it wasn't set.  Frees the
+ * reply.
+ */
+static gchar*
+property_reply_to_string (xcb_get_property_reply_t *reply)
+{
+  gchar *result = NULL;
+
+  if (reply && xcb_get_property_value_length (reply) > 0)
+    result = g_strndup (xcb_get_property_value (reply),
+                        xcb_get_property_value_length (reply));
+
+  free (reply);
+
+  return result;
+}
+
+/**
+ * Finds out what we need to know about a window we're
+ * about to send.  Every request goes to the X server
+ * before we wait for any reply, so this takes one round
+ * trip rather than one per property.
+ */
+static void
+fetch_window_metadata (Window window,
+                       WindowMetadata *metadata)
+{
+  xcb_connection_t *xcb =
+    XGetXCBConnection (gdk_x11_get_default_xdisplay ());
+  xcb_get_property_cookie_t net_wm_name, wm_name, window_type;
+  xcb_get_window_attributes_cookie_t attributes;
+  xcb_get_property_reply_t *type_reply;
+  xcb_get_window_attributes_reply_t *attributes_reply;
+  gchar *legacy_name;
+
+  net_wm_name = xcb_get_property (xcb, FALSE, window,
+                                  atoms[ATOM_NET_WM_NAME],
+                                  atoms[ATOM_UTF8_STRING],
+                                  0, 1024);
+  wm_name = xcb_get_property (xcb, FALSE, window,
+                              atoms[ATOM_WM_NAME],
+                              atoms[ATOM_STRING],
+                              0, 1024);
+  window_type = xcb_get_property (xcb, FALSE, window,
+                                  atoms[ATOM_NET_WM_WINDOW_TYPE],
+                                  atoms[ATOM_ATOM],
+                                  0, 1);
+  attributes = xcb_get_window_attributes (xcb, window);
+
+  metadata->name =
+    property_reply_to_string (xcb_get_property_reply (xcb, net_wm_name,
+                                                      NULL));
+  legacy_name =
+    property_reply_to_string (xcb_get_property_reply (xcb, wm_name,
+                                                      NULL));
+
+  if (!metadata->name)
+    metadata->name = legacy_name? legacy_name: g_strdup ("");
+  else
+    g_free (legacy_name);
+
+  metadata->type[0] = metadata->type[1] = 0;
+  type_reply = xcb_get_property_reply (xcb, window_type, NULL);
+
+  if (type_reply && xcb_get_property_value_length (type_reply) >=
+      (int) sizeof (xcb_atom_t))
+    {
+      /* We interned the types we know in advance,
+       * so there's no need to ask for its name. */
+      xcb_atom_t type = *(xcb_atom_t*) xcb_get_property_value (type_reply);
+      int i=0;
+
+      while (window_types[i][0])
+        {
+          if (window_type_atoms[i] == type)
+            {
+              metadata->type[0] = window_types[i][0][0];
+              break;
+            }
+          i++;
+        }
+    }
+
+  free (type_reply);
+
+  metadata->event_mask = 0;
+  attributes_reply = xcb_get_window_attributes_reply (xcb, attributes,
+                                                      NULL);
+
+  if (attributes_reply)
+    {
+      metadata->event_mask = attributes_reply->your_event_mask;
+      free (attributes_reply);
+    }
+}
+
 /**
  * Forwards a block of data for a particular channel to the handler
  * for that channel.  This is a helper function for copy_bottom_to_client,
  * which is concerned with marshalling.
  */
 static void
-handle_message_to_client (MutterPlugin *plugin,
+handle_message_to_client (XzibitPeer *peer,
                           int channel,
                           char *buffer,
                           int length)
 {
+  MutterPlugin *plugin = peer->plugin;
   MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
   ForwardedWindow *fw;
 
@@ -2024,17 +3702,12 @@ handle_message_to_client (MutterPlugin *plugin,
           {
             /* Kick off VNC as appropriate */
             
-            Atom actual_type;
-            int actual_format;
-            unsigned long n_items, bytes_after;
-            unsigned char *property;
-            unsigned char *name_of_window = NULL;
-            unsigned char type_of_window[2] = { 0, 0 };
-            XWindowAttributes get_attr;
+            WindowMetadata metadata;
             XSetWindowAttributes set_attr;
             GIOChannel *channel;
             unsigned int channel_number;
             ForwardedWindow *fw;
+            gboolean new_server = FALSE;
 
             if (length<3)
               {
@@ -2050,7 +3723,7 @@ handle_message_to_client (MutterPlugin *plugin,
             fw = g_hash_table_lookup (priv->forwarded_windows_by_xzibit_id,
                                       &channel_number);
 
-            if (!fw)
+            if (!fw || fw->peer != peer)
               {
                 g_warning ("Attempt to accept channel %d, which doesn't exist",
                            channel_number);
@@ -2066,123 +3739,95 @@ handle_message_to_client (MutterPlugin *plugin,
                 return;
               }
 
-            vnc_create (fw->window);
-            fw->client_fd = vnc_fd (fw->window);
-
-            /* If we receive data from VNC, send it on. */
-
-            channel = g_io_channel_unix_new (fw->client_fd);
-            g_io_add_watch (channel,
-                            G_IO_IN,
-                            copy_client_to_bottom,
-                            fw);
-
-            /* also supply metadata */
-
-            if (XGetWindowProperty (gdk_x11_get_default_xdisplay (),
-                                    fw->window,
-                                    gdk_x11_get_xatom_by_name ("_NET_WM_NAME"),
-                                    0,
-                                    1024,
-                                    False,
-                                    gdk_x11_get_xatom_by_name ("UTF8_STRING"),
-                                    &actual_type,
-                                    &actual_format,
-                                    &n_items,
-                                    &bytes_after,
-                                    &property)==Success)
+            if (priv->broadcast_enabled &&
+                g_list_length (g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                                    &fw->window)) > 1)
               {
-                name_of_window = property;
+                /* Shared with several peers at once, so
+                 * it's encoded once for all of them.
+                 */
+                if (!join_broadcast (fw, &new_server))
+                  {
+                    g_warning ("Could not connect to the VNC server for %x",
+                               (int) fw->window);
+                    return;
+                  }
               }
-            
-            if (!name_of_window &&
-                XGetWindowProperty(gdk_x11_get_default_xdisplay (),
-                                   fw->window,
-                                   gdk_x11_get_xatom_by_name ("WM_NAME"),
-                                   0,
-                                   1024,
-                                   False,
-                                   gdk_x11_get_xatom_by_name ("STRING"),
-                                   &actual_type,
-                                   &actual_format,
-                                   &n_items,
-                                   &bytes_after,
-                                   &property)==Success)
+            else
               {
-                name_of_window = property;
-              }
+                fw->client_fd = connect_to_server (fw->window,
+                                                   &new_server);
 
-            g_print ("Name of window is %s",
-                     name_of_window);
-
-            if (name_of_window &&
-                XGetWindowProperty(gdk_x11_get_default_xdisplay (),
-                                   fw->window,
-                                   gdk_x11_get_xatom_by_name ("_NET_WM_WINDOW_TYPE"),
-                                   0,
-                                   1,
-                                   False,
-                                   gdk_x11_get_xatom_by_name ("ATOM"),
-                                   &actual_type,
-                                   &actual_format,
-                                   &n_items,
-                                   &bytes_after,
-                                   &property)==Success)
-              {
-                char *type = NULL;
-                int i=0;
-                
-                if (property)
-                  type = XGetAtomName(gdk_x11_get_default_xdisplay (),
-                                      *((int*) property));
-                
-                /* FIXME: Presumably that can fail */
-
-                if (type)
+                if (fw->client_fd==-1)
                   {
-                    while (window_types[i][0])
-                      {
-                        if (strcmp(window_types[i][1], type)==0)
-                          {
-                            type_of_window[0] = window_types[i][0][0];
-                            break;
-                          }
-                        i++;
-                      }
+                    g_warning ("Could not connect to the VNC server for %x",
+                               (int) fw->window);
+                    return;
                   }
+
+                /* If we receive data from VNC, send it on. */
+
+                fw->client_channel = g_io_channel_unix_new (fw->client_fd);
+                fw->client_watch = g_io_add_watch (fw->client_channel,
+                                                   G_IO_IN,
+                                                   copy_client_to_bottom,
+                                                   fw);
               }
 
+            /* If they do flow control, we can't send
+             * anything until they give us credit, which
+             * they do straight after accepting. */
+            fw->credit_limited =
+              (peer->capabilities & CAPABILITY_CREDIT) != 0;
+            fw->credit = 0;
+            update_client_watch (fw);
+
+            update_priority (fw);
+
+            /* What arrives for it from now on is a byte
+             * stream for libvncserver, so it can go
+             * straight there as it arrives.
+             */
+            block_parser_set_streamed (peer->parser,
+                                       channel_number,
+                                       TRUE);
+
+            /* also supply metadata */
+
+            fetch_window_metadata (fw->window, &metadata);
+
             g_print ("Name of window==[%s]; type==[%s]\n",
-                     name_of_window,
-                     type_of_window);
+                     metadata.name,
+                     metadata.type);
 
-            send_metadata_from_bottom (plugin,
+            /* These go out together, at the end of this
+             * pass of the main loop. */
+            send_metadata_from_bottom (peer,
                                        fw->channel,
                                        XZIBIT_METADATA_NAME,
-                                       name_of_window,
+                                       metadata.name,
                                        -1);
 
-            send_metadata_from_bottom (plugin,
+            send_metadata_from_bottom (peer,
                                        fw->channel,
                                        XZIBIT_METADATA_TYPE,
-                                       type_of_window,
+                                       metadata.type,
                                        1);
 
             /* we don't supply icons yet. */
 
             /* Now start things going... */
 
-            vnc_start (fw->window);
+            if (new_server)
+              {
+                supply_texture (plugin, fw->window);
+                vnc_start (fw->window);
+              }
 
             /* ...request mouse movement information... */
-            /* FIXME: these can fail */
-
-            XGetWindowAttributes (gdk_x11_get_default_xdisplay (),
-                                  fw->window,
-                                  &get_attr);
 
             set_attr.event_mask =
-              get_attr.your_event_mask |
+              metadata.event_mask |
               PointerMotionMask |
               LeaveWindowMask;
 
@@ -2193,7 +3838,87 @@ handle_message_to_client (MutterPlugin *plugin,
 
             /* ...and clean up after ourselves. */
 
-            XFree (name_of_window);
+            g_free (metadata.name);
+          }
+          break;
+
+        case 10: /* FRAMING */
+          {
+            guint32 max_length;
+
+            if (length<5)
+              {
+                g_warning ("Framing message ran short");
+                return;
+              }
+
+            max_length = (guchar) buffer[1] |
+              (guchar) buffer[2] << 8 |
+              (guchar) buffer[3] << 16 |
+              (guint32) (guchar) buffer[4] << 24;
+
+            /* They'll send no more short blocks of 0xFFFF,
+             * so a length of 0xFFFF from here on means
+             * a long header.
+             */
+            block_parser_allow_long_blocks (peer->parser,
+                                            BLOCK_PARSER_LONG_MAX);
+
+            /* We never send more than we'd take. */
+            if (max_length > BLOCK_PARSER_SHORT_MAX)
+              peer->max_block = MIN (max_length, BLOCK_PARSER_LONG_MAX);
+
+            output_queue_allow_long_blocks (get_bottom_queue (peer),
+                                            peer->max_block);
+          }
+          break;
+
+        case 11: /* CAPABILITIES */
+          if (length<5)
+            {
+              g_warning ("Capabilities message ran short");
+              return;
+            }
+
+          /* Anything after the map is for later
+           * versions. */
+          peer->capabilities = (guchar) buffer[1] |
+            (guchar) buffer[2] << 8 |
+            (guchar) buffer[3] << 16 |
+            (guint32) (guchar) buffer[4] << 24;
+
+          if (mutter_plugin_debug_mode (plugin))
+            g_print ("%s supports %08x\n",
+                     peer->target,
+                     peer->capabilities);
+          break;
+
+        case 12: /* CREDIT */
+          {
+            unsigned int channel_number;
+            guint32 bytes;
+
+            if (length<7)
+              {
+                g_warning ("Credit message ran short");
+                return;
+              }
+
+            channel_number = (guchar) buffer[1] |
+              (guchar) buffer[2] << 8;
+            bytes = (guchar) buffer[3] |
+              (guchar) buffer[4] << 8 |
+              (guchar) buffer[5] << 16 |
+              (guint32) (guchar) buffer[6] << 24;
+
+            fw = g_hash_table_lookup (priv->forwarded_windows_by_xzibit_id,
+                                      &channel_number);
+
+            if (!fw || fw->peer != peer || !fw->credit_limited)
+              return;
+
+            fw->credit += bytes;
+            update_client_watch (fw);
           }
           break;
 
@@ -2208,27 +3933,118 @@ handle_message_to_client (MutterPlugin *plugin,
   fw = g_hash_table_lookup (priv->forwarded_windows_by_xzibit_id,
                             &channel);
 
-  if (!fw) {
+  if (!fw || fw->peer != peer) {
     g_warning ("Discarding message to channel %d because it doesn't have a handler",
                channel);
     return;
   }
 
-  /* FIXME: error checking; it could run short */
-
   DEBUG_FLOW ("sent from TOP to CLIENT",
               buffer, length);
-  if (write (fw->client_fd, buffer, length)!=length)
+  write_to_client (fw, (const guchar*) buffer, length);
+}
+
+/**
+ * Called when the other side's greeting has arrived
+ * from a peer.
+ */
+static void
+bottom_greeting_received (gpointer data)
+{
+  send_avatar ((XzibitPeer*) data);
+}
+
+/**
+ * Called with each block which arrives from a peer.
+ */
+static void
+bottom_block_received (int channel,
+                       const guchar *payload,
+                       gsize length,
+                       gpointer data)
+{
+  handle_message_to_client ((XzibitPeer*) data,
+                            channel,
+                            (char*) payload,
+                            length);
+}
+
+/**
+ * Called with each piece of a block on a streamed
+ * channel, that is, RFB data for a window whose
+ * sharing has been accepted.
+ */
+static void
+bottom_span_received (int channel,
+                      const guchar *data,
+                      gsize length,
+                      gpointer user_data)
+{
+  XzibitPeer *peer = (XzibitPeer*) user_data;
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (peer->plugin)->priv;
+  ForwardedWindow *fw;
+
+  fw = g_hash_table_lookup (priv->forwarded_windows_by_xzibit_id,
+                            &channel);
+
+  if (!fw || fw->peer != peer || fw->client_fd==-1)
     {
-      g_warning ("Could not send received data to client; "
-              "things will break.");
+      /* it went away part-way through a block */
+      return;
     }
+
+  DEBUG_FLOW ("streamed from TOP to CLIENT",
+              (unsigned char*) data, length);
+  write_to_client (fw, data, length);
 }
 
+#ifdef HAVE_SPLICE
+
+/**
+ * Payloads at least this long go from a peer to
+ * libvncserver by splice() rather than through a
+ * buffer of ours.  Below this, the extra system calls
+ * cost more than the copy.
+ */
+#define SPLICE_THRESHOLD 16384
+
+/**
+ * Moves up to "length" bytes of a streamed payload
+ * from a peer to a forwarded window's connection
+ * to libvncserver without them coming through our
+ * address space.
+ *
+ * \return  FALSE if nothing was moved and the caller
+ *          should read() the peer's fd as usual instead.
+ */
+static gboolean
+splice_bottom_to_client (XzibitPeer *peer,
+                         ForwardedWindow *fw,
+                         gsize length)
+{
+  gssize moved;
+
+  moved = splice_through_pipe (peer->fd,
+                               fw->client_fd,
+                               peer->splice_pipe,
+                               length,
+                               &peer->splice_broken);
+
+  if (moved<=0)
+    return FALSE;
+
+  vnc_client_input (fw->window, fw->client_fd, NULL, moved);
+  block_parser_skip (peer->parser, moved);
+
+  return TRUE;
+}
+
+#endif /* HAVE_SPLICE */
+
 /**
  * Handles any data about received windows
- * arriving from the connection we made to the
- * other side's listening socket.  Also handles
+ * arriving from the connection we made to a
+ * peer's listening socket.  Also handles
  * recognising the signature at the start.
  */
 static gboolean
@@ -2236,176 +4052,258 @@ copy_bottom_to_client (GIOChannel *source,
                        GIOCondition condition,
                        gpointer data)
 {
-  MutterPlugin *plugin = (MutterPlugin*) data;
-  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
-  unsigned char buffer[1024];
-  int count, i;
-  Window *xid;
-  
-  count = read (priv->bottom_fd,
-                buffer,
-                sizeof(buffer));
+  XzibitPeer *peer = (XzibitPeer*) data;
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (peer->plugin)->priv;
+  unsigned char buffer[65536];
+  int count;
 
-  if (count<0)
+#ifdef HAVE_SPLICE
+  if (!peer->splice_broken)
     {
-      perror ("xzibit");
-      g_error ("Something downstream died.");
-    }
+      int channel;
+      gsize pending = block_parser_get_pending (peer->parser,
+                                                &channel);
 
-  DEBUG_FLOW ("received at BOTTOM from TOP", buffer, count);
-  
-  for (i=0; i<count; i++)
-    {
-      if (count < 0)
+      if (pending >= SPLICE_THRESHOLD)
         {
-          perror ("xzibit");
-          /* FIXME */
-          g_error ("Something went wrong");
+          ForwardedWindow *fw =
+            g_hash_table_lookup (priv->forwarded_windows_by_xzibit_id,
+                                 &channel);
+
+          /* What a peer of a broadcast sends has to be
+           * looked at on the way; see write_to_client(). */
+          if (fw && fw->peer == peer && fw->client_fd!=-1 &&
+              !fw->viewer &&
+              splice_bottom_to_client (peer, fw, pending))
+            return TRUE;
         }
+    }
+#endif /* HAVE_SPLICE */
+
+  count = read (peer->fd,
+                buffer,
+                sizeof(buffer));
 
-      if (count==0)
+  if (count<0)
+    {
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
         {
-          return /* FIXME: TRUE? */;
+          /* the peer's fd is non-blocking, since we
+           * write to it through an OutputQueue */
+          return TRUE;
         }
 
-      switch (priv->bottom_stage)
-        {
-        case -4:
-          priv->bottom_channel = buffer[i];
-          break;
+      g_warning ("Lost the connection to %s: %s",
+                 peer->target, g_strerror (errno));
+      forget_peer (peer);
+      return FALSE;
+    }
 
-        case -3:
-          priv->bottom_channel |= buffer[i] * 256;
-          break;
+  if (count==0)
+    {
+      g_warning ("%s closed the connection", peer->target);
+      forget_peer (peer);
+      return FALSE;
+    }
 
-        case -2:
-          priv->bottom_length = buffer[i];
-          break;
+  DEBUG_FLOW ("received at BOTTOM from TOP", buffer, count);
 
-        case -1:
-          priv->bottom_length |= buffer[i] * 256;
-          priv->bottom_buffer = g_malloc (priv->bottom_length);
-          break;
+  if (!block_parser_feed (peer->parser,
+                          buffer,
+                          count))
+    {
+      g_warning ("%s isn't talking xzibit; closing the connection",
+                 peer->target);
+      forget_peer (peer);
+      return FALSE;
+    }
 
-        default:
-          if (priv->bottom_stage < 0)
-            {
-              /* still reading the header */
-              if (xzibit_header[priv->bottom_stage+
-                                sizeof(xzibit_header)+3]!=
-                  buffer[i])
-                {
-                  /* FIXME g_error() is for programming errors */
-                  g_error ("Connected to something that isn't xzibit");
-                }
-
-              if (priv->bottom_stage == -5)
-                {
-                  introduce_yourself (plugin);
-                }
-            }
-          else
-            {
-              priv->bottom_buffer[priv->bottom_stage] =
-                buffer[i];
-
-              if (priv->bottom_stage==priv->bottom_length-1)
-                {
-                  handle_message_to_client (plugin,
-                                            priv->bottom_channel,
-                                            priv->bottom_buffer,
-                                            priv->bottom_length);
-                  
-                  /* and reset */
-                  g_free (priv->bottom_buffer);
-                  priv->bottom_stage = -5;
-                }
-            }
-        }
+  return TRUE;
+}
 
-      priv->bottom_stage++;
+/**
+ * Returns what we know about a window, creating
+ * an empty record if we know nothing.
+ */
+static WindowInfo*
+get_window_info (MutterPlugin *plugin,
+                 Window window)
+{
+  MutterXzibitPluginPrivate *priv = MUTTER_XZIBIT_PLUGIN (plugin)->priv;
+  WindowInfo *info = g_hash_table_lookup (priv->window_info,
+                                          GUINT_TO_POINTER (window));
+
+  if (!info)
+    {
+      info = g_malloc (sizeof (WindowInfo));
+      info->sharing_known = FALSE;
+      info->sharing = 0;
+      info->parent_known = FALSE;
+      info->parent = None;
+
+      g_hash_table_insert (priv->window_info,
+                           GUINT_TO_POINTER (window),
+                           info);
     }
 
-  return TRUE;
+  return info;
 }
 
 /**
- * Returns whether a given window is related to a
- * window that's being shared.
- *
- * \param dpy    The display
- * \param window The given window
- * \param relationship  How they might be related
- *       (in practice, usually "WM_TRANSIENT_FOR")
+ * Returns the sharing state of a window, asking the
+ * X server only if we haven't seen it before.
  */
-static gboolean
-related_to_shared_window (Display *dpy,
-                          Window window,
-                          gchar *relationship)
+static guint32
+get_sharing_state (MutterPlugin *plugin,
+                   Display *dpy,
+                   Window window)
 {
+  WindowInfo *info = get_window_info (plugin, window);
   Atom actual_type;
   int actual_format;
   unsigned long n_items, bytes_after;
-  unsigned char *property;
-  guint32 parent, sharing;
+  unsigned char *property = NULL;
+
+  if (info->sharing_known)
+    return info->sharing;
 
   if (XGetWindowProperty(dpy,
                          window,
-                         gdk_x11_get_xatom_by_name (relationship),
+                         atoms[ATOM_XZIBIT_SHARE],
                          0,
                          4,
                          False,
-                         gdk_x11_get_xatom_by_name ("WINDOW"),
+                         atoms[ATOM_CARDINAL],
                          &actual_type,
                          &actual_format,
                          &n_items,
                          &bytes_after,
                          &property)!=Success)
     {
-      g_warning ("We can't tell the %s of %x.\n",
-                 relationship, (int)window);
-      return FALSE; /* we can't tell */
+      /* g_warning ("can't read sharing of %x", (int)window); */
+      return 0; /* we can't tell */
     }
-  if (property == NULL)
+
+  info->sharing_known = TRUE;
+  info->sharing = 0;
+
+  if (property)
     {
-      /* g_warning ("%x has no %s.\n", (int)window, relationship); */
-      return FALSE; /* no, it isn't */
+      info->sharing = *(guint32*) property;
+      XFree (property);
     }
 
-  parent = *((guint32*) property);
-  XFree (property);
+  return info->sharing;
+}
 
-  /* g_warning ("%s relation of %x is %x",
-             relationship, (int)window,
-             parent); */
+/**
+ * Returns the window a window is transient for, or
+ * None, asking the X server only if we haven't seen
+ * it before.
+ */
+static Window
+get_transient_parent (MutterPlugin *plugin,
+                      Display *dpy,
+                      Window window)
+{
+  WindowInfo *info = get_window_info (plugin, window);
+  Atom actual_type;
+  int actual_format;
+  unsigned long n_items, bytes_after;
+  unsigned char *property = NULL;
+
+  if (info->parent_known)
+    return info->parent;
 
   if (XGetWindowProperty(dpy,
-                         parent,
-                         gdk_x11_get_xatom_by_name ("_XZIBIT_SHARE"),
+                         window,
+                         atoms[ATOM_WM_TRANSIENT_FOR],
                          0,
                          4,
                          False,
-                         gdk_x11_get_xatom_by_name ("CARDINAL"),
+                         atoms[ATOM_WINDOW],
                          &actual_type,
                          &actual_format,
                          &n_items,
                          &bytes_after,
                          &property)!=Success)
     {
-      /* g_warning ("can't read relationship %s\n", relationship); */
-      return FALSE; /* we can't tell */
+      g_warning ("We can't tell the WM_TRANSIENT_FOR of %x.\n",
+                 (int)window);
+      return None; /* we can't tell */
     }
-  
-  if (property == NULL)
+
+  info->parent_known = TRUE;
+  info->parent = None;
+
+  if (property)
     {
-      /* g_warning ("no sharing on parent, %x", (int)parent); */
-      return FALSE; /* no, it isn't */
+      info->parent = *((guint32*) property);
+      XFree (property);
     }
 
-  sharing = *(guint32*) property;
-  XFree (property);
+  return info->parent;
+}
+
+/**
+ * Returns whether a given window is transient for
+ * a window that's being shared.
+ *
+ * \param plugin The plugin
+ * \param dpy    The display
+ * \param window The given window
+ */
+static gboolean
+related_to_shared_window (MutterPlugin *plugin,
+                          Display *dpy,
+                          Window window)
+{
+  Window parent = get_transient_parent (plugin, dpy, window);
 
-  return sharing==1;
+  if (parent == None)
+    return FALSE; /* no, it isn't */
+
+  /* g_warning ("WM_TRANSIENT_FOR relation of %x is %x",
+             (int)window, (int)parent); */
+
+  return get_sharing_state (plugin, dpy, parent)==1;
+}
+
+/**
+ * Finds the compositor's texture for a window we're
+ * about to share, and hands it to the VNC server so
+ * that it doesn't have to ask the X server for pixels.
+ */
+static void
+supply_texture (MutterPlugin *plugin,
+                Window window)
+{
+  GList *windows;
+
+  for (windows = mutter_plugin_get_windows (plugin);
+       windows;
+       windows = windows->next)
+    {
+      MutterWindow *mw = windows->data;
+      MetaWindow *meta_window = mutter_window_get_meta_window (mw);
+      MetaRectangle outer, *inner;
+
+      if (!meta_window ||
+          meta_window_get_xwindow (meta_window) != window)
+        continue;
+
+      /* The texture holds the frame as well as the
+       * window, so work out where the window is in it.
+       */
+      meta_window_get_outer_rect (meta_window, &outer);
+      inner = meta_window_get_rect (meta_window);
+
+      vnc_set_texture (window,
+                       mutter_window_get_texture (mw),
+                       inner->x - outer.x,
+                       inner->y - outer.y);
+      return;
+    }
 }
 
 /**
@@ -2425,11 +4323,11 @@ share_transiency_on_map (MutterPlugin *plugin,
   guint32 client_leader;
   guint32 *sharing;
   Display *dpy = map_event->display;
-  XzibitSendingWindow *sending;
+  GList *cursor;
 
   /* g_warning ("Transiency check for %x starting\n", (int) map_event->window); */
 
-  if (related_to_shared_window (dpy, window, "WM_TRANSIENT_FOR"))
+  if (related_to_shared_window (plugin, dpy, window))
     {
       /* This is what we've been looking for!
        * The window is related to a shared window.
@@ -2437,22 +4335,31 @@ share_transiency_on_map (MutterPlugin *plugin,
        */
       
       guint32 window_is_shared = 1;
+      Window parent = get_transient_parent (plugin, dpy, window);
             
       XChangeProperty (dpy,
                        window,
-                       gdk_x11_get_xatom_by_name ("WM_TRANSIENT_FOR"),
-                       gdk_x11_get_xatom_by_name ("CARDINAL"),
+                       atoms[ATOM_WM_TRANSIENT_FOR],
+                       atoms[ATOM_CARDINAL],
                        32,
                        PropModeReplace,
                        (const unsigned char*) &window_is_shared,
                        1);
 
-      sending = sending_window_new (dpy,
-                                    window);
-            
-      share_window (dpy,
-                    sending,
-                    plugin);
+      /* Send it to everyone we're sending its parent to. */
+      for (cursor = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                         &parent);
+           cursor;
+           cursor = cursor->next)
+        {
+          ForwardedWindow *fw = cursor->data;
+
+          share_window (dpy,
+                        sending_window_new (dpy,
+                                            window,
+                                            fw->peer->target),
+                        plugin);
+        }
     }
 }
 
@@ -2476,6 +4383,51 @@ ensure_display(MutterPlugin *plugin,
     }
 }
 
+/**
+ * Sends the latest pointer position over a window.
+ */
+static void
+send_pointer (ForwardedWindow *fw)
+{
+  char xzibit_packet[7];
+
+  xzibit_packet[0] = 8; /* MOUSE */
+  xzibit_packet[1] = (fw->channel) % 256;
+  xzibit_packet[2] = (fw->channel) / 256;
+  xzibit_packet[3] = (fw->pointer_x) % 256;
+  xzibit_packet[4] = (fw->pointer_x) / 256;
+  xzibit_packet[5] = (fw->pointer_y) % 256;
+  xzibit_packet[6] = (fw->pointer_y) / 256;
+
+  send_buffer_from_bottom (fw->peer,
+                           0, /* control */
+                           xzibit_packet,
+                           sizeof (xzibit_packet));
+
+  fw->pointer_pending = FALSE;
+}
+
+/**
+ * Called pointer_interval after we last sent the
+ * pointer position over a window, to send the latest
+ * one if it's moved since.  We keep going until it
+ * stops moving.
+ */
+static gboolean
+send_pointer_later (gpointer data)
+{
+  ForwardedWindow *fw = (ForwardedWindow*) data;
+
+  if (fw->pointer_pending)
+    {
+      send_pointer (fw);
+      return TRUE;
+    }
+
+  fw->pointer_timeout = 0;
+  return FALSE;
+}
+
 /**
  * Called on every X event.  We use this to spy on
  * changes to properties and so on.
@@ -2495,6 +4447,9 @@ xevent_filter (MutterPlugin *plugin, XEvent *event)
       first = FALSE;
   }
 
+  if (vnc_handle_xevent (event))
+    return TRUE;
+
   gdk_error_trap_push ();
 
   switch (event->type)
@@ -2507,14 +4462,53 @@ xevent_filter (MutterPlugin *plugin, XEvent *event)
       }
       break;
 
+    case DestroyNotify:
+      {
+        XDestroyWindowEvent *destroy = (XDestroyWindowEvent*) event;
+
+        g_hash_table_remove (priv->window_info,
+                             GUINT_TO_POINTER (destroy->window));
+      }
+      break;
+
     case PropertyNotify:
       {
         XPropertyEvent *property = (XPropertyEvent*) event;
         int new_state = 0;
-        Atom xzibit_share_atom = gdk_x11_get_xatom_by_name ("_XZIBIT_SHARE");
+        Atom xzibit_share_atom = atoms[ATOM_XZIBIT_SHARE];
+        WindowInfo *info;
 
         ensure_display (plugin, property->display);
 
+        if (property->atom == atoms[ATOM_WM_TRANSIENT_FOR])
+          {
+            info = g_hash_table_lookup (priv->window_info,
+                                        GUINT_TO_POINTER (property->window));
+
+            if (info)
+              info->parent_known = FALSE;
+
+            break;
+          }
+
+        if (property->atom == atoms[ATOM_XZIBIT_PRIORITY])
+          {
+            GList *cursor;
+
+            for (cursor = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                               &(property->window));
+                 cursor;
+                 cursor = cursor->next)
+              {
+                ForwardedWindow *fwd = cursor->data;
+
+                if (fwd->client_fd!=-1)
+                  update_priority (fwd);
+              }
+
+            break;
+          }
+
         if (property->atom != xzibit_share_atom)
           return FALSE;
 
@@ -2544,6 +4538,10 @@ xevent_filter (MutterPlugin *plugin, XEvent *event)
             XFree (value);
           }
 
+        info = get_window_info (plugin, property->window);
+        info->sharing_known = TRUE;
+        info->sharing = new_state;
+
         set_sharing_state (property->display,
                            property->window,
                            new_state,
@@ -2567,26 +4565,33 @@ xevent_filter (MutterPlugin *plugin, XEvent *event)
     case MotionNotify:
       {
         XMotionEvent *motion = (XMotionEvent*) event;
-        ForwardedWindow *fwd;
-        char xzibit_packet[7];
+        GList *cursor;
 
-        fwd = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
-                                   &(motion->window));
-
-        if (fwd)
+        for (cursor = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                           &(motion->window));
+             cursor;
+             cursor = cursor->next)
           {
-            xzibit_packet[0] = 8; /* MOUSE */
-            xzibit_packet[1] = (fwd->channel) % 256;
-            xzibit_packet[2] = (fwd->channel) / 256;
-            xzibit_packet[3] = (motion->x) % 256;
-            xzibit_packet[4] = (motion->x) / 256;
-            xzibit_packet[5] = (motion->y) % 256;
-            xzibit_packet[6] = (motion->y) / 256;
-
-            send_buffer_from_bottom (plugin,
-                                     0, /* control */
-                                     xzibit_packet,
-                                     sizeof (xzibit_packet));
+            ForwardedWindow *fwd = cursor->data;
+
+            /* they haven't accepted it yet */
+            if (fwd->client_fd==-1)
+              continue;
+
+            fwd->pointer_x = motion->x;
+            fwd->pointer_y = motion->y;
+            fwd->pointer_pending = TRUE;
+
+            if (!fwd->pointer_timeout)
+              {
+                send_pointer (fwd);
+
+                if (priv->pointer_interval)
+                  fwd->pointer_timeout =
+                    g_timeout_add (priv->pointer_interval,
+                                   send_pointer_later,
+                                   fwd);
+              }
           }
       }
       break;
@@ -2594,17 +4599,33 @@ xevent_filter (MutterPlugin *plugin, XEvent *event)
     case LeaveNotify:
       {
         XCrossingEvent *crossing = (XCrossingEvent*) event;
-        ForwardedWindow *fwd;
+        GList *cursor;
         char xzibit_packet[1];
 
-        fwd = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
-                                   &(crossing->window));
-
-        if (fwd)
+        for (cursor = g_hash_table_lookup (priv->forwarded_windows_by_x11_id,
+                                           &(crossing->window));
+             cursor;
+             cursor = cursor->next)
           {
+            ForwardedWindow *fwd = cursor->data;
+
+            if (fwd->client_fd==-1)
+              continue;
+
+            /* The last place the pointer was over the
+             * window goes first. */
+            if (fwd->pointer_pending)
+              send_pointer (fwd);
+
+            if (fwd->pointer_timeout)
+              {
+                g_source_remove (fwd->pointer_timeout);
+                fwd->pointer_timeout = 0;
+              }
+
             xzibit_packet[0] = 8; /* MOUSE */
 
-            send_buffer_from_bottom (plugin,
+            send_buffer_from_bottom (fwd->peer,
                                      0, /* control */
                                      xzibit_packet,
                                      sizeof (xzibit_packet));
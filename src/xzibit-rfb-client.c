@@ -10,6 +10,8 @@
 #include <X11/extensions/XInput.h>
 
 #include "doppelganger.h"
+#include "block-parser.h"
+#include "capabilities.h"
 
 /****************************************************************
  * Some globals.
@@ -32,22 +34,51 @@ int following_fd = -1;
  * Definitions used for buffer reading.
  ****************************************************************/
 
-typedef enum {
-  STATE_START,
-  STATE_SEEN_CHANNEL,
-  STATE_SEEN_LENGTH,
-} FdReadState;
-
 #define METADATA_TRANSIENCY 1
 #define METADATA_TITLE 2
 #define METADATA_TYPE 3
 #define METADATA_ICON 4
 
-FdReadState fd_read_state = STATE_START;
-int fd_read_through = 0;
-int fd_read_channel = 0;
-int fd_read_length = 0;
-char* fd_read_buffer = NULL;
+/**
+ * Splits what arrives on following_fd into blocks.
+ */
+BlockParser *fd_parser = NULL;
+
+/**
+ * The most we read from gtk-vnc at once, and so the
+ * longest block we send, if long blocks are allowed.
+ */
+#define RFB_READ_SIZE (256*1024)
+
+/**
+ * The longest block we may send.  Our parent offered
+ * long blocks when the connection began, so this
+ * becomes larger once the other side offers them too.
+ */
+gsize max_block_length = BLOCK_PARSER_SHORT_MAX;
+
+/**
+ * What the other side told us it supports, as
+ * CAPABILITY_* bits; 0 until it does.  (Our parent
+ * told them what we support.)
+ */
+guint32 peer_capabilities = 0;
+
+/**
+ * If the other side does flow control, this is how many
+ * bytes of RFB data we let it have in flight for each
+ * window.  Small enough that a slow connection doesn't
+ * build up seconds of stale frames, and large enough
+ * for a good-sized update.
+ */
+#define CREDIT_WINDOW (256*1024)
+
+/**
+ * We give back credit in pieces of at least this
+ * many bytes, so as not to send a CREDIT message
+ * for every block.
+ */
+#define CREDIT_RETURN (64*1024)
 
 typedef void (MessageHandler) (int, unsigned char*, unsigned int);
 
@@ -79,6 +110,13 @@ typedef struct {
    * (implicit or explicit) to display this window.
    */
   gboolean permitted;
+  /**
+   * Whether we give the other side credit for sending
+   * on this channel, and if so, how many bytes it has
+   * sent which we've passed on but not yet given back.
+   */
+  gboolean gives_credit;
+  gsize consumed;
 } XzibitReceivedWindow;
 
 GHashTable *received_windows = NULL;
@@ -225,12 +263,18 @@ check_for_rfb_replies (GIOChannel *source,
 		       gpointer data)
 {
   XzibitReceivedWindow *received = data;
-  char buffer[1024];
+  static char *buffer = NULL;
   int fd = g_io_channel_unix_get_fd (source);
   int count;
-  char header[4];
+  unsigned char header[8];
+  gsize header_length = 4;
 
-  count = read (fd, &buffer, sizeof(buffer));
+  if (!buffer)
+    buffer = g_malloc (RFB_READ_SIZE);
+
+  /* One read makes one block, so read as much as
+   * the other side will take in a block. */
+  count = read (fd, buffer, MIN (max_block_length, RFB_READ_SIZE));
 
   if (count<0)
     {
@@ -245,15 +289,54 @@ check_for_rfb_replies (GIOChannel *source,
 
   header[0] = received->id % 256;
   header[1] = received->id / 256;
-  header[2] = count % 256;
-  header[3] = count / 256;
 
-  write_to_following_fd (header, sizeof (header));
+  if (count <= BLOCK_PARSER_SHORT_MAX)
+    {
+      header[2] = count % 256;
+      header[3] = count / 256;
+    }
+  else
+    {
+      header[2] = header[3] = 0xFF;
+      header[4] = count & 0xFF;
+      header[5] = (count >> 8) & 0xFF;
+      header[6] = (count >> 16) & 0xFF;
+      header[7] = (count >> 24) & 0xFF;
+      header_length = 8;
+    }
+
+  write_to_following_fd (header, header_length);
   write_to_following_fd (buffer, count);
 
   return TRUE;
 }
 
+/**
+ * Lets the other side send another "bytes" bytes on
+ * the given channel.
+ */
+static void
+give_credit_for_channel (unsigned int channel_id,
+			 guint32 bytes)
+{
+  unsigned char buffer[11];
+
+  buffer[0] = 0; /* CONTROL_CHANNEL */
+  buffer[1] = 0; /* ditto */
+  buffer[2] = 7; /* length of this message */
+  buffer[3] = 0;
+
+  buffer[4] = 12; /* COMMAND_CREDIT */
+  buffer[5] = channel_id % 256;
+  buffer[6] = channel_id / 256;
+  buffer[7] = bytes & 0xFF;
+  buffer[8] = (bytes >> 8) & 0xFF;
+  buffer[9] = (bytes >> 16) & 0xFF;
+  buffer[10] = (bytes >> 24) & 0xFF;
+
+  write_to_following_fd (buffer, sizeof(buffer));
+}
+
 /**
  * Handler for video (i.e. RFB) channels.
  */
@@ -270,6 +353,18 @@ handle_video_message (int channel,
     {
       g_warning ("Writing to the VNC library ran short.  Things will break.");
     }
+
+  /* It's out of our hands, so they can send more. */
+  if (received->gives_credit)
+    {
+      received->consumed += length;
+
+      if (received->consumed >= CREDIT_RETURN)
+	{
+	  give_credit_for_channel (channel, received->consumed);
+	  received->consumed = 0;
+	}
+    }
 }
 
 /**
@@ -466,6 +561,35 @@ give_permission_for_channel (unsigned int channel_id)
   buffer[6] = channel_id / 256;
 
   write_to_following_fd (buffer, sizeof(buffer));
+
+  /* If they do flow control, they can't send until
+   * we give them some credit. */
+  if (peer_capabilities & CAPABILITY_CREDIT)
+    give_credit_for_channel (channel_id, CREDIT_WINDOW);
+}
+
+/**
+ * Starts giving credit on a video channel which was
+ * opened before we knew the other side does flow
+ * control; until it has some, it can't send anything.
+ * Called for each received window.
+ */
+static void
+start_giving_credit (gpointer key,
+		     gpointer value,
+		     gpointer user_data)
+{
+  XzibitReceivedWindow *received = (XzibitReceivedWindow*) value;
+
+  if (received->handler != handle_video_message ||
+      received->gives_credit)
+    return;
+
+  received->gives_credit = TRUE;
+  received->consumed = 0;
+
+  if (received->permitted)
+    give_credit_for_channel (*((int*) key), CREDIT_WINDOW);
 }
 
 static GdkFilterReturn
@@ -565,6 +689,8 @@ open_new_channel (int channel_id)
 		       received);
 
   received->handler = handle_video_message;
+  received->gives_credit = (peer_capabilities & CAPABILITY_CREDIT) != 0;
+  received->consumed = 0;
 
   if (policy != POLICY_ALLOW_ALWAYS)
     {
@@ -906,6 +1032,54 @@ handle_control_channel_message (int channel,
       }
       break;
 
+    case 10: /* Framing */
+      {
+	guint32 max_length;
+
+	if (length < 5)
+	  {
+	    g_warning ("Framing message; bad length (%d)\n",
+		       length);
+	    return;
+	  }
+
+	max_length = buffer[1] | buffer[2] << 8 |
+	  buffer[3] << 16 | (guint32) buffer[4] << 24;
+
+	/* Our parent offered long blocks on our behalf,
+	 * and now they've offered them too, so a length
+	 * of 0xFFFF from here on means a long header.
+	 */
+	block_parser_allow_long_blocks (fd_parser,
+					BLOCK_PARSER_LONG_MAX);
+
+	/* We never send more than we'd take. */
+	if (max_length > BLOCK_PARSER_SHORT_MAX)
+	  max_block_length = MIN (max_length, BLOCK_PARSER_LONG_MAX);
+      }
+      break;
+
+    case 11: /* Capabilities */
+      if (length < 5)
+	{
+	  g_warning ("Capabilities message; bad length (%d)\n",
+		     length);
+	  return;
+	}
+
+      /* Anything after the map is for later
+       * versions. */
+      peer_capabilities = buffer[1] | buffer[2] << 8 |
+	buffer[3] << 16 | (guint32) buffer[4] << 24;
+
+      /* It may come after some OPENs, which we've
+       * already accepted without giving credit. */
+      if (peer_capabilities & CAPABILITY_CREDIT)
+	g_hash_table_foreach (received_windows,
+			      start_giving_credit,
+			      NULL);
+      break;
+
     default:
       g_warning ("Unknown control channel opcode %x\n",
 		 opcode);
@@ -946,6 +1120,21 @@ handle_xzibit_message (int channel,
 		     length);
 }
 
+/**
+ * Called with each block which arrives from the
+ * upstream Mutter process.
+ */
+static void
+fd_block_received (int channel,
+		   const guchar *payload,
+		   gsize length,
+		   gpointer user_data)
+{
+  handle_xzibit_message (channel,
+			 (unsigned char*) payload,
+			 length);
+}
+
 /**
  * Called when data arrives from the upstream Mutter
  * process.
@@ -957,9 +1146,9 @@ check_for_fd_input (GIOChannel *source,
 		    GIOCondition condition,
 		    gpointer data)
 {
-  unsigned char buffer[1024];
+  unsigned char buffer[65536];
   int fd = g_io_channel_unix_get_fd (source);
-  int count, i;
+  int count;
 
 #ifdef DEBUG
   if (bootstrap)
@@ -990,68 +1179,16 @@ check_for_fd_input (GIOChannel *source,
    * We don't have to deal with the header.
    * That's done for us, upstream.
    */
-  
-  for (i=0; i<count; i++)
-    {
 
-#if 0
-      g_print ("(%d/%d) Received %02x in state %d\n",
-	       i+1, count,
-	       buffer[i], fd_read_state);
-#endif
+  if (!fd_parser)
+    fd_parser = block_parser_new (NULL,
+				  NULL,
+				  fd_block_received,
+				  NULL);
 
-      switch (fd_read_state)
-	{
-	case STATE_START:
-	  /* Seen header; read channel */
-	  switch (fd_read_through)
-	    {
-	    case 0:
-	      fd_read_channel = buffer[i];
-	      fd_read_through = 1;
-	      break;
-
-	    case 1:
-	      fd_read_channel |= buffer[i]*256;
-	      fd_read_through = 0;
-	      fd_read_state = STATE_SEEN_CHANNEL;
-	      break;
-	    }
-	  break;
-
-	case STATE_SEEN_CHANNEL:
-	  /* Seen channel; read length */
-	  switch (fd_read_through)
-	    {
-	    case 0:
-	      fd_read_length = buffer[i];
-	      fd_read_through = 1;
-	      break;
-
-	    case 1:
-	      fd_read_length |= buffer[i]*256;
-	      fd_read_buffer = g_malloc (fd_read_length);
-	      fd_read_through = 0;
-	      fd_read_state = STATE_SEEN_LENGTH;
-	      break;
-	    }
-	  break;
-
-	case STATE_SEEN_LENGTH:
-	  /* Seen length; read data */
-	  fd_read_buffer[fd_read_through] = buffer[i];
-	  fd_read_through++;
-	  if (fd_read_through==fd_read_length)
-	    {
-	      handle_xzibit_message (fd_read_channel,
-				     fd_read_buffer,
-				     fd_read_length);
-	      g_free (fd_read_buffer);
-	      fd_read_through = 0;
-	      fd_read_state = STATE_START;
-	    }
-	}
-      
+  if (!block_parser_feed (fd_parser, buffer, count))
+    {
+      g_error ("The other side sent a block longer than we allow.");
     }
 
   return TRUE;